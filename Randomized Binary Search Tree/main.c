@@ -8,20 +8,395 @@ that maintains its randomness property with each insertion, to achieve balance w
 #include <stdlib.h>
 #include <time.h>
 #include <stdbool.h> // To use boolean datatypes
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
-// Structure for representing the nodes in a BST.
+// Subtrees with at least this many nodes generate their shape on a separate thread when rebuilt.
+#define SHAPE_THREAD_CUTOFF 65536
+
+// Number of independent generator lanes, and number of random numbers produced per refill.
+#define RNG_LANES 8
+#define RNG_BUFFER_SIZE 256
+
+// Rebuilds of subtrees with at least this many nodes draw their random numbers from a vectorized buffer.
+#define RNG_BUFFER_CUTOFF 256
+
+// Number of nodes in each chunk of a node arena.
+#define ARENA_CHUNK_NODES 4096
+
+// Fields a tree can add to its nodes (see TreeNode). A node with NODE_HASHED is followed by its subtree hash, 
+// then a node with NODE_LINKED by its NodeLinks.
+#define NODE_HASHED 1
+#define NODE_LINKED 2
+
+// Subtrees with at least this many nodes are freed on their own thread by freeRBSTAsync().
+#define PARALLEL_FREE_CUTOFF 65536
+
+// Subtrees with at least this many nodes split a batch delete into two threads.
+#define PARALLEL_DELETE_CUTOFF 65536
+
+// Key ranges with at least this many keys split a build (see buildRBST()) into two threads.
+#define PARALLEL_BUILD_CUTOFF 65536
+
+// Parallel traversals split the tree into about this many tasks per worker, of at least the grain size.
+#define PARALLEL_TASKS_PER_WORKER 8
+#define PARALLEL_TRAVERSAL_GRAIN 4096
+
+// Key ranges with at most this many keys in both trees are compared key by key by diffRBST().
+#define DIFF_LEAF_KEYS 16
+
+// Trees with at most this many keys store them inline in the RBST. Trees built from nodes go back to 
+// inline storage once deletions leave them with half as many keys.
+#define SMALL_TREE_KEYS 32
+
+// Subtrees with at least this many nodes are rebuilt on a helper thread in background rebuild mode. Once the 
+// subtree is rebuilt, inserts into it are throttled while this many buffered nodes are left for the helper thread.
+#define BACKGROUND_REBUILD_CUTOFF 262144
+#define BACKGROUND_REBUILD_BACKLOG 1024
+
+// Background rebuild cutoffs set by autoTuneRBST() keep a rebuild on the writer's thread to at most about this many seconds.
+#define BACKGROUND_REBUILD_STALL 0.005
+
+/*
+Thresholds that depend on the host's processors and caches. They start at the defaults above, and 
+autoTuneRBST() can calibrate them on the running machine or load them from a tuning file.
+*/
+typedef struct RBSTTuning {
+    int shapeThreadCutoff; // See SHAPE_THREAD_CUTOFF.
+    int parallelFreeCutoff; // See PARALLEL_FREE_CUTOFF.
+    int parallelDeleteCutoff; // See PARALLEL_DELETE_CUTOFF.
+    int parallelBuildCutoff; // See PARALLEL_BUILD_CUTOFF.
+    int traversalGrain; // See PARALLEL_TRAVERSAL_GRAIN.
+    int backgroundRebuildCutoff; // See BACKGROUND_REBUILD_CUTOFF.
+} RBSTTuning;
+
+RBSTTuning tuning = { SHAPE_THREAD_CUTOFF, PARALLEL_FREE_CUTOFF, PARALLEL_DELETE_CUTOFF, PARALLEL_BUILD_CUTOFF, 
+                      PARALLEL_TRAVERSAL_GRAIN, BACKGROUND_REBUILD_CUTOFF };
+
+/* 
+Structure for a buffered xoshiro256++ generator with RNG_LANES independent lanes. The state is 
+stored lane-major, so one step is a handful of loops over RNG_LANES words which the compiler 
+turns into SIMD code (two AVX2 registers per state word). xoshiro256++ only uses additions, 
+shifts and xors, so no 64-bit vector multiply is needed. It takes a few KB, so it lives on the 
+stack of a large rebuild, which attaches it to the tree's generator (see attachRNGBuffer()).
+*/
+typedef struct RNGBuffer {
+    uint64_t state[4][RNG_LANES];
+    uint64_t values[RNG_BUFFER_SIZE]; // Random numbers that have not been handed out yet.
+    int next; // Index of the next unused value, RNG_BUFFER_SIZE if the buffer is empty.
+} RNGBuffer;
+
+// Structure for the generator of a tree: a scalar xoshiro256++, which hands out the numbers of a buffer while one is attached.
+typedef struct RNG {
+    uint64_t state[4];
+    RNGBuffer* buffer; // The buffer of the running rebuild, or NULL.
+} RNG;
+
+/*
+Structure for representing the nodes in a BST. Trees that opt into more per-node state allocate it 
+right after the node, as given by its extras: every node of a tree has the same extras.
+*/
 typedef struct TreeNode {
     int key;
     int size; // Number of nodes in its subtree.
+    unsigned int hits; // Number of successful searches that ended at this node (self-adjusting mode).
+    unsigned int extras; // The NODE_* fields that follow the node.
     struct TreeNode* left;
     struct TreeNode* right;
 } TreeNode;
 
+// Structure for the fields of a node with NODE_LINKED, which handles, iterators and background rebuilds need.
+typedef struct NodeLinks {
+    struct TreeNode* parent; // NULL for the root.
+    long long value; // Data attached to the key, which can be updated through a handle (see insertHandleRBST()).
+} NodeLinks;
+
+// Structure for a chunk of ARENA_CHUNK_NODES nodes handed out by a node arena.
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    uint64_t nodes[]; // The nodes, of the arena's nodeBytes each.
+} ArenaChunk;
+
+/* 
+Structure for an arena that allocates the nodes of one tree from large chunks. Nodes released 
+by rebuilds are kept on a free list and reused, and the whole tree is released by freeing 
+the chunks, without visiting the nodes.
+*/
+typedef struct NodeArena {
+    ArenaChunk* chunks; // The most recently allocated chunk, which links to the older ones.
+    size_t nodeBytes; // Size of a node with the extras of the tree.
+    int used; // Number of nodes handed out from the most recent chunk.
+    TreeNode* freeList; // Released nodes, linked through their right pointers.
+} NodeArena;
+
+/*
+Structure for a task started by an executor's fork, to be waited for with its join. It lives on the stack 
+of the thread that forks, which joins it before returning.
+*/
+typedef struct RBSTFork {
+    void* (*fn)(void* arg);
+    void* arg;
+    pthread_t thread; // The thread running the task, with the default executor.
+    struct CallbackWork* work; // The submitted work, with a callback executor.
+} RBSTFork;
+
+/*
+Structure for an executor, which runs the parallel parts of a tree's algorithms: batches of independent 
+tasks (parallel traversals) and fork-join splits (builds, batch deletes, parallel frees, shape generation). 
+A tree without an executor uses the shared work pool for batches and a new thread for every fork. 
+See serialExecutor and makeCallbackExecutor() for the others.
+*/
+typedef struct RBSTExecutor {
+    // Runs runTask(ctx, task) for every task in [0, numTasks), possibly at the same time, and returns once all have finished.
+    void (*runTasks)(struct RBSTExecutor* executor, int numTasks, void (*runTask)(void* ctx, int task), void* ctx);
+    // Starts fork->fn(fork->arg), possibly on another thread. Returns false if it is not started, so the caller runs it.
+    bool (*fork)(struct RBSTExecutor* executor, RBSTFork* fork);
+    // Waits for a task started by fork.
+    void (*join)(struct RBSTExecutor* executor, RBSTFork* fork);
+    int numThreads; // Number of tasks it runs at once, which sets how many ways the fork-join algorithms split.
+    void (*submit)(void* pool, void (*fn)(void* arg), void* arg); // The thread pool of a callback executor.
+    void* pool;
+} RBSTExecutor;
+
 // Structure for representing a BST.
 typedef struct RBST {
     TreeNode* root;
+    RNG rng; // Random numbers for insertion, rebuild and promotion decisions.
+    NodeArena* arena; // The arena the nodes are allocated from, or NULL to use malloc().
+    unsigned int nodeExtras; // The extras of the tree's nodes: NODE_HASHED (see useHashingRBST()) and NODE_LINKED.
+    bool selfAdjusting; // If true, frequently searched keys are promoted toward the root.
+    bool shapeFirstRebuild; // If true, rebuilds generate the random shape first and then fill in the keys.
+    bool stableNodes; // If true, rebuilds relink the existing nodes, so pointers to nodes stay valid.
+    bool backgroundRebuild; // If true, large rebuilds run on a helper thread (see useBackgroundRebuildRBST()).
+    struct BackgroundRebuild* rebuild; // The rebuild running in the background, or NULL.
+    RBSTExecutor* executor; // Runs the parallel algorithms on the tree, NULL for the shared work pool.
+    bool isSmall; // If true, the tree has no nodes and its keys are in smallKeys[].
+    int numSmallKeys;
+    int smallKeys[SMALL_TREE_KEYS]; // The keys of a small tree, in sorted order.
 } RBST; 
 
+// Rotates the 64-bit word left by k bits.
+static inline uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// splitmix64, used for expanding a single seed into the generator state.
+uint64_t splitMix64(uint64_t* seed) {
+    uint64_t z = (*seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    
+    return z ^ (z >> 31);
+}
+
+// Seeds the generator from the seed, with no buffer attached.
+void seedRNG(RNG* rng, uint64_t seed) {
+    for (int word = 0; word < 4; word++) {
+        rng->state[word] = splitMix64(&seed);
+    }
+    rng->buffer = NULL;
+}
+
+// Seeds every lane of the buffer's generator from the seed, and empties the buffer.
+void seedRNGBuffer(RNGBuffer* rng, uint64_t seed) {
+    for (int word = 0; word < 4; word++) {
+        for (int lane = 0; lane < RNG_LANES; lane++) {
+            rng->state[word][lane] = splitMix64(&seed);
+        }
+    }
+    rng->next = RNG_BUFFER_SIZE;
+}
+
+/*
+Refills the buffer with RNG_BUFFER_SIZE numbers, RNG_LANES at a time. Every loop runs over the 
+lanes with no dependencies between them, so it is vectorized.
+*/
+void refillRNG(RNGBuffer* rng) {
+    uint64_t s0[RNG_LANES], s1[RNG_LANES], s2[RNG_LANES], s3[RNG_LANES];
+    
+    // Work on local copies of the state, so the compiler knows they do not alias the buffer.
+    for (int lane = 0; lane < RNG_LANES; lane++) {
+        s0[lane] = rng->state[0][lane];
+        s1[lane] = rng->state[1][lane];
+        s2[lane] = rng->state[2][lane];
+        s3[lane] = rng->state[3][lane];
+    }
+    
+    for (int i = 0; i < RNG_BUFFER_SIZE; i += RNG_LANES) {
+        // Keep the lane loop rolled so it is vectorized instead of being unrolled into scalar code.
+        #pragma GCC unroll 1
+        for (int lane = 0; lane < RNG_LANES; lane++) {
+            uint64_t result = rotl64(s0[lane] + s3[lane], 23) + s0[lane];
+            uint64_t t = s1[lane] << 17;
+            
+            s2[lane] ^= s0[lane];
+            s3[lane] ^= s1[lane];
+            s1[lane] ^= s2[lane];
+            s0[lane] ^= s3[lane];
+            s2[lane] ^= t;
+            s3[lane] = rotl64(s3[lane], 45);
+            
+            rng->values[i + lane] = result;
+        }
+    }
+    
+    for (int lane = 0; lane < RNG_LANES; lane++) {
+        rng->state[0][lane] = s0[lane];
+        rng->state[1][lane] = s1[lane];
+        rng->state[2][lane] = s2[lane];
+        rng->state[3][lane] = s3[lane];
+    }
+    rng->next = 0;
+}
+
+// Returns the next 64 random bits, from the attached buffer (refilled when it runs out) if there is one.
+static inline uint64_t nextRandom(RNG* rng) {
+    RNGBuffer* buffer = rng->buffer;
+    
+    if (buffer != NULL) {
+        if (buffer->next == RNG_BUFFER_SIZE) {
+            refillRNG(buffer);
+        }
+        return buffer->values[(buffer->next)++];
+    }
+    
+    uint64_t* s = rng->state;
+    uint64_t result = rotl64(s[0] + s[3], 23) + s[0];
+    uint64_t t = s[1] << 17;
+    
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    
+    return result;
+}
+
+/*
+Attaches the buffer to the generator for a rebuild of 'size' nodes, which draws about one number per node, 
+if it is large enough to pay for filling the buffer and no buffer is attached yet. The buffer is seeded from 
+the generator. Returns true if it was attached, in which case detachRNGBuffer() has to be called before the 
+buffer goes out of scope.
+*/
+bool attachRNGBuffer(RNG* rng, RNGBuffer* buffer, int size) {
+    if (rng->buffer != NULL || size < RNG_BUFFER_CUTOFF) {
+        return false;
+    }
+    
+    seedRNGBuffer(buffer, nextRandom(rng));
+    rng->buffer = buffer;
+    
+    return true;
+}
+
+// Detaches the buffer from the generator, if attachRNGBuffer() attached it.
+void detachRNGBuffer(RNG* rng, bool isAttached) {
+    if (isAttached) {
+        rng->buffer = NULL;
+    }
+}
+
+/*
+Maps the random 32 bits x to an unbiased integer in [0, range) with Lemire's multiply-shift method. 
+The (rare) values that would make the result biased are rejected and redrawn from the generator.
+*/
+uint32_t boundedRandom(RNG* rng, uint32_t x, uint32_t range) {
+    uint64_t m = (uint64_t) x * range;
+    uint32_t low = (uint32_t) m;
+    
+    if (low < range) {
+        uint32_t threshold = (uint32_t) (-range) % range;
+        while (low < threshold) {
+            x = (uint32_t) (nextRandom(rng) >> 32);
+            m = (uint64_t) x * range;
+            low = (uint32_t) m;
+        }
+    }
+    
+    return (uint32_t) (m >> 32);
+}
+
+// Returns an unbiased random integer in [0, range).
+static inline uint32_t randomBelow(RNG* rng, uint32_t range) {
+    return boundedRandom(rng, (uint32_t) (nextRandom(rng) >> 32), range);
+}
+
+/*
+Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"). 
+The four 32-bit outputs are a pure function of the 128-bit counter and the 64-bit key, so numbers can 
+be drawn for any position in any order, on any thread, without a generator state.
+*/
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+void philox4x32(const uint32_t counter[4], uint64_t key, uint32_t out[4]) {
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = (uint32_t) key;
+    uint32_t k1 = (uint32_t) (key >> 32);
+    
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+        
+        c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t) p1;
+        c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t) p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/*
+Returns an unbiased random integer in [0, range) that only depends on the seed and the position (a, b), 
+with Lemire's method on the outputs of philox4x32(). Rejected outputs move on to the next output, and 
+then to the next counter.
+*/
+uint32_t counterRandomBelow(uint64_t seed, uint32_t a, uint32_t b, uint32_t range) {
+    uint32_t counter[4] = { a, b, 0, 0 };
+    uint32_t out[4];
+    
+    while (true) {
+        philox4x32(counter, seed, out);
+        for (int i = 0; i < 4; i++) {
+            uint64_t m = (uint64_t) out[i] * range;
+            
+            if ((uint32_t) m >= range || (uint32_t) m >= (uint32_t) (-range) % range) {
+                return (uint32_t) (m >> 32);
+            }
+        }
+        (counter[2])++;
+    }
+}
+
 /* For computing the "height" of a tree -- the number of nodes along 
 the longest path from the root node down to the farthest leaf node.*/
 int height(TreeNode* node)
@@ -43,19 +418,194 @@ int height(TreeNode* node)
     }
 }
 
+/* For fingerprinting the shape of a tree: a hash of the key and size of every node in preorder, 
+so two trees have the same checksum (with high probability) only if they are identical.*/
+uint64_t shapeChecksum(TreeNode* node)
+{
+    uint64_t checksum = 0;
+    
+    while (node != NULL) {
+        checksum = (checksum ^ (uint32_t) node->key ^ ((uint64_t) node->size << 32)) * 0x100000001B3ULL;
+        checksum = rotl64(checksum, 17) ^ shapeChecksum(node->left);
+        node = node->right;
+    }
+    
+    return checksum;
+}
+
+/*
+Hash of a single key for the subtree hashes. The hash of a set of keys is the sum of their hashes 
+(modulo 2^64), so it can be updated by adding and subtracting, and it does not depend on the shape.
+*/
+static inline uint64_t keyHash(int key) {
+    uint64_t seed = (uint32_t) key;
+    
+    return splitMix64(&seed);
+}
+
+// Returns the number of bytes of a node with the extras.
+static inline size_t nodeBytes(unsigned int extras) {
+    return sizeof(TreeNode) + ((extras & NODE_HASHED) ? sizeof(uint64_t) : 0) + ((extras & NODE_LINKED) ? sizeof(NodeLinks) : 0);
+}
+
+// Returns the subtree hash of a node with NODE_HASHED: the sum of keyHash() over the keys in its subtree.
+static inline uint64_t* nodeHash(TreeNode* node) {
+    return (uint64_t*) (node + 1);
+}
+
+// Returns the parent pointer and value of a node with NODE_LINKED.
+static inline NodeLinks* nodeLinks(TreeNode* node) {
+    return (NodeLinks*) ((unsigned char*) (node + 1) + ((node->extras & NODE_HASHED) ? sizeof(uint64_t) : 0));
+}
+
+// Returns the parent of a node with NODE_LINKED, or NULL for the root.
+static inline TreeNode* nodeParent(TreeNode* node) {
+    return nodeLinks(node)->parent;
+}
+
+// Sets the parent of the node, if it keeps one.
+static inline void setParent(TreeNode* node, TreeNode* parent) {
+    if (node->extras & NODE_LINKED) {
+        nodeLinks(node)->parent = parent;
+    }
+}
+
+// Returns the value of the node of a handle (see insertHandleRBST()), which can be read and updated in place.
+static inline long long* handleValue(TreeNode* handle) {
+    return &nodeLinks(handle)->value;
+}
+
 // Initializes an RBST struct to an empty tree.
 RBST* initRBST() {
     RBST* bst = (RBST*) malloc(sizeof(RBST));
     bst->root = NULL;
+    bst->arena = NULL;
+    bst->nodeExtras = 0;
+    // Seed from rand(), so srand() still makes a run reproducible.
+    seedRNG(&bst->rng, ((uint64_t) rand() << 32) ^ (uint64_t) rand());
+    bst->selfAdjusting = false;
+    bst->shapeFirstRebuild = false;
+    bst->stableNodes = false;
+    bst->backgroundRebuild = false;
+    bst->rebuild = NULL;
+    bst->executor = NULL;
+    bst->isSmall = true;
+    bst->numSmallKeys = 0;
 
     return bst;
 }
 
-// Function for creating nodes with the given key. 
+/*
+Initializes a scratch RBST in the caller's storage: an empty tree seeded with the seed, which shares the 
+rebuild mode, node mode, node extras and executor of the model tree (or uses the defaults if the model is NULL). Work 
+that runs on a subtree with its own generator, such as a helper thread, goes through one. It allocates 
+with malloc(), and is never small, self-adjusting or rebuilt in the background.
+*/
+void initScratchRBST(RBST* scratch, const RBST* model, uint64_t seed) {
+    seedRNG(&scratch->rng, seed);
+    scratch->root = NULL;
+    scratch->arena = NULL;
+    scratch->nodeExtras = (model != NULL) ? model->nodeExtras : 0;
+    scratch->selfAdjusting = false;
+    scratch->shapeFirstRebuild = (model != NULL) && model->shapeFirstRebuild;
+    scratch->stableNodes = (model != NULL) && model->stableNodes;
+    scratch->backgroundRebuild = false;
+    scratch->rebuild = NULL;
+    scratch->executor = (model != NULL) ? model->executor : NULL;
+    scratch->isSmall = false;
+    scratch->numSmallKeys = 0;
+}
+
+// Returns a new, empty arena for nodes of nodeBytes each, or NULL if malloc fails.
+NodeArena* createArena(size_t nodeBytes) {
+    NodeArena* arena = (NodeArena*) malloc(sizeof(NodeArena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    
+    arena->chunks = NULL;
+    arena->nodeBytes = nodeBytes;
+    arena->used = ARENA_CHUNK_NODES;
+    arena->freeList = NULL;
+    
+    return arena;
+}
+
+/*
+Makes the tree allocate its nodes from an arena. Has to be called while the tree is still empty, 
+so that every node belongs to the arena. Returns false if the tree is not empty or malloc fails.
+*/
+bool useArenaRBST(RBST* bst) {
+    if (bst->root != NULL || bst->arena != NULL) {
+        return false;
+    }
+    
+    bst->arena = createArena(nodeBytes(bst->nodeExtras));
+    
+    return bst->arena != NULL;
+}
+
+// Returns uninitialized memory for a node from the arena, reusing released nodes first.
+TreeNode* arenaAlloc(NodeArena* arena) {
+    TreeNode* node = arena->freeList;
+    
+    if (node != NULL) {
+        arena->freeList = node->right;
+        return node;
+    }
+    
+    // Start a new chunk once the current one is used up.
+    if (arena->used == ARENA_CHUNK_NODES) {
+        ArenaChunk* chunk = (ArenaChunk*) malloc(sizeof(ArenaChunk) + ARENA_CHUNK_NODES * arena->nodeBytes);
+        
+        // Check if memory allocation failed.
+        if (chunk == NULL) {
+            exit(0);
+        }
+        
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->used = 0;
+    }
+    
+    return (TreeNode*) ((unsigned char*) arena->chunks->nodes + (size_t) (arena->used)++ * arena->nodeBytes);
+}
+
+// Releases a single node of the tree, to the arena's free list if the tree uses one.
+void releaseNode(RBST* bst, TreeNode* node) {
+    if (bst->arena != NULL) {
+        node->right = bst->arena->freeList;
+        bst->arena->freeList = node;
+    }
+    else {
+        free(node);
+    }
+}
+
+// Frees every chunk of the arena, and with it every node of the tree, in O(N / ARENA_CHUNK_NODES).
+void freeArena(NodeArena* arena) {
+    ArenaChunk* chunk = arena->chunks;
+    
+    while (chunk != NULL) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+// Function for creating nodes of the tree with the given key, with the tree's node extras. 
 // Defaults the size to 1, and the left and right pointers to NULL. 
-// Returns a TreeNode* with the key or NULL if malloc fails. 
-TreeNode* createNode(int key) {
-    TreeNode* newNode = (TreeNode*) malloc(sizeof(TreeNode));
+// Exits if malloc fails. 
+TreeNode* createNode(RBST* bst, int key) {
+    TreeNode* newNode;
+    
+    if (bst->arena != NULL) {
+        newNode = arenaAlloc(bst->arena);
+    }
+    else {
+        newNode = (TreeNode*) malloc(nodeBytes(bst->nodeExtras));
+    }
     
     // Check if memory allocation failed.
     if (newNode == NULL) {
@@ -64,292 +614,8081 @@ TreeNode* createNode(int key) {
     
     newNode->key = key;
     newNode->size = 1; 
+    newNode->hits = 0;
+    newNode->extras = bst->nodeExtras;
     newNode->left = NULL;
     newNode->right = NULL;
+    if (bst->nodeExtras & NODE_HASHED) {
+        *nodeHash(newNode) = keyHash(key);
+    }
+    if (bst->nodeExtras & NODE_LINKED) {
+        nodeLinks(newNode)->parent = NULL;
+        nodeLinks(newNode)->value = 0;
+    }
     
     return newNode;
 }
 
-/* 
-Helper function for recursively rebuilding a randomized BST from a sorted array 
-withthe newNode at the root. Left and right subtrees are created recursively from
-a random pivot, where 'first' and 'last' are the current bounds of the subtree.
+// Returns the size of the subtree rooted at the node, or 0 for an empty subtree.
+int nodeSize(TreeNode* node) {
+    if (node == NULL) {
+        return 0;
+    }
 
-Time Complexity: O(N) (preorder traversal with O(1) work done per node)
+    return node->size;
+}
+
+// Returns the hash of the keys in the subtree rooted at a node with NODE_HASHED, or 0 for an empty subtree.
+uint64_t subtreeHash(TreeNode* node) {
+    if (node == NULL) {
+        return 0;
+    }
+    
+    return *nodeHash(node);
+}
+
+// Makes the node the parent of its children, if it keeps parents.
+void adoptChildren(TreeNode* node) {
+    if (!(node->extras & NODE_LINKED)) {
+        return;
+    }
+    if (node->left != NULL) {
+        nodeLinks(node->left)->parent = node;
+    }
+    if (node->right != NULL) {
+        nodeLinks(node->right)->parent = node;
+    }
+}
+
+// Recomputes the size (and hash) of the node from its children, after they have changed, and adopts them.
+void updateNode(TreeNode* node) {
+    node->size = 1 + nodeSize(node->left) + nodeSize(node->right);
+    if (node->extras & NODE_HASHED) {
+        *nodeHash(node) = keyHash(node->key) + subtreeHash(node->left) + subtreeHash(node->right);
+    }
+    adoptChildren(node);
+}
+
+// Makes the node the root of the tree.
+void setRoot(RBST* bst, TreeNode* root) {
+    bst->root = root;
+    if (root != NULL) {
+        setParent(root, NULL);
+    }
+}
+
+// Runs the tasks one after the other on the calling thread.
+void serialRunTasks(RBSTExecutor* executor, int numTasks, void (*runTask)(void* ctx, int task), void* ctx) {
+    (void) executor;
+    for (int task = 0; task < numTasks; task++) {
+        runTask(ctx, task);
+    }
+}
+
+// Never starts a forked task, so the caller runs it.
+bool serialFork(RBSTExecutor* executor, RBSTFork* fork) {
+    (void) executor;
+    (void) fork;
+    
+    return false;
+}
+
+// Executor that runs everything on the calling thread, e.g. for trees used from inside another parallel job.
+RBSTExecutor serialExecutor = { serialRunTasks, serialFork, NULL, 1, NULL, NULL };
+
+/*
+Structure for tasks handed to the thread pool of a callback executor. The submitted helpers and the 
+waiting thread claim tasks from the same counter, so the waiting thread runs whatever the pool has not 
+started yet and never waits for the pool to get to it. Helpers that start late find nothing to claim, 
+so the structure is reference counted and freed by whichever lets go of it last.
 */
-TreeNode* makeRBST(int bstArr[], int first, int last, int newNodeIndex, bool isAdded, int* nodesVisited) {
-    // Check if the entire array has been scanned yet.
-    if(last < first) {
-        return NULL;
+typedef struct CallbackWork {
+    pthread_mutex_t lock;
+    pthread_cond_t done; // Signaled when every task has finished.
+    int refs; // Number of submitted helpers that have not returned, plus one for the waiting thread.
+    int next; // The next task to claim, taken with atomic increments.
+    int numTasks;
+    int finished; // Number of finished tasks, guarded by lock.
+    void (*runTask)(void* ctx, int task);
+    void* ctx;
+} CallbackWork;
+
+// Runs tasks of the work until there are none left to claim.
+void runCallbackTasks(CallbackWork* work) {
+    int task;
+    int count = 0;
+    
+    while ((task = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->numTasks) {
+        work->runTask(work->ctx, task);
+        count++;
+    }
+    
+    if (count > 0) {
+        pthread_mutex_lock(&work->lock);
+        work->finished += count;
+        if (work->finished == work->numTasks) {
+            pthread_cond_broadcast(&work->done);
+        }
+        pthread_mutex_unlock(&work->lock);
+    }
+}
+
+// Drops a reference to the work, and frees it with the last one.
+void releaseCallbackWork(CallbackWork* work) {
+    pthread_mutex_lock(&work->lock);
+    bool isLast = (--(work->refs) == 0);
+    pthread_mutex_unlock(&work->lock);
+    
+    if (isLast) {
+        pthread_mutex_destroy(&work->lock);
+        pthread_cond_destroy(&work->done);
+        free(work);
+    }
+}
+
+// Runs on a thread of the pool: claims tasks, then lets go of the work.
+void callbackHelper(void* arg) {
+    runCallbackTasks((CallbackWork*) arg);
+    releaseCallbackWork((CallbackWork*) arg);
+}
+
+// Submits numHelpers helpers for the tasks to the executor's pool, and returns the work to finish.
+CallbackWork* startCallbackWork(RBSTExecutor* executor, int numTasks, void (*runTask)(void* ctx, int task), void* ctx, 
+                                int numHelpers) {
+    CallbackWork* work = (CallbackWork*) malloc(sizeof(CallbackWork));
+    
+    // Check if memory allocation failed.
+    if (work == NULL) {
+        exit(0);
+    }
+    
+    pthread_mutex_init(&work->lock, NULL);
+    pthread_cond_init(&work->done, NULL);
+    work->refs = numHelpers + 1;
+    work->next = 0;
+    work->numTasks = numTasks;
+    work->finished = 0;
+    work->runTask = runTask;
+    work->ctx = ctx;
+    
+    for (int i = 0; i < numHelpers; i++) {
+        executor->submit(executor->pool, callbackHelper, work);
+    }
+    
+    return work;
+}
+
+// Runs the tasks nobody has claimed yet, waits for the others, and lets go of the work.
+void finishCallbackWork(CallbackWork* work) {
+    runCallbackTasks(work);
+    
+    pthread_mutex_lock(&work->lock);
+    while (work->finished < work->numTasks) {
+        pthread_cond_wait(&work->done, &work->lock);
+    }
+    pthread_mutex_unlock(&work->lock);
+    
+    releaseCallbackWork(work);
+}
+
+// Runs the tasks on the pool with up to numThreads - 1 helpers, and on the calling thread.
+void callbackRunTasks(RBSTExecutor* executor, int numTasks, void (*runTask)(void* ctx, int task), void* ctx) {
+    int numHelpers = ((numTasks < executor->numThreads) ? numTasks : executor->numThreads) - 1;
+    
+    if (numTasks <= 0) {
+        return;
+    }
+    
+    finishCallbackWork(startCallbackWork(executor, numTasks, runTask, ctx, numHelpers));
+}
+
+// Runs a forked task as the single task of its work.
+void runForkTask(void* ctx, int task) {
+    RBSTFork* fork = (RBSTFork*) ctx;
+    (void) task;
+    
+    fork->fn(fork->arg);
+}
+
+// Submits the forked task to the pool. The join runs it itself if the pool has not started it.
+bool callbackFork(RBSTExecutor* executor, RBSTFork* fork) {
+    fork->work = startCallbackWork(executor, 1, runForkTask, fork, 1);
+    
+    return true;
+}
+
+void callbackJoin(RBSTExecutor* executor, RBSTFork* fork) {
+    (void) executor;
+    finishCallbackWork(fork->work);
+}
+
+/*
+Returns an executor that runs the tree's parallel work on an existing thread pool, through a function 
+that queues fn(arg) on it, so the tree does not start threads of its own next to the pool's. numThreads 
+is the number of tasks the pool runs at once. A thread waiting for tasks runs the ones the pool has not 
+started, so the pool never has to make progress for a waiting thread to finish. Free it with free().
+*/
+RBSTExecutor* makeCallbackExecutor(void (*submit)(void* pool, void (*fn)(void* arg), void* arg), void* pool, int numThreads) {
+    RBSTExecutor* executor = (RBSTExecutor*) malloc(sizeof(RBSTExecutor));
+    
+    // Check if memory allocation failed.
+    if (executor == NULL) {
+        exit(0);
+    }
+    
+    executor->runTasks = callbackRunTasks;
+    executor->fork = callbackFork;
+    executor->join = callbackJoin;
+    executor->numThreads = (numThreads > 1) ? numThreads : 1;
+    executor->submit = submit;
+    executor->pool = pool;
+    
+    return executor;
+}
+
+// Makes the tree run its parallel algorithms on the executor, or on the shared work pool if it is NULL.
+void setExecutorRBST(RBST* bst, RBSTExecutor* executor) {
+    bst->executor = executor;
+}
+
+/*
+Starts fn(arg) as a forked task of the executor, on a new thread if the executor is NULL. Returns false 
+if it was not started, in which case the caller runs it.
+*/
+bool forkJob(RBSTExecutor* executor, RBSTFork* fork, void* (*fn)(void* arg), void* arg) {
+    fork->fn = fn;
+    fork->arg = arg;
+    
+    if (executor == NULL) {
+        return pthread_create(&fork->thread, NULL, fn, arg) == 0;
+    }
+    
+    return executor->fork(executor, fork);
+}
+
+// Waits for a task started by forkJob().
+void joinJob(RBSTExecutor* executor, RBSTFork* fork) {
+    if (executor == NULL) {
+        pthread_join(fork->thread, NULL);
+    }
+    else {
+        executor->join(executor, fork);
+    }
+}
+
+// Returns the number of levels fork-join algorithms split at, for about one task per thread of the executor.
+int forkDepth(RBSTExecutor* executor) {
+    long numThreads = (executor == NULL) ? sysconf(_SC_NPROCESSORS_ONLN) : executor->numThreads;
+    int depth = 0;
+    
+    for (; numThreads > 1; numThreads /= 2) {
+        depth++;
+    }
+    
+    return depth;
+}
+
+/* 
+Helper function for recursively rebuilding a randomized BST from a sorted array 
+withthe newNode at the root. Left and right subtrees are created recursively from
+a random pivot, where 'first' and 'last' are the current bounds of the subtree.
+
+Time Complexity: O(N) (preorder traversal with O(1) work done per node)
+*/
+TreeNode* makeRBST(RBST* bst, int bstArr[], int first, int last, int newNodeIndex, bool isAdded, int* nodesVisited) {
+    // Check if the entire array has been scanned yet.
+    if(last < first) {
+        return NULL;
+    }
+    
+    TreeNode* newNode;
+    (*nodesVisited)++;
+    
+    // Add the newNode (the key to insert) as to the root node.
+    if (!isAdded) { 
+        newNode = createNode(bst, bstArr[newNodeIndex]);
+        isAdded = true;
+        
+        newNode->left = makeRBST(bst, bstArr, first, newNodeIndex - 1, newNodeIndex, isAdded, nodesVisited);
+        newNode->right = makeRBST(bst, bstArr, newNodeIndex + 1, last, newNodeIndex, isAdded, nodesVisited);
+    }
+    // Randomly construct the rest of the subree from the array.
+    else {
+        // Generate a random index between first and last index.
+        int index = first + (int) randomBelow(&bst->rng, (uint32_t) (last - first + 1));
+        
+        newNode = createNode(bst, bstArr[index]);
+        newNode->left = makeRBST(bst, bstArr, first, index - 1, newNodeIndex, isAdded, nodesVisited);
+        newNode->right = makeRBST(bst, bstArr, index + 1, last, newNodeIndex, isAdded, nodesVisited);
+    }
+    
+    // Update the size (and hash) of the subtree rooted at the current node.
+    updateNode(newNode);
+    
+    return newNode;
+}
+
+// Arguments of a build of the keys in [first, last], so that it can be run on its own thread.
+typedef struct BuildJob {
+    RBST* bst;
+    const int* keys; // The keys in sorted order.
+    int first;
+    int last;
+    uint64_t seed;
+    int depth; // Number of levels at which the job may still split into two threads.
+    TreeNode* root; // The built subtree.
+} BuildJob;
+
+/*
+Builds a random BST over the keys in [first, last], like makeRBST(). The root is drawn with 
+counterRandomBelow() at the position (first, last), which only this subtree has, so the shape is the 
+same whichever thread builds a subtree and in whichever order. Ranges of at least 
+tuning.parallelBuildCutoff keys fork their left subtree on the tree's executor while depth allows.
+Takes and returns a void* so it can be passed to forkJob().
+
+Time Complexity: O(N) (preorder traversal with O(1) work done per node)
+*/
+void* buildJob(void* arg) {
+    BuildJob* job = (BuildJob*) arg;
+    
+    if (job->last < job->first) {
+        job->root = NULL;
+        return NULL;
+    }
+    
+    uint32_t range = (uint32_t) (job->last - job->first + 1);
+    int index = job->first + (int) counterRandomBelow(job->seed, (uint32_t) job->first, (uint32_t) job->last, range);
+    TreeNode* newNode = createNode(job->bst, job->keys[index]);
+    BuildJob left = { job->bst, job->keys, job->first, index - 1, job->seed, job->depth - 1, NULL };
+    BuildJob right = { job->bst, job->keys, index + 1, job->last, job->seed, job->depth - 1, NULL };
+    bool isThreaded = false;
+    RBSTFork fork;
+    
+    if (job->depth > 0 && range >= (uint32_t) tuning.parallelBuildCutoff) {
+        isThreaded = forkJob(job->bst->executor, &fork, buildJob, &left);
+    }
+    if (!isThreaded) {
+        buildJob(&left);
+    }
+    buildJob(&right);
+    if (isThreaded) {
+        joinJob(job->bst->executor, &fork);
+    }
+    
+    newNode->left = left.root;
+    newNode->right = right.root;
+    updateNode(newNode);
+    job->root = newNode;
+    
+    return NULL;
+}
+
+/*
+Builds the tree from n keys in sorted order, with a shape that only depends on the keys and the seed: 
+the same seed gives the same tree whether it is built serially or with any executor (see buildJob()). 
+Has to be called while the tree is empty. Returns false if it is not.
+
+Time Complexity: O(N)
+*/
+bool buildRBST(RBST* bst, const int sortedKeys[], int n, uint64_t seed) {
+    if (!bst->isSmall || bst->numSmallKeys > 0) {
+        return false;
+    }
+    
+    if (n <= SMALL_TREE_KEYS) {
+        memcpy(bst->smallKeys, sortedKeys, n * sizeof(int));
+        bst->numSmallKeys = n;
+        
+        return true;
+    }
+    
+    // Split into about one task per thread of the executor, unless the nodes come from the tree's arena.
+    BuildJob job = { bst, sortedKeys, 0, n - 1, seed, (bst->arena == NULL) ? forkDepth(bst->executor) : 0, NULL };
+    
+    buildJob(&job);
+    bst->isSmall = false;
+    setRoot(bst, job.root);
+    
+    return true;
+}
+
+/*
+Helper function for performing an inorder traversal to flatten the RBST in a sorted array.
+Only the value of the keys are sorted, while the nodes are released (see releaseNode()).
+
+Time Complexity: O(n) (inorder traversal with O(1) work done per node).
+*/
+void flattenRBST (RBST* bst, int bstArr[], TreeNode* newNode, TreeNode* currentNode, int* curIndex, 
+                    int* newNodeIndex, bool* isAdded, int arrLength, int* nodesVisited) {
+    // Check if a leaf node has been proceeded
+    if(currentNode == NULL) {
+        // If the newNode hasnt been added yet and is greater than all other nodes, add it to the end of the array.
+        if(!(*isAdded) && ((*curIndex) == ((arrLength) - 1))) {
+            bstArr[(*curIndex)] = newNode->key;
+            (*newNodeIndex) = (*curIndex);
+            (*curIndex)++;
+        }
+        
+        return;
+    }
+    
+    // Recursively sort the left subtree.
+    flattenRBST(bst, bstArr, newNode, currentNode->left, curIndex, newNodeIndex, isAdded, arrLength, nodesVisited);
+    
+    // If the newNode is less than the currentNode, add it at the correct position, before the currentNode.
+    if(((newNode->key) < (currentNode->key)) && (!(*isAdded))){
+        bstArr[(*curIndex)] = newNode->key;
+        *newNodeIndex = (*curIndex);
+        (*curIndex)++;
+        (*isAdded) = true;
+    }
+    
+    (*nodesVisited)++; 
+    bstArr[(*curIndex)] = currentNode->key;
+    (*curIndex)++;
+    
+    // Recursively sort the right subtree.
+    flattenRBST(bst, bstArr, newNode, currentNode->right, curIndex, newNodeIndex, isAdded, arrLength, nodesVisited);
+    
+    releaseNode(bst, currentNode);
+}
+
+/*
+Returns the number of keys in the subtree that are less than or equal to the key, which is 
+the index the key gets in the array produced by flattenRBST(). 
+
+Time Complexity: Expected O(log(N))
+*/
+int rankInSubtree(TreeNode* currentNode, int key) {
+    int rank = 0;
+    
+    while (currentNode != NULL) {
+        if (key < currentNode->key) {
+            currentNode = currentNode->left;
+        }
+        else {
+            rank += nodeSize(currentNode->left) + 1;
+            currentNode = currentNode->right;
+        }
+    }
+    
+    return rank;
+}
+
+/*
+Helper function for generating the random shape of a subtree with 'size' nodes, without any keys. 
+The size of the left subtree of every node is written to shape[] in preorder, where shape[] 
+initially holds 32 random bits per node (consumed at the same preorder index they are replaced at).
+
+Time Complexity: O(N) (preorder traversal with O(1) work done per node)
+*/
+void makeShape(RNG* rng, uint32_t shape[], int size, int* preIndex) {
+    if (size == 0) {
+        return;
+    }
+    
+    // Like makeRBST(), every position in [0, size) is equally likely to be the root.
+    int leftSize = (int) boundedRandom(rng, shape[(*preIndex)], (uint32_t) size);
+    shape[(*preIndex)] = leftSize;
+    (*preIndex)++;
+    
+    makeShape(rng, shape, leftSize, preIndex);
+    makeShape(rng, shape, size - 1 - leftSize, preIndex);
+}
+
+// Arguments of a shape generation, so that it can be run on its own thread.
+typedef struct ShapeJob {
+    RNG* rng; // The tree's generator, which is not used by the flattening thread.
+    uint32_t* shape; // Left subtree sizes in preorder, of length 'length'.
+    int length; // Number of nodes in the subtree, including the newNode.
+    int rootLeftSize; // The newNode's index in the sorted array, which is fixed as the root.
+} ShapeJob;
+
+/*
+Generates the shape of a rebuilt subtree, with the newNode fixed at the root. The random numbers are
+drawn in one batch up front, so the shape generation itself is a plain loop over memory.
+Takes and returns a void* so it can be passed to forkJob().
+*/
+void* makeShapeJob(void* arg) {
+    ShapeJob* job = (ShapeJob*) arg;
+    int preIndex = 1;
+    
+    // Batch the random number generation: 32 bits per node below the root, two nodes per number.
+    for (int i = 1; i < job->length; i += 2) {
+        uint64_t bits = nextRandom(job->rng);
+        job->shape[i] = (uint32_t) bits;
+        if (i + 1 < job->length) {
+            job->shape[i + 1] = (uint32_t) (bits >> 32);
+        }
+    }
+    
+    job->shape[0] = (uint32_t) job->rootLeftSize;
+    makeShape(job->rng, job->shape, job->rootLeftSize, &preIndex);
+    makeShape(job->rng, job->shape, job->length - 1 - job->rootLeftSize, &preIndex);
+    
+    return NULL;
+}
+
+/*
+Helper function for filling a pregenerated shape with the keys of a sorted array. The node at 
+each preorder position takes the key at its inorder position, and its size and hash are computed from its children.
+
+Time Complexity: O(N) (preorder traversal with O(1) work done per node)
+*/
+TreeNode* fillRBST(RBST* bst, int bstArr[], uint32_t shape[], int first, int size, int* preIndex, int* nodesVisited) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    int leftSize = (int) shape[(*preIndex)];
+    (*preIndex)++;
+    (*nodesVisited)++;
+    
+    TreeNode* newNode = createNode(bst, bstArr[first + leftSize]);
+    newNode->left = fillRBST(bst, bstArr, shape, first, leftSize, preIndex, nodesVisited);
+    newNode->right = fillRBST(bst, bstArr, shape, first + leftSize + 1, size - 1 - leftSize, preIndex, nodesVisited);
+    updateNode(newNode);
+    
+    return newNode;
+}
+
+/*
+Shape-then-fill version of reconstructRBST(). The random shape of the rebuilt subtree only depends 
+on its size and on the newNode's rank, both of which are known before flattening, so the shape is 
+generated first (on a separate thread for large subtrees, overlapping flattenRBST()), and the keys 
+are then filled in at their inorder positions.
+
+Time Complexity: O(N) (Rank: O(log(N)) + Flatten and Shape: O(N) + Fill: O(N))
+*/
+TreeNode* reconstructShapeFirstRBST(RBST* bst, TreeNode* currentNode, TreeNode* newNode, int* nodesVisited) {
+    int arrLength = (currentNode->size) + 1; 
+    int* bstArr = (int*) malloc(arrLength * sizeof(int)); // An array of length: subtree length + 1.
+    uint32_t* shape = (uint32_t*) malloc(arrLength * sizeof(uint32_t)); // Left subtree sizes in preorder.
+    int newNodeIndex; // For remembering the newNodeIndex across function calls.
+    int curIndex = 0; // For remembering the current index across function calls.
+    int preIndex = 0; // For remembering the current preorder position across function calls.
+    bool isAddedArr = false; // Flag for indicating whether the newNode has been added into the array yet.
+    bool isThreaded = false; // Flag for indicating whether the shape is generated on its own thread.
+    RBSTFork shapeFork;
+    
+    // Check if memory allocation failed.
+    if (bstArr == NULL || shape == NULL) {
+        exit(0);
+    }
+    
+    ShapeJob job = { &bst->rng, shape, arrLength, rankInSubtree(currentNode, newNode->key) };
+    
+    // Generate the shape while the subtree is being flattened, if it is large enough to pay for a thread.
+    if (arrLength >= tuning.shapeThreadCutoff) {
+        isThreaded = forkJob(bst->executor, &shapeFork, makeShapeJob, &job);
+    }
+    if (!isThreaded) {
+        makeShapeJob(&job);
+    }
+    
+    // Flatten the BST into a sorted array.
+    flattenRBST(bst, bstArr, newNode, currentNode, &curIndex, &newNodeIndex, &isAddedArr, arrLength, nodesVisited);
+    releaseNode(bst, newNode);
+    
+    if (isThreaded) {
+        joinJob(bst->executor, &shapeFork);
+    }
+    
+    // Fill the shape with the keys, the newNode's key is at the root since shape[0] == newNodeIndex.
+    newNode = fillRBST(bst, bstArr, shape, 0, arrLength, &preIndex, nodesVisited);
+    
+    free(shape);
+    free(bstArr);
+    
+    return newNode;
+}
+
+// Helper function for listing the nodes of the subtree and the new node in sorted order, without releasing them.
+void flattenNodesRBST(TreeNode* nodes[], TreeNode* newNode, TreeNode* currentNode, int* curIndex, 
+                      int* newNodeIndex, int* nodesVisited) {
+    while (currentNode != NULL) {
+        flattenNodesRBST(nodes, newNode, currentNode->left, curIndex, newNodeIndex, nodesVisited);
+        
+        // Place the new node before the first node with a greater key.
+        if (*newNodeIndex == -1 && newNode->key < currentNode->key) {
+            *newNodeIndex = *curIndex;
+            nodes[(*curIndex)++] = newNode;
+        }
+        
+        (*nodesVisited)++;
+        nodes[(*curIndex)++] = currentNode;
+        currentNode = currentNode->right;
+    }
+}
+
+// Helper function for relinking nodes[first..last] into a random subtree with the new node at the root (see makeRBST()).
+TreeNode* relinkRBST(RBST* bst, TreeNode* nodes[], int first, int last, int newNodeIndex, int* nodesVisited) {
+    if (last < first) {
+        return NULL;
+    }
+    
+    (*nodesVisited)++;
+    
+    int index = newNodeIndex;
+    if (index < first || index > last) {
+        index = first + (int) randomBelow(&bst->rng, (uint32_t) (last - first + 1));
+    }
+    
+    TreeNode* newNode = nodes[index];
+    newNode->left = relinkRBST(bst, nodes, first, index - 1, newNodeIndex, nodesVisited);
+    newNode->right = relinkRBST(bst, nodes, index + 1, last, newNodeIndex, nodesVisited);
+    updateNode(newNode);
+    
+    return newNode;
+}
+
+/*
+Stable-node version of reconstructRBST(): the subtree and the newNode are rebuilt with the same random 
+shape distribution, but by relinking the existing nodes, so node pointers, values and hit counts survive.
+
+Time Complexity: O(N)
+*/
+TreeNode* reconstructStableRBST(RBST* bst, TreeNode* currentNode, TreeNode* newNode, int* nodesVisited) {
+    int arrLength = currentNode->size + 1;
+    TreeNode** nodes = (TreeNode**) malloc(arrLength * sizeof(TreeNode*));
+    int curIndex = 0;
+    int newNodeIndex = -1;
+    
+    // Check if memory allocation failed.
+    if (nodes == NULL) {
+        exit(0);
+    }
+    
+    flattenNodesRBST(nodes, newNode, currentNode, &curIndex, &newNodeIndex, nodesVisited);
+    
+    // The newNode is greater than or equal to every key of the subtree.
+    if (newNodeIndex == -1) {
+        newNodeIndex = curIndex;
+        nodes[curIndex] = newNode;
+    }
+    newNode = relinkRBST(bst, nodes, 0, arrLength - 1, newNodeIndex, nodesVisited);
+    
+    free(nodes);
+    
+    return newNode;
+}
+
+/*
+Helper function for flattening a subtree into an array of keys, and reconstructing it with 
+the newNode at the root. Returns the newNode, which contains its new randomized subtree.
+
+Time Complexity: O(N) (Flatten: O(N) + BST Construction: O(N)) 
+*/
+TreeNode* reconstructKeysRBST(RBST* bst, TreeNode* currentNode, TreeNode* newNode, int* nodesVisited) {
+    int arrLength = (currentNode->size) + 1; 
+    int* bstArr = (int*) malloc(arrLength * sizeof(int)); // An array of length: subtree length + 1.
+    int newNodeIndex; // For remembering the newNodeIndex across function calls.
+    int curIndex = 0; // For remembering the current index across function calls.
+    bool isAddedArr = false; // Flag for indicating whether the newNode has been added into the array yet.
+    bool isAddedBST = false; // Flag for indicating whether the newNode has been added into the BST yet.
+    
+    // Flatten the BST into a sorted array.
+    flattenRBST(bst, bstArr, newNode, currentNode, &curIndex, &newNodeIndex, &isAddedArr, arrLength, nodesVisited);
+    releaseNode(bst, newNode);
+    
+    // Rebuild the subtree from the array, with the newNode at the root.
+    newNode = makeRBST(bst, bstArr, 0, (arrLength - 1), newNodeIndex, isAddedBST, nodesVisited);    
+    
+    free(bstArr);
+    
+    return newNode;
+}
+
+/*
+Helper function for rebuilding a subtree with the newNode at the root, in the tree's rebuild mode. 
+Returns the newNode, which contains its new randomized subtree.
+
+Time Complexity: O(N)
+*/
+TreeNode* reconstructRBST(RBST* bst, TreeNode* currentNode, TreeNode* newNode, int* nodesVisited) {
+    RNGBuffer buffer;
+    bool isBuffered = attachRNGBuffer(&bst->rng, &buffer, currentNode->size);
+    
+    if (bst->stableNodes) {
+        newNode = reconstructStableRBST(bst, currentNode, newNode, nodesVisited);
+    }
+    else if (bst->shapeFirstRebuild) {
+        newNode = reconstructShapeFirstRBST(bst, currentNode, newNode, nodesVisited);
+    }
+    else {
+        newNode = reconstructKeysRBST(bst, currentNode, newNode, nodesVisited);
+    }
+    detachRNGBuffer(&bst->rng, isBuffered);
+    
+    return newNode;
+}
+
+/*
+Structure for a rebuild running on a helper thread (background rebuild mode). The subtree being rebuilt 
+is replaced in the tree by a placeholder node with its size and hash, so the rest of the tree stays 
+consistent and the writer does not wait for the rebuild. Inserts that reach the placeholder are buffered 
+and inserted into the rebuilt subtree by the helper thread, and anything else that reaches the placeholder 
+waits for the helper thread and swaps in the rebuilt subtree (see finishRebuildRBST()).
+*/
+typedef struct BackgroundRebuild {
+    pthread_t thread;
+    RBST scratch; // The generator and rebuild mode of the helper thread, which allocates with malloc().
+    TreeNode* oldRoot; // The subtree being rebuilt, owned by the helper thread.
+    TreeNode* newNode; // The node that goes to the root of the rebuilt subtree.
+    TreeNode* newRoot; // The rebuilt subtree, set by the helper thread.
+    int nodesVisited; // Number of nodes visited by the helper thread.
+    TreeNode* placeholder; // Takes the place of the subtree in the tree, with the tree's node extras.
+    pthread_mutex_t lock; // Guards the fields below.
+    pthread_cond_t applied; // Signaled when a buffered node is inserted while the writer waits, and when done is set.
+    bool built; // Set once the subtree is rebuilt and the helper thread starts inserting the buffered nodes.
+    bool writerWaiting;
+    bool done; // Set once the buffer is empty and newRoot is complete, after which nothing is buffered.
+    TreeNode** buffered; // Nodes inserted into the subtree meanwhile, in order.
+    int numBuffered;
+    int maxBuffered;
+    int numApplied; // Number of buffered nodes the helper thread has inserted.
+    int numBuilt; // Number of nodes that were buffered when the subtree was rebuilt.
+} BackgroundRebuild;
+
+// Declared here, since the helper thread of a background rebuild inserts the buffered nodes.
+TreeNode* insertRBSTHelper(RBST* bst, TreeNode* currentNode, TreeNode* newNode, int* nodesVisited);
+
+/*
+Helper thread of a background rebuild, which runs reconstructRBST() with its own generator and then 
+inserts the buffered nodes into the rebuilt subtree until the buffer is empty.
+*/
+void* backgroundRebuildThread(void* arg) {
+    BackgroundRebuild* rebuild = (BackgroundRebuild*) arg;
+    TreeNode* subtree = reconstructRBST(&rebuild->scratch, rebuild->oldRoot, rebuild->newNode, &rebuild->nodesVisited);
+    
+    pthread_mutex_lock(&rebuild->lock);
+    rebuild->built = true;
+    rebuild->numBuilt = rebuild->numBuffered;
+    
+    while (true) {
+        if (rebuild->writerWaiting) {
+            pthread_cond_signal(&rebuild->applied);
+        }
+        if (rebuild->numApplied == rebuild->numBuffered) {
+            rebuild->newRoot = subtree;
+            __atomic_store_n(&rebuild->done, true, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&rebuild->lock);
+            
+            return NULL;
+        }
+        TreeNode* node = rebuild->buffered[(rebuild->numApplied)++];
+        pthread_mutex_unlock(&rebuild->lock);
+        
+        subtree = insertRBSTHelper(&rebuild->scratch, subtree, node, &rebuild->nodesVisited);
+        pthread_mutex_lock(&rebuild->lock);
+    }
+}
+
+/*
+Starts rebuilding the subtree with the newNode at its root on a helper thread, and returns the placeholder 
+that takes the place of the subtree until finishRebuildRBST(). The helper thread gets a seed from the tree's 
+generator. Returns NULL if no thread can be created.
+
+Time Complexity: O(1) (O(N) on the helper thread)
+*/
+TreeNode* startBackgroundRebuild(RBST* bst, TreeNode* currentNode, TreeNode* newNode) {
+    BackgroundRebuild* rebuild = (BackgroundRebuild*) malloc(sizeof(BackgroundRebuild));
+    
+    // Check if memory allocation failed.
+    if (rebuild == NULL) {
+        exit(0);
+    }
+    
+    initScratchRBST(&rebuild->scratch, bst, nextRandom(&bst->rng));
+    
+    rebuild->oldRoot = currentNode;
+    rebuild->newNode = newNode;
+    rebuild->newRoot = NULL;
+    rebuild->nodesVisited = 0;
+    pthread_mutex_init(&rebuild->lock, NULL);
+    pthread_cond_init(&rebuild->applied, NULL);
+    rebuild->built = false;
+    rebuild->writerWaiting = false;
+    rebuild->done = false;
+    rebuild->buffered = NULL;
+    rebuild->numBuffered = 0;
+    rebuild->maxBuffered = 0;
+    rebuild->numApplied = 0;
+    rebuild->numBuilt = 0;
+    
+    // The placeholder has the size (and hash) of the subtree with the newNode, and no children.
+    rebuild->placeholder = createNode(&rebuild->scratch, newNode->key);
+    rebuild->placeholder->size = currentNode->size + 1;
+    nodeLinks(rebuild->placeholder)->parent = nodeParent(currentNode);
+    if (bst->nodeExtras & NODE_HASHED) {
+        *nodeHash(rebuild->placeholder) = subtreeHash(currentNode) + subtreeHash(newNode);
+    }
+    
+    if (pthread_create(&rebuild->thread, NULL, backgroundRebuildThread, rebuild) != 0) {
+        pthread_mutex_destroy(&rebuild->lock);
+        pthread_cond_destroy(&rebuild->applied);
+        free(rebuild->placeholder);
+        free(rebuild);
+        return NULL;
+    }
+    bst->rebuild = rebuild;
+    
+    return rebuild->placeholder;
+}
+
+/*
+Hands the node to the helper thread of the background rebuild, to be inserted into the rebuilt subtree. 
+Once the subtree is rebuilt and the backlog is large, waits until the helper thread has inserted two nodes 
+for every node buffered since, so the backlog shrinks and the helper thread finishes in bounded time. 
+Returns false if the helper thread is already done, in which case the rebuild has to be finished first.
+
+Time Complexity: O(1) amortized, plus the wait for up to two inserts on the helper thread
+*/
+bool bufferRebuildNode(BackgroundRebuild* rebuild, TreeNode* newNode) {
+    pthread_mutex_lock(&rebuild->lock);
+    while (rebuild->built && !rebuild->done && rebuild->numBuffered - rebuild->numApplied >= BACKGROUND_REBUILD_BACKLOG && 
+           rebuild->numApplied < 2 * (rebuild->numBuffered - rebuild->numBuilt)) {
+        rebuild->writerWaiting = true;
+        pthread_cond_wait(&rebuild->applied, &rebuild->lock);
+        rebuild->writerWaiting = false;
+    }
+    if (rebuild->done) {
+        pthread_mutex_unlock(&rebuild->lock);
+        return false;
+    }
+    
+    // Double the buffer when it is full.
+    if (rebuild->numBuffered == rebuild->maxBuffered) {
+        int maxBuffered = (rebuild->maxBuffered == 0) ? 1024 : 2 * rebuild->maxBuffered;
+        TreeNode** buffered = (TreeNode**) realloc(rebuild->buffered, maxBuffered * sizeof(TreeNode*));
+        
+        // Check if memory allocation failed.
+        if (buffered == NULL) {
+            exit(0);
+        }
+        rebuild->buffered = buffered;
+        rebuild->maxBuffered = maxBuffered;
+    }
+    
+    // The node belongs to the helper thread once it is in the buffer, which may release it in a rebuild.
+    (rebuild->placeholder->size)++;
+    if (newNode->extras & NODE_HASHED) {
+        *nodeHash(rebuild->placeholder) += subtreeHash(newNode);
+    }
+    rebuild->buffered[(rebuild->numBuffered)++] = newNode;
+    pthread_mutex_unlock(&rebuild->lock);
+    
+    return true;
+}
+
+/*
+Waits for the rebuild running in the background and swaps the rebuilt subtree in for the placeholder. 
+Returns the rebuilt subtree, or NULL if no rebuild is running. Adds the number of nodes visited by the 
+helper thread to nodesVisited.
+
+Time Complexity: O(1), once the helper thread is done
+*/
+TreeNode* finishRebuildRBST(RBST* bst, int* nodesVisited) {
+    BackgroundRebuild* rebuild = bst->rebuild;
+    
+    if (rebuild == NULL) {
+        return NULL;
+    }
+    
+    pthread_join(rebuild->thread, NULL);
+    bst->rebuild = NULL;
+    (*nodesVisited) += rebuild->nodesVisited;
+    
+    TreeNode* subtree = rebuild->newRoot;
+    TreeNode* parent = nodeParent(rebuild->placeholder);
+    if (parent == NULL) {
+        setRoot(bst, subtree);
+    }
+    else {
+        if (parent->left == rebuild->placeholder) {
+            parent->left = subtree;
+        }
+        else {
+            parent->right = subtree;
+        }
+        setParent(subtree, parent);
+    }
+    
+    pthread_mutex_destroy(&rebuild->lock);
+    pthread_cond_destroy(&rebuild->applied);
+    free(rebuild->buffered);
+    free(rebuild->placeholder);
+    free(rebuild);
+    
+    return subtree;
+}
+
+// Swaps in the rebuild running in the background, if any, e.g. before traversing the whole tree.
+void waitForRebuildRBST(RBST* bst) {
+    int nodesVisited = 0;
+    
+    finishRebuildRBST(bst, &nodesVisited);
+}
+
+// Returns true if the node is in the subtree of the root, following the parent pointers up from the node (NODE_LINKED).
+bool inSubtree(TreeNode* node, TreeNode* root) {
+    for (; node != NULL; node = nodeParent(node)) {
+        if (node == root) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+Helper function for insertRBST() that is suitable for recursion and keeping track of nodesVisited.
+3 Possibilites for insertion: 
+- The newNode becomes the root node, if the tree is empty. 
+- The newNode becomes the root of the current subtree with probability 1/n, this involves rebuilding its subtree. 
+- Recurses the left or right subtree depending on where the newNode belongs (ordering property of the BST). 
+Returns a tree that includes the added node. 
+
+Time Complexity: Worst case - O(N) (If the entire tree is reconstructed), 
+Expected (Amortized) case - O(log(N)) (Inserts element at end of tree rather than reconstructing at all) 
+*/
+TreeNode* insertRBSTHelper(RBST* bst, TreeNode* currentNode, TreeNode* newNode, int* nodesVisited) {
+    // Check if the tree or node is empty
+    if (currentNode == NULL) {
+        return newNode; 
+    }
+    
+    // A subtree that is being rebuilt in the background hands the node to the helper thread.
+    if (bst->rebuild != NULL && currentNode == bst->rebuild->placeholder) {
+        if (bufferRebuildNode(bst->rebuild, newNode)) {
+            return currentNode;
+        }
+        currentNode = finishRebuildRBST(bst, nodesVisited);
+    }
+    
+    (*nodesVisited)++;
+    
+    // With probability 1/(n+1), construct a new subtree with the new node in the root
+    if (randomBelow(&bst->rng, (uint32_t) ((currentNode->size) + 1)) == 0) {
+        bool inBackground = bst->backgroundRebuild && currentNode->size >= tuning.backgroundRebuildCutoff && 
+                            bst->arena == NULL && !bst->stableNodes && (bst->nodeExtras & NODE_LINKED);
+        
+        // The rebuild running in the background is finished first if it is in the subtree or its thread is needed.
+        if (bst->rebuild != NULL && (inBackground || inSubtree(bst->rebuild->placeholder, currentNode))) {
+            finishRebuildRBST(bst, nodesVisited);
+        }
+        if (inBackground) {
+            TreeNode* placeholder = startBackgroundRebuild(bst, currentNode, newNode);
+            
+            if (placeholder != NULL) {
+                return placeholder;
+            }
+        }
+        
+        TreeNode* reconstructedSubtree = reconstructRBST(bst, currentNode, newNode, nodesVisited);
+        
+        return reconstructedSubtree;
+    }
+    
+    (currentNode->size)++;
+    if (currentNode->extras & NODE_HASHED) {
+        *nodeHash(currentNode) += subtreeHash(newNode);
+    }
+    
+    // Else If the current node's key is less than the current node's key, recursively search the left substree.
+    if ((newNode->key) < (currentNode->key)) {
+        currentNode->left = insertRBSTHelper(bst, currentNode->left, newNode, nodesVisited);
+        setParent(currentNode->left, currentNode);
+    }
+    else {
+        currentNode->right = insertRBSTHelper(bst, currentNode->right, newNode, nodesVisited);
+        setParent(currentNode->right, currentNode);
+    }
+    
+    return currentNode;
+}
+
+// Returns the number of keys in the tree.
+int sizeRBST(RBST* bst) {
+    return bst->isSmall ? bst->numSmallKeys : nodeSize(bst->root);
+}
+
+// Returns the number of keys of a small tree that are less than the key, or at most the key if inclusive is true.
+int smallRank(RBST* bst, int key, bool inclusive) {
+    int rank = 0;
+    
+    for (int i = 0; i < bst->numSmallKeys; i++) {
+        rank += inclusive ? (bst->smallKeys[i] <= key) : (bst->smallKeys[i] < key);
+    }
+    
+    return rank;
+}
+
+// Inserts the key into a small tree with room for it, after any equal keys.
+void insertSmallKey(RBST* bst, int key) {
+    int index = smallRank(bst, key, true);
+    
+    memmove(&(bst->smallKeys[index + 1]), &(bst->smallKeys[index]), (bst->numSmallKeys - index) * sizeof(int));
+    bst->smallKeys[index] = key;
+    (bst->numSmallKeys)++;
+}
+
+/*
+Builds the nodes of a full small tree and the key, as a random BST over all of them (like makeRBST() 
+without a fixed root), and switches the tree to nodes.
+
+Time Complexity: O(SMALL_TREE_KEYS)
+*/
+void expandSmallRBST(RBST* bst, int key, int* nodesVisited) {
+    int bstArr[SMALL_TREE_KEYS + 1];
+    int numKeys = bst->numSmallKeys;
+    int index = smallRank(bst, key, true);
+    
+    // The key goes after any equal keys, like insertSmallKey().
+    memcpy(bstArr, bst->smallKeys, index * sizeof(int));
+    bstArr[index] = key;
+    memcpy(&(bstArr[index + 1]), &(bst->smallKeys[index]), (numKeys - index) * sizeof(int));
+    
+    bst->isSmall = false;
+    bst->numSmallKeys = 0;
+    setRoot(bst, makeRBST(bst, bstArr, 0, numKeys, -1, true, nodesVisited));
+}
+
+// Helper function for moving the keys of the subtree into smallKeys[] in sorted order, releasing its nodes.
+void moveToSmallKeys(RBST* bst, TreeNode* currentNode, int* nodesVisited) {
+    while (currentNode != NULL) {
+        TreeNode* right = currentNode->right;
+        
+        moveToSmallKeys(bst, currentNode->left, nodesVisited);
+        bst->smallKeys[(bst->numSmallKeys)++] = currentNode->key;
+        (*nodesVisited)++;
+        releaseNode(bst, currentNode);
+        currentNode = right;
+    }
+}
+
+// Switches a tree with at most SMALL_TREE_KEYS keys back to inline storage.
+void shrinkRBST(RBST* bst, int* nodesVisited) {
+    TreeNode* root = bst->root;
+    
+    bst->isSmall = true;
+    bst->numSmallKeys = 0;
+    bst->root = NULL;
+    moveToSmallKeys(bst, root, nodesVisited);
+}
+
+/*
+The function takes an RBST and a key to insert. It uses insertRBSTHelper()
+to insert a node containing the given key and returns number of nodes visited.
+
+Time Complexity: Worst case - O(N), Expected (Amortized) - O(log(N))
+*/
+int insertRBST(RBST* bst, int key) { 
+    TreeNode* newNode;
+    int nodesVisited = 0;
+    
+    // A small tree keeps the key inline while there is room, and is built into nodes when it overflows.
+    if (bst->isSmall) {
+        if (bst->numSmallKeys < SMALL_TREE_KEYS) {
+            insertSmallKey(bst, key);
+            return 1;
+        }
+        expandSmallRBST(bst, key, &nodesVisited);
+        
+        return nodesVisited;
+    }
+    
+    // Swap in a finished background rebuild right away, so inserts into its subtree do not take the lock.
+    if (bst->rebuild != NULL && __atomic_load_n(&bst->rebuild->done, __ATOMIC_ACQUIRE)) {
+        finishRebuildRBST(bst, &nodesVisited);
+    }
+    
+    // Allocate memory for the node to be created.
+    newNode = createNode(bst, key);
+    nodesVisited++;
+    
+    // If the tree is empty, make the newNode the root.
+    if (bst->root == NULL) {
+        bst->root = newNode;
+        
+        return nodesVisited;
+    }
+
+    setRoot(bst, insertRBSTHelper(bst, bst->root, newNode, &nodesVisited));
+    
+    return nodesVisited;
+}
+
+/*
+Rotates the left child of the node above it and returns the new subtree root.
+The sizes and hashes of both nodes involved are updated, the rest of the subtree is unchanged.
+
+Time Complexity: O(1)
+*/
+TreeNode* rotateRight(TreeNode* node) {
+    TreeNode* pivot = node->left;
+
+    node->left = pivot->right;
+    pivot->right = node;
+    setParent(node, pivot);
+
+    pivot->size = node->size;
+    if (pivot->extras & NODE_HASHED) {
+        *nodeHash(pivot) = *nodeHash(node);
+    }
+    updateNode(node);
+
+    return pivot;
+}
+
+/*
+Rotates the right child of the node above it and returns the new subtree root.
+
+Time Complexity: O(1)
+*/
+TreeNode* rotateLeft(TreeNode* node) {
+    TreeNode* pivot = node->right;
+
+    node->right = pivot->left;
+    pivot->left = node;
+    setParent(node, pivot);
+
+    pivot->size = node->size;
+    if (pivot->extras & NODE_HASHED) {
+        *nodeHash(pivot) = *nodeHash(node);
+    }
+    updateNode(node);
+
+    return pivot;
+}
+
+/*
+Decides whether a node that was just searched for should be rotated above its parent.
+The access counts act as treap priorities: a child that has been searched more often than
+its parent is promoted with probability (childHits - parentHits) / childHits, so hot keys
+drift toward the root while keys with similar counts keep the shape left by the insertions.
+Under uniform access the counts are (nearly) equal and random, so the tree keeps an expected
+O(log(N)) height, under skewed (e.g. Zipfian) access the hot keys end up a few levels from the root.
+*/
+bool shouldPromote(RNG* rng, TreeNode* child, TreeNode* parent) {
+    if (child->hits <= parent->hits) {
+        return false;
+    }
+
+    return randomBelow(rng, child->hits) < (child->hits - parent->hits);
+}
+
+/*
+Helper function for searchRBST() in self-adjusting mode that is suitable for recursion and keeping track 
+of nodesVisited. 'promoted' holds the node that was found while it is still being rotated toward the root,
+and is set to NULL once it stops. Returns the (possibly rotated) root of the current subtree.
+
+Time Complexity: Expected O(log(N))
+*/
+TreeNode* searchRBSTHelper(RBST* bst, TreeNode* currentNode, int key, TreeNode** promoted,
+                            bool* found, int* nodesVisited) {
+    if (currentNode == NULL) {
+        return NULL;
+    }
+
+    // A subtree that is being rebuilt in the background is swapped in before it is searched.
+    if (bst->rebuild != NULL && currentNode == bst->rebuild->placeholder) {
+        currentNode = finishRebuildRBST(bst, nodesVisited);
+    }
+
+    (*nodesVisited)++;
+
+    if (key == currentNode->key) {
+        *found = true;
+
+        // Saturate instead of wrapping around, so a hot key never loses its priority.
+        if (currentNode->hits < UINT_MAX) {
+            (currentNode->hits)++;
+        }
+        *promoted = currentNode;
+
+        return currentNode;
+    }
+
+    // Recursively search the left or right subtree, and rotate the found node above this one if it won.
+    if (key < currentNode->key) {
+        currentNode->left = searchRBSTHelper(bst, currentNode->left, key, promoted, found, nodesVisited);
+        adoptChildren(currentNode);
+
+        if ((*promoted != NULL) && (currentNode->left == *promoted)) {
+            if (shouldPromote(&bst->rng, currentNode->left, currentNode)) {
+                return rotateRight(currentNode);
+            }
+            *promoted = NULL;
+        }
+    }
+    else {
+        currentNode->right = searchRBSTHelper(bst, currentNode->right, key, promoted, found, nodesVisited);
+        adoptChildren(currentNode);
+
+        if ((*promoted != NULL) && (currentNode->right == *promoted)) {
+            if (shouldPromote(&bst->rng, currentNode->right, currentNode)) {
+                return rotateLeft(currentNode);
+            }
+            *promoted = NULL;
+        }
+    }
+
+    return currentNode;
+}
+
+/*
+The function takes an RBST and a key to search for. Returns true if the key is in the tree,
+and adds the number of nodes visited to nodesVisited. If the tree is in self-adjusting mode,
+the found node may be rotated toward the root (see shouldPromote()). Otherwise the search 
+only reads the tree, unless it reaches a subtree that is being rebuilt in the background.
+
+Time Complexity: Expected O(log(N))
+*/
+bool searchRBST(RBST* bst, int key, int* nodesVisited) {
+    TreeNode* promoted = NULL;
+    bool found = false;
+    
+    if (bst->isSmall) {
+        int index = smallRank(bst, key, false);
+        
+        (*nodesVisited)++;
+        return index < bst->numSmallKeys && bst->smallKeys[index] == key;
+    }
+    
+    if (bst->selfAdjusting) {
+        setRoot(bst, searchRBSTHelper(bst, bst->root, key, &promoted, &found, nodesVisited));
+        
+        return found;
+    }
+    
+    TreeNode* currentNode = bst->root;
+    
+    while (currentNode != NULL) {
+        // A subtree that is being rebuilt in the background is swapped in before it is searched.
+        if (bst->rebuild != NULL && currentNode == bst->rebuild->placeholder) {
+            currentNode = finishRebuildRBST(bst, nodesVisited);
+        }
+        
+        (*nodesVisited)++;
+        
+        if (key == currentNode->key) {
+            return true;
+        }
+        currentNode = (key < currentNode->key) ? currentNode->left : currentNode->right;
+    }
+    
+    return false;
+}
+
+/*
+Joins two subtrees, where every key in 'left' is less than or equal to every key in 'right', 
+into one randomized BST. The root of the left subtree is kept with probability m/(m+n), where m 
+and n are the sizes of the subtrees, which keeps the result a random BST. Returns the joined subtree.
+
+Time Complexity: Expected O(log(N))
+*/
+TreeNode* joinRBST(RBST* bst, TreeNode* left, TreeNode* right, int* nodesVisited) {
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+    
+    (*nodesVisited)++;
+    
+    if (randomBelow(&bst->rng, (uint32_t) (left->size + right->size)) < (uint32_t) left->size) {
+        left->size += right->size;
+        if (left->extras & NODE_HASHED) {
+            *nodeHash(left) += subtreeHash(right);
+        }
+        left->right = joinRBST(bst, left->right, right, nodesVisited);
+        setParent(left->right, left);
+        
+        return left;
+    }
+    
+    right->size += left->size;
+    if (right->extras & NODE_HASHED) {
+        *nodeHash(right) += subtreeHash(left);
+    }
+    right->left = joinRBST(bst, left, right->left, nodesVisited);
+    setParent(right->left, right);
+    
+    return right;
+}
+
+/*
+Helper function for deleteRBST() that is suitable for recursion and keeping track of nodesVisited.
+The node with the key is replaced by the join of its subtrees, and the sizes along the path are 
+decremented once it has been found. Returns the subtree without the key. The rebuild running in the 
+background is only waited for if the descent reaches its placeholder, or the join may reach it.
+
+Time Complexity: Expected O(log(N))
+*/
+TreeNode* deleteRBSTHelper(RBST* bst, TreeNode* currentNode, int key, bool* found, int* nodesVisited) {
+    if (currentNode == NULL) {
+        return NULL;
+    }
+    
+    // A subtree that is being rebuilt in the background is swapped in before it is searched.
+    if (bst->rebuild != NULL && currentNode == bst->rebuild->placeholder) {
+        currentNode = finishRebuildRBST(bst, nodesVisited);
+    }
+    
+    (*nodesVisited)++;
+    
+    if (key == currentNode->key) {
+        if (bst->rebuild != NULL && inSubtree(bst->rebuild->placeholder, currentNode)) {
+            finishRebuildRBST(bst, nodesVisited);
+        }
+        
+        TreeNode* joined = joinRBST(bst, currentNode->left, currentNode->right, nodesVisited);
+        
+        releaseNode(bst, currentNode);
+        *found = true;
+        
+        return joined;
+    }
+    
+    if (key < currentNode->key) {
+        currentNode->left = deleteRBSTHelper(bst, currentNode->left, key, found, nodesVisited);
+    }
+    else {
+        currentNode->right = deleteRBSTHelper(bst, currentNode->right, key, found, nodesVisited);
+    }
+    adoptChildren(currentNode);
+    
+    if (*found) {
+        (currentNode->size)--;
+        if (currentNode->extras & NODE_HASHED) {
+            *nodeHash(currentNode) -= keyHash(key);
+        }
+    }
+    
+    return currentNode;
+}
+
+/*
+The function takes an RBST and a key to delete. Removes one node with the key and returns true, 
+or returns false if the key is not in the tree. Adds the number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(log(N))
+*/
+bool deleteRBST(RBST* bst, int key, int* nodesVisited) {
+    bool found = false;
+    
+    if (bst->isSmall) {
+        int index = smallRank(bst, key, false);
+        
+        (*nodesVisited)++;
+        if (index == bst->numSmallKeys || bst->smallKeys[index] != key) {
+            return false;
+        }
+        (bst->numSmallKeys)--;
+        memmove(&(bst->smallKeys[index]), &(bst->smallKeys[index + 1]), (bst->numSmallKeys - index) * sizeof(int));
+        
+        return true;
+    }
+    
+    setRoot(bst, deleteRBSTHelper(bst, bst->root, key, &found, nodesVisited));
+    
+    // Go back to inline storage once the tree is well below the size it was built into nodes at.
+    if (found && !bst->stableNodes && nodeSize(bst->root) <= SMALL_TREE_KEYS / 2) {
+        finishRebuildRBST(bst, nodesVisited);
+        shrinkRBST(bst, nodesVisited);
+    }
+    
+    return found;
+}
+
+// Compares two keys for qsort().
+int compareKeys(const void* a, const void* b) {
+    int x = *(const int*) a;
+    int y = *(const int*) b;
+    
+    return (x > y) - (x < y);
+}
+
+// Returns the index of the first of keys[first..last-1] that is greater than or equal to the key.
+int lowerBound(const int keys[], int first, int last, int key) {
+    while (first < last) {
+        int middle = first + (last - first) / 2;
+        
+        if (keys[middle] < key) {
+            first = middle + 1;
+        }
+        else {
+            last = middle;
+        }
+    }
+    
+    return first;
+}
+
+// Returns the index of the first of keys[first..last-1] that is greater than the key.
+int upperBound(const int keys[], int first, int last, int key) {
+    while (first < last) {
+        int middle = first + (last - first) / 2;
+        
+        if (keys[middle] <= key) {
+            first = middle + 1;
+        }
+        else {
+            last = middle;
+        }
+    }
+    
+    return first;
+}
+
+// Arguments of a batch delete over a subtree, so that it can be run on its own thread.
+typedef struct DeleteBatchJob {
+    RBST* bst; // The tree, or a copy of its mode with a generator of its own on a helper thread.
+    TreeNode* root; // The subtree, replaced by the subtree without the deleted keys.
+    const int* keys; // The distinct keys of the batch in sorted order, of which the job gets keys[first..last-1].
+    int* counts; // The number of copies of every key that are still to be deleted.
+    int first;
+    int last;
+    int depth; // Number of levels at which the job may still split into two threads.
+    int removed;
+    int nodesVisited;
+} DeleteBatchJob;
+
+/*
+Removes keys[first..last-1] from the subtree, counts[i] copies of keys[i] at most, in a single traversal. 
+The batch is split at the key of every node, so each subtree only sees the keys that can be in it, and a 
+deleted node is replaced by the join of its subtrees. Copies of a key left after deleting the node may be 
+in either subtree, so that key is passed to both sides, left first. Otherwise large subtrees delete from 
+the left subtree forked on the tree's executor, with a generator of its own, while the depth allows it. 
+Takes and returns a void* for forkJob().
+
+Time Complexity: Expected O(M log(N/M + 1)) for M keys
+*/
+void* deleteBatchJob(void* arg) {
+    DeleteBatchJob* job = (DeleteBatchJob*) arg;
+    TreeNode* currentNode = job->root;
+    
+    if (currentNode == NULL || job->first >= job->last) {
+        return NULL;
+    }
+    
+    (job->nodesVisited)++;
+    
+    int index = lowerBound(job->keys, job->first, job->last, currentNode->key);
+    bool hasKey = (index < job->last && job->keys[index] == currentNode->key);
+    bool isDeleted = hasKey && job->counts[index] > 0;
+    
+    if (isDeleted) {
+        (job->counts[index])--;
+    }
+    
+    // The key goes to the left subtree only if copies are left to delete, and then to the right one as well.
+    bool isShared = isDeleted && job->counts[index] > 0;
+    DeleteBatchJob leftJob = { job->bst, currentNode->left, job->keys, job->counts, job->first, 
+                               isShared ? index + 1 : index, job->depth, 0, 0 };
+    DeleteBatchJob rightJob = { job->bst, currentNode->right, job->keys, job->counts, 
+                                (hasKey && !isShared) ? index + 1 : index, job->last, job->depth, 0, 0 };
+    bool isThreaded = false;
+    
+    // Split into two threads when the halves do not share a key and the subtree is large enough to pay for it.
+    if (job->depth > 0 && !isShared && job->bst->arena == NULL && currentNode->size >= tuning.parallelDeleteCutoff) {
+        RBST scratch;
+        RBSTFork leftFork;
+        
+        initScratchRBST(&scratch, job->bst, nextRandom(&job->bst->rng));
+        leftJob.bst = &scratch;
+        leftJob.depth = rightJob.depth = job->depth - 1;
+        
+        isThreaded = forkJob(job->bst->executor, &leftFork, deleteBatchJob, &leftJob);
+        if (isThreaded) {
+            deleteBatchJob(&rightJob);
+            joinJob(job->bst->executor, &leftFork);
+        }
+        leftJob.bst = job->bst;
+    }
+    if (!isThreaded) {
+        deleteBatchJob(&leftJob);
+        deleteBatchJob(&rightJob);
+    }
+    
+    job->removed += leftJob.removed + rightJob.removed;
+    job->nodesVisited += leftJob.nodesVisited + rightJob.nodesVisited;
+    
+    if (isDeleted) {
+        releaseNode(job->bst, currentNode);
+        (job->removed)++;
+        job->root = joinRBST(job->bst, leftJob.root, rightJob.root, &job->nodesVisited);
+        
+        return NULL;
+    }
+    
+    currentNode->left = leftJob.root;
+    currentNode->right = rightJob.root;
+    updateNode(currentNode);
+    
+    return NULL;
+}
+
+/*
+Deletes the keys of the batch from the tree, one copy for every time a key appears in the batch, in a single 
+traversal instead of one search per key (see deleteBatchJob()). The keys do not have to be sorted. 
+Returns the number of keys that were removed.
+
+Time Complexity: O(M log(M)) to sort M keys + Expected O(M log(N/M + 1)) to delete them
+*/
+int deleteBatchRBST(RBST* bst, const int keys[], int n) {
+    int* sorted = (int*) malloc((n + 1) * sizeof(int));
+    int* counts = (int*) malloc((n + 1) * sizeof(int));
+    int numKeys = 0;
+    int removed = 0;
+    
+    // Check if memory allocation failed.
+    if (sorted == NULL || counts == NULL) {
+        exit(0);
+    }
+    
+    waitForRebuildRBST(bst);
+    
+    // Sort the batch and merge equal keys into one key with a count.
+    memcpy(sorted, keys, n * sizeof(int));
+    qsort(sorted, n, sizeof(int), compareKeys);
+    for (int i = 0; i < n; i++) {
+        if (numKeys > 0 && sorted[numKeys - 1] == sorted[i]) {
+            counts[numKeys - 1]++;
+        }
+        else {
+            sorted[numKeys] = sorted[i];
+            counts[numKeys++] = 1;
+        }
+    }
+    
+    // A small tree keeps the keys that are not in the batch, merging the two sorted lists.
+    if (bst->isSmall) {
+        int numSmallKeys = 0;
+        
+        for (int i = 0, j = 0; i < bst->numSmallKeys; i++) {
+            while (j < numKeys && sorted[j] < bst->smallKeys[i]) {
+                j++;
+            }
+            if (j < numKeys && sorted[j] == bst->smallKeys[i] && counts[j] > 0) {
+                counts[j]--;
+                removed++;
+            }
+            else {
+                bst->smallKeys[numSmallKeys++] = bst->smallKeys[i];
+            }
+        }
+        bst->numSmallKeys = numSmallKeys;
+    }
+    else {
+        // Split into about one task per thread of the executor.
+        DeleteBatchJob job = { bst, bst->root, sorted, counts, 0, numKeys, forkDepth(bst->executor), 0, 0 };
+        
+        deleteBatchJob(&job);
+        setRoot(bst, job.root);
+        removed = job.removed;
+        
+        if (removed > 0 && !bst->stableNodes && nodeSize(bst->root) <= SMALL_TREE_KEYS / 2) {
+            shrinkRBST(bst, &job.nodesVisited);
+        }
+    }
+    
+    free(counts);
+    free(sorted);
+    
+    return removed;
+}
+
+// Helper function for setNodeExtrasRBST() that copies the subtree into new nodes of the tree, freeing the old nodes if 'freeOld' is true.
+TreeNode* copyNodes(RBST* bst, TreeNode* currentNode, bool freeOld) {
+    if (currentNode == NULL) {
+        return NULL;
+    }
+    
+    TreeNode* copy = createNode(bst, currentNode->key);
+    copy->hits = currentNode->hits;
+    if (copy->extras & currentNode->extras & NODE_LINKED) {
+        *handleValue(copy) = *handleValue(currentNode);
+    }
+    copy->left = copyNodes(bst, currentNode->left, freeOld);
+    copy->right = copyNodes(bst, currentNode->right, freeOld);
+    updateNode(copy);
+    if (freeOld) {
+        free(currentNode);
+    }
+    
+    return copy;
+}
+
+/*
+Changes the extras of the tree's nodes to the given NODE_* fields, by copying every node into a node 
+with the new extras (in a new arena if the tree uses one). Pointers to the old nodes, such as handles, 
+are invalid afterwards, so the extras are best chosen right after initRBST().
+
+Time Complexity: O(N)
+*/
+void setNodeExtrasRBST(RBST* bst, unsigned int extras) {
+    waitForRebuildRBST(bst);
+    if (extras == bst->nodeExtras) {
+        return;
+    }
+    
+    NodeArena* oldArena = bst->arena;
+    
+    bst->nodeExtras = extras;
+    if (oldArena != NULL) {
+        bst->arena = createArena(nodeBytes(extras));
+        
+        // Check if memory allocation failed.
+        if (bst->arena == NULL) {
+            exit(0);
+        }
+    }
+    
+    setRoot(bst, copyNodes(bst, bst->root, oldArena == NULL));
+    if (oldArena != NULL) {
+        freeArena(oldArena);
+    }
+}
+
+/*
+Gives the nodes of the tree parent pointers and values (NODE_LINKED), which inserts, deletes and rebuilds 
+keep up to date from then on. Iterators (see seekRBST()) need them. Pointers to the old nodes are invalid 
+afterwards (see setNodeExtrasRBST()).
+
+Time Complexity: O(N), O(1) if the tree is empty or already linked
+*/
+void useLinkedNodesRBST(RBST* bst) {
+    setNodeExtrasRBST(bst, bst->nodeExtras | NODE_LINKED);
+}
+
+/*
+Switches the tree to stable nodes: from now on rebuilds relink the existing nodes instead of replacing 
+them, and the tree is never stored inline, so a pointer to a node (a handle) stays valid until that 
+node is deleted. The nodes get parent pointers and values (NODE_LINKED), and the keys of a small tree 
+are built into nodes.
+
+Time Complexity: O(SMALL_TREE_KEYS), O(N) if the nodes have no parent pointers yet
+*/
+void useStableNodesRBST(RBST* bst) {
+    int bstArr[SMALL_TREE_KEYS];
+    int numKeys = bst->numSmallKeys;
+    int nodesVisited = 0;
+    
+    useLinkedNodesRBST(bst);
+    bst->stableNodes = true;
+    if (bst->isSmall) {
+        memcpy(bstArr, bst->smallKeys, numKeys * sizeof(int));
+        bst->isSmall = false;
+        bst->numSmallKeys = 0;
+        setRoot(bst, makeRBST(bst, bstArr, 0, numKeys - 1, -1, true, &nodesVisited));
+    }
+}
+
+/*
+Makes the tree run rebuilds of subtrees with at least tuning.backgroundRebuildCutoff nodes on a helper 
+thread (see startBackgroundRebuild()), so that a single insert does not stall on them. The nodes get 
+parent pointers (NODE_LINKED), which relink the rebuilt subtree. Trees with an arena or stable nodes 
+keep rebuilding synchronously.
+
+Time Complexity: O(1), O(N) if the nodes have no parent pointers yet
+*/
+void useBackgroundRebuildRBST(RBST* bst) {
+    useLinkedNodesRBST(bst);
+    bst->backgroundRebuild = true;
+}
+
+/*
+Inserts the key with a value and returns the new node as a handle, which stays valid until the node is 
+deleted: its value can be read and updated in O(1), and deleteHandleRBST() removes it without a search. 
+Switches the tree to stable nodes (see useStableNodesRBST()) if it does not use them yet. 
+Adds the number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(log(N))
+*/
+TreeNode* insertHandleRBST(RBST* bst, int key, long long value, int* nodesVisited) {
+    if (!bst->stableNodes) {
+        useStableNodesRBST(bst);
+    }
+    
+    TreeNode* newNode = createNode(bst, key);
+    *handleValue(newNode) = value;
+    (*nodesVisited)++;
+    
+    setRoot(bst, insertRBSTHelper(bst, bst->root, newNode, nodesVisited));
+    
+    return newNode;
+}
+
+/*
+Returns a handle to a node with the key, or NULL if the key is not in the tree. Does not promote the node 
+in self-adjusting mode. Adds the number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(log(N))
+*/
+TreeNode* findRBST(RBST* bst, int key, int* nodesVisited) {
+    finishRebuildRBST(bst, nodesVisited);
+    TreeNode* currentNode = bst->root;
+    
+    while (currentNode != NULL) {
+        (*nodesVisited)++;
+        
+        if (key == currentNode->key) {
+            return currentNode;
+        }
+        currentNode = (key < currentNode->key) ? currentNode->left : currentNode->right;
+    }
+    
+    return NULL;
+}
+
+/*
+Deletes the node of the handle from a tree with stable nodes, replacing it by the join of its subtrees 
+and walking the parent pointers up to update the sizes and hashes, without searching for its key.
+
+Time Complexity: Expected O(log(N))
+*/
+void deleteHandleRBST(RBST* bst, TreeNode* node, int* nodesVisited) {
+    TreeNode* parent = nodeParent(node);
+    TreeNode* joined = joinRBST(bst, node->left, node->right, nodesVisited);
+    uint64_t hash = (node->extras & NODE_HASHED) ? keyHash(node->key) : 0;
+    
+    if (parent == NULL) {
+        setRoot(bst, joined);
+    }
+    else {
+        if (parent->left == node) {
+            parent->left = joined;
+        }
+        else {
+            parent->right = joined;
+        }
+        adoptChildren(parent);
+    }
+    
+    for (TreeNode* ancestor = parent; ancestor != NULL; ancestor = nodeParent(ancestor)) {
+        (*nodesVisited)++;
+        (ancestor->size)--;
+        if (ancestor->extras & NODE_HASHED) {
+            *nodeHash(ancestor) -= hash;
+        }
+    }
+    
+    releaseNode(bst, node);
+}
+
+/*
+Returns the node after the given one in sorted order, or NULL if it is the last. Follows the parent 
+pointers, so it needs no stack and can start from any node.
+
+Time Complexity: O(1) amortized over a full traversal, O(log(N)) expected worst case
+*/
+TreeNode* nextRBST(TreeNode* node) {
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) {
+            node = node->left;
+        }
+        return node;
+    }
+    
+    // Climb until the node is in a left subtree; its parent is then the successor.
+    while (nodeParent(node) != NULL && nodeParent(node)->right == node) {
+        node = nodeParent(node);
+    }
+    
+    return nodeParent(node);
+}
+
+/*
+Returns the node before the given one in sorted order, or NULL if it is the first.
+
+Time Complexity: O(1) amortized over a full traversal, O(log(N)) expected worst case
+*/
+TreeNode* prevRBST(TreeNode* node) {
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        return node;
+    }
+    
+    while (nodeParent(node) != NULL && nodeParent(node)->left == node) {
+        node = nodeParent(node);
+    }
+    
+    return nodeParent(node);
+}
+
+/*
+Structure for an iterator over the keys of a tree in sorted order. It lives on the caller's stack and 
+allocates nothing. The tree needs linked nodes (see useLinkedNodesRBST()). It is invalidated by any change 
+to the tree, except for trees with stable nodes, where it stays valid as long as the node it is at is not deleted.
+*/
+typedef struct RBSTIterator {
+    RBST* bst;
+    TreeNode* node; // The current node, NULL past either end (trees built from nodes).
+    int index; // The current position in smallKeys[] (small trees).
+} RBSTIterator;
+
+/*
+Returns an iterator at the first key of the tree that is greater than or equal to the key. 
+Returns an invalid iterator if the tree does not have linked nodes.
+*/
+RBSTIterator seekRBST(RBST* bst, int key) {
+    waitForRebuildRBST(bst);
+    RBSTIterator it = { bst, NULL, -1 };
+    TreeNode* currentNode = bst->root;
+    
+    if (!(bst->nodeExtras & NODE_LINKED)) {
+        return it;
+    }
+    if (bst->isSmall) {
+        it.index = smallRank(bst, key, false);
+        return it;
+    }
+    
+    while (currentNode != NULL) {
+        if (currentNode->key >= key) {
+            it.node = currentNode;
+            currentNode = currentNode->left;
+        }
+        else {
+            currentNode = currentNode->right;
+        }
+    }
+    
+    return it;
+}
+
+// Returns an iterator at the smallest key of the tree, or an invalid one if the tree does not have linked nodes.
+RBSTIterator beginRBST(RBST* bst) {
+    waitForRebuildRBST(bst);
+    RBSTIterator it = { bst, bst->root, 0 };
+    
+    if (!(bst->nodeExtras & NODE_LINKED)) {
+        it.node = NULL;
+        it.index = -1;
+        return it;
+    }
+    while (it.node != NULL && it.node->left != NULL) {
+        it.node = it.node->left;
+    }
+    
+    return it;
+}
+
+// Returns true if the iterator is at a key, false if it has moved past either end.
+bool iterValid(RBSTIterator* it) {
+    return it->bst->isSmall ? (it->index >= 0 && it->index < it->bst->numSmallKeys) : (it->node != NULL);
+}
+
+// Returns the key the iterator is at.
+int iterKey(RBSTIterator* it) {
+    return it->bst->isSmall ? it->bst->smallKeys[it->index] : it->node->key;
+}
+
+// Moves the iterator to the next key.
+void iterNext(RBSTIterator* it) {
+    if (it->bst->isSmall) {
+        (it->index)++;
+    }
+    else {
+        it->node = nextRBST(it->node);
+    }
+}
+
+// Moves the iterator to the previous key.
+void iterPrev(RBSTIterator* it) {
+    if (it->bst->isSmall) {
+        (it->index)--;
+    }
+    else {
+        it->node = prevRBST(it->node);
+    }
+}
+
+/*
+Returns the rank of the key: the number of keys in the tree that are less than it.
+
+Time Complexity: Expected O(log(N))
+*/
+int rankRBST(RBST* bst, int key) {
+    waitForRebuildRBST(bst);
+    TreeNode* currentNode = bst->root;
+    int rank = 0;
+    
+    if (bst->isSmall) {
+        return smallRank(bst, key, false);
+    }
+    
+    while (currentNode != NULL) {
+        if (key <= currentNode->key) {
+            currentNode = currentNode->left;
+        }
+        else {
+            rank += nodeSize(currentNode->left) + 1;
+            currentNode = currentNode->right;
+        }
+    }
+    
+    return rank;
+}
+
+/*
+Returns the number of keys in the tree that are in the range [low, high].
+
+Time Complexity: Expected O(log(N))
+*/
+int rangeCountRBST(RBST* bst, int low, int high) {
+    if (high < low) {
+        return 0;
+    }
+    
+    waitForRebuildRBST(bst);
+    if (bst->isSmall) {
+        return smallRank(bst, high, true) - smallRank(bst, low, false);
+    }
+    
+    return rankInSubtree(bst->root, high) - rankRBST(bst, low);
+}
+
+/*
+Helper function for rankBatchRBST() that sets ranks[i] to the rank of keys[i] in the subtree plus 'offset', 
+for the sorted keys[first..last-1]. The queries are split at the key of every node, so every node on the 
+union of their search paths is visited once.
+
+Time Complexity: Expected O(M log(N/M + 1)) for M queries
+*/
+void rankBatchHelper(TreeNode* currentNode, const int keys[], int first, int last, int offset, int ranks[], 
+                     int* nodesVisited) {
+    while (first < last) {
+        if (currentNode == NULL) {
+            for (int i = first; i < last; i++) {
+                ranks[i] = offset;
+            }
+            return;
+        }
+        
+        (*nodesVisited)++;
+        
+        // Queries up to the node's key rank in the left subtree, the others also count the left subtree and the node.
+        int index = upperBound(keys, first, last, currentNode->key);
+        rankBatchHelper(currentNode->left, keys, first, index, offset, ranks, nodesVisited);
+        
+        offset += nodeSize(currentNode->left) + 1;
+        first = index;
+        currentNode = currentNode->right;
+    }
+}
+
+/*
+Sets ranks[i] to the rank of keys[i] (the number of keys in the tree that are less than it) for a batch of 
+n queries sorted in increasing order, in a single traversal instead of one descent per query (see 
+rankBatchHelper()). Adds the number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(M log(N/M + 1)) for M queries
+*/
+void rankBatchRBST(RBST* bst, const int keys[], int n, int ranks[], int* nodesVisited) {
+    waitForRebuildRBST(bst);
+    
+    if (bst->isSmall) {
+        for (int i = 0; i < n; i++) {
+            ranks[i] = smallRank(bst, keys[i], false);
+        }
+        (*nodesVisited) += n;
+        
+        return;
+    }
+    
+    rankBatchHelper(bst->root, keys, 0, n, 0, ranks, nodesVisited);
+}
+
+// Helper function for searchBatchRBST() that sets found[i] for the sorted keys[first..last-1], like rankBatchHelper().
+void searchBatchHelper(TreeNode* currentNode, const int keys[], int first, int last, bool found[], int* nodesVisited) {
+    while (first < last) {
+        if (currentNode == NULL) {
+            for (int i = first; i < last; i++) {
+                found[i] = false;
+            }
+            return;
+        }
+        
+        (*nodesVisited)++;
+        
+        // Split the queries into the ones below, at and above the node's key.
+        int low = lowerBound(keys, first, last, currentNode->key);
+        int high = upperBound(keys, low, last, currentNode->key);
+        searchBatchHelper(currentNode->left, keys, first, low, found, nodesVisited);
+        for (int i = low; i < high; i++) {
+            found[i] = true;
+        }
+        
+        first = high;
+        currentNode = currentNode->right;
+    }
+}
+
+/*
+Sets found[i] to true if keys[i] is in the tree, for a batch of n queries sorted in increasing order, in 
+a single traversal. Unlike searchRBST(), it does not promote the keys in self-adjusting mode. Adds the 
+number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(M log(N/M + 1)) for M queries
+*/
+void searchBatchRBST(RBST* bst, const int keys[], int n, bool found[], int* nodesVisited) {
+    waitForRebuildRBST(bst);
+    
+    if (bst->isSmall) {
+        for (int i = 0; i < n; i++) {
+            int index = smallRank(bst, keys[i], false);
+            found[i] = (index < bst->numSmallKeys && bst->smallKeys[index] == keys[i]);
+        }
+        (*nodesVisited) += n;
+        
+        return;
+    }
+    
+    searchBatchHelper(bst->root, keys, 0, n, found, nodesVisited);
+}
+
+/*
+Makes the tree keep the hash of every subtree in its nodes, so that rangeHashRBST() takes expected 
+O(log(N)) and diffRBST() skips equal key ranges. Costs 8 bytes per node and a hash update on every 
+change, which trees that are never compared do not pay.
+
+Time Complexity: O(N)
+*/
+void useHashingRBST(RBST* bst) {
+    setNodeExtrasRBST(bst, bst->nodeExtras | NODE_HASHED);
+}
+
+/*
+Returns the sum of keyHash() over the keys in the subtree that are less than the key, 
+or less than or equal to it if 'inclusive' is true.
+
+Time Complexity: Expected O(log(N))
+*/
+uint64_t prefixHash(TreeNode* currentNode, int key, bool inclusive) {
+    uint64_t hash = 0;
+    
+    while (currentNode != NULL) {
+        if (key < currentNode->key || (key == currentNode->key && !inclusive)) {
+            currentNode = currentNode->left;
+        }
+        else {
+            hash += keyHash(currentNode->key) + subtreeHash(currentNode->left);
+            currentNode = currentNode->right;
+        }
+    }
+    
+    return hash;
+}
+
+// Helper function for rangeHashRBST() on trees without subtree hashes, which sums keyHash() over the keys in the range.
+uint64_t rangeKeyHash(TreeNode* currentNode, int low, int high) {
+    uint64_t hash = 0;
+    
+    while (currentNode != NULL) {
+        if (currentNode->key < low) {
+            currentNode = currentNode->right;
+        }
+        else if (currentNode->key > high) {
+            currentNode = currentNode->left;
+        }
+        else {
+            hash += keyHash(currentNode->key) + rangeKeyHash(currentNode->left, low, high);
+            currentNode = currentNode->right;
+        }
+    }
+    
+    return hash;
+}
+
+/*
+Returns the hash of the keys of the tree in the range [low, high]. Two trees hold the same keys 
+in the range if (with high probability) their range hashes and range counts are equal, whatever 
+their shapes are.
+
+Time Complexity: Expected O(log(N)) with subtree hashes (see useHashingRBST()), O(log(N) + K) without 
+them for K keys in the range
+*/
+uint64_t rangeHashRBST(RBST* bst, int low, int high) {
+    if (high < low) {
+        return 0;
+    }
+    
+    waitForRebuildRBST(bst);
+    if (bst->isSmall) {
+        uint64_t hash = 0;
+        
+        for (int i = 0; i < bst->numSmallKeys; i++) {
+            if (bst->smallKeys[i] >= low && bst->smallKeys[i] <= high) {
+                hash += keyHash(bst->smallKeys[i]);
+            }
+        }
+        
+        return hash;
+    }
+    
+    if (!(bst->nodeExtras & NODE_HASHED)) {
+        return rangeKeyHash(bst->root, low, high);
+    }
+    
+    return prefixHash(bst->root, high, true) - prefixHash(bst->root, low, false);
+}
+
+// Helper function for writing the keys of the subtree in the range [low, high] to keys[], in inorder.
+void collectRange(TreeNode* currentNode, int low, int high, int keys[], int* curIndex) {
+    while (currentNode != NULL) {
+        if (currentNode->key < low) {
+            currentNode = currentNode->right;
+        }
+        else if (currentNode->key > high) {
+            currentNode = currentNode->left;
+        }
+        else {
+            collectRange(currentNode->left, low, high, keys, curIndex);
+            keys[(*curIndex)++] = currentNode->key;
+            currentNode = currentNode->right;
+        }
+    }
+}
+
+// Writes the keys of the tree in the range [low, high] to keys[], in sorted order.
+void collectRangeRBST(RBST* bst, int low, int high, int keys[], int* curIndex) {
+    waitForRebuildRBST(bst);
+    if (!bst->isSmall) {
+        collectRange(bst->root, low, high, keys, curIndex);
+        return;
+    }
+    
+    for (int i = 0; i < bst->numSmallKeys; i++) {
+        if (bst->smallKeys[i] >= low && bst->smallKeys[i] <= high) {
+            keys[(*curIndex)++] = bst->smallKeys[i];
+        }
+    }
+}
+
+// Arguments shared by the recursive calls of diffRBST().
+typedef struct DiffJob {
+    RBST* a;
+    RBST* b;
+    void (*report)(int key, int countA, int countB, void* ctx);
+    void* ctx;
+    int* keysA; // Scratch space for the keys of small ranges, DIFF_LEAF_KEYS each.
+    int* keysB;
+    int numDifferences;
+} DiffJob;
+
+// Merges the sorted keys in job->keysA[] and job->keysB[], reporting every key whose number of copies differs.
+void reportDifferences(DiffJob* job, int lengthA, int lengthB) {
+    int i = 0;
+    int j = 0;
+    
+    while (i < lengthA || j < lengthB) {
+        int key = (j == lengthB || (i < lengthA && job->keysA[i] < job->keysB[j])) ? job->keysA[i] : job->keysB[j];
+        int copiesA = 0;
+        int copiesB = 0;
+        
+        while (i < lengthA && job->keysA[i] == key) {
+            copiesA++;
+            i++;
+        }
+        while (j < lengthB && job->keysB[j] == key) {
+            copiesB++;
+            j++;
+        }
+        if (copiesA != copiesB) {
+            job->report(key, copiesA, copiesB, job->ctx);
+            (job->numDifferences)++;
+        }
+    }
+}
+
+/*
+Helper function for diffRBST() that compares the trees on the key range [low, high]. Ranges with equal 
+counts and hashes are skipped, small ranges are compared key by key, and other ranges are halved.
+*/
+void diffRange(DiffJob* job, int low, int high) {
+    int countA = rangeCountRBST(job->a, low, high);
+    int countB = rangeCountRBST(job->b, low, high);
+    
+    if (countA == countB && rangeHashRBST(job->a, low, high) == rangeHashRBST(job->b, low, high)) {
+        return;
+    }
+    
+    if ((countA <= DIFF_LEAF_KEYS && countB <= DIFF_LEAF_KEYS) || low == high) {
+        int lengthA = 0;
+        int lengthB = 0;
+        
+        // A range with a single key value can hold any number of duplicates, compare their counts directly.
+        if (low == high) {
+            job->report(low, countA, countB, job->ctx);
+            (job->numDifferences)++;
+            return;
+        }
+        
+        collectRangeRBST(job->a, low, high, job->keysA, &lengthA);
+        collectRangeRBST(job->b, low, high, job->keysB, &lengthB);
+        reportDifferences(job, lengthA, lengthB);
+        return;
+    }
+    
+    int mid = (int) (((long long) low + high) >> 1);
+    diffRange(job, low, mid);
+    diffRange(job, mid + 1, high);
+}
+
+/*
+Compares two trees and calls report(key, countA, countB, ctx) for every key that has a different number 
+of copies in them, in increasing key order. Returns the number of keys reported. Whole key ranges with 
+equal hashes are skipped without visiting their nodes, so d differences cost O(d log(N) log(U)) for U 
+possible keys instead of O(N). This needs subtree hashes in both trees (see useHashingRBST()), otherwise 
+(unless a tree is small) the trees are merged in O(N).
+*/
+int diffRBST(RBST* a, RBST* b, void (*report)(int key, int countA, int countB, void* ctx), void* ctx) {
+    DiffJob job = { a, b, report, ctx, NULL, NULL, 0 };
+    
+    waitForRebuildRBST(a);
+    waitForRebuildRBST(b);
+    bool hashed = (a->isSmall || (a->nodeExtras & NODE_HASHED)) && (b->isSmall || (b->nodeExtras & NODE_HASHED));
+    int sizeA = sizeRBST(a);
+    int sizeB = sizeRBST(b);
+    
+    // Equal trees are recognized from their sizes and the hashes of their whole key range.
+    if (hashed && sizeA == sizeB && rangeHashRBST(a, INT_MIN, INT_MAX) == rangeHashRBST(b, INT_MIN, INT_MAX)) {
+        return 0;
+    }
+    
+    job.keysA = (int*) malloc((hashed ? DIFF_LEAF_KEYS : sizeA + 1) * sizeof(int));
+    job.keysB = (int*) malloc((hashed ? DIFF_LEAF_KEYS : sizeB + 1) * sizeof(int));
+    
+    // Check if memory allocation failed.
+    if (job.keysA == NULL || job.keysB == NULL) {
+        exit(0);
+    }
+    
+    if (hashed) {
+        diffRange(&job, INT_MIN, INT_MAX);
+    }
+    else {
+        int lengthA = 0;
+        int lengthB = 0;
+        
+        collectRangeRBST(a, INT_MIN, INT_MAX, job.keysA, &lengthA);
+        collectRangeRBST(b, INT_MIN, INT_MAX, job.keysB, &lengthB);
+        reportDifferences(&job, lengthA, lengthB);
+    }
+    
+    free(job.keysA);
+    free(job.keysB);
+    
+    return job.numDifferences;
+}
+
+/*
+Helper function for freeRBST() that uses recursion to free nodes while keeping track of nodesVisited.
+*/
+void freeRBSTHelper(TreeNode* currentNode, int* nodesVisited) {
+    if (currentNode == NULL) 
+        return;
+    (*nodesVisited)++;
+    freeRBSTHelper(currentNode->left, nodesVisited);
+    freeRBSTHelper(currentNode->right, nodesVisited);
+    free(currentNode);
+}
+
+/*
+Frees entire tree and returns number of nodes visited in O(N) time.
+If the tree uses an arena, its chunks are freed without visiting any nodes.
+*/
+int freeRBST(RBST* bst) {
+    int nodesVisited = 0;
+    
+    finishRebuildRBST(bst, &nodesVisited);
+    
+    // Free the tree
+    if (bst->arena != NULL) {
+        freeArena(bst->arena);
+    }
+    else {
+        freeRBSTHelper(bst->root, &nodesVisited);
+    }
+    free(bst);
+    
+    return nodesVisited;
+}
+
+// Number of freeRBSTAsync() calls whose tree has not been freed yet, guarded by asyncFreeLock.
+int pendingAsyncFrees = 0;
+pthread_mutex_t asyncFreeLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t asyncFreeDone = PTHREAD_COND_INITIALIZER;
+
+// Arguments of a parallel free, so that it can be run on its own thread.
+typedef struct FreeJob {
+    TreeNode* root;
+    int depth; // Number of levels at which the job may still split into two threads.
+    RBSTExecutor* executor; // The executor of the tree being freed.
+} FreeJob;
+
+/*
+Frees the subtree, splitting it into two jobs (the left subtree forked on the executor, the right subtree 
+on the current thread) while it is large enough and the depth allows it. The subtree sizes make this 
+split balanced without visiting the nodes first. Takes and returns a void* for forkJob().
+*/
+void* freeSubtreeJob(void* arg) {
+    FreeJob* job = (FreeJob*) arg;
+    TreeNode* root = job->root;
+    int nodesVisited = 0;
+    
+    if (root == NULL) {
+        return NULL;
+    }
+    
+    if (job->depth > 0 && root->size >= tuning.parallelFreeCutoff) {
+        FreeJob leftJob = { root->left, job->depth - 1, job->executor };
+        FreeJob rightJob = { root->right, job->depth - 1, job->executor };
+        RBSTFork leftFork;
+        
+        if (forkJob(job->executor, &leftFork, freeSubtreeJob, &leftJob)) {
+            freeSubtreeJob(&rightJob);
+            joinJob(job->executor, &leftFork);
+            free(root);
+            
+            return NULL;
+        }
+    }
+    
+    freeRBSTHelper(root, &nodesVisited);
+    
+    return NULL;
+}
+
+// Background thread of freeRBSTAsync(), which owns the detached tree.
+void* asyncFreeThread(void* arg) {
+    RBST* bst = (RBST*) arg;
+    
+    // Split into about one task per thread of the executor.
+    FreeJob job = { bst->root, forkDepth(bst->executor), bst->executor };
+    freeSubtreeJob(&job);
+    free(bst);
+    
+    pthread_mutex_lock(&asyncFreeLock);
+    pendingAsyncFrees--;
+    pthread_cond_broadcast(&asyncFreeDone);
+    pthread_mutex_unlock(&asyncFreeLock);
+    
+    return NULL;
+}
+
+/*
+Detaches the tree and frees it on a background thread, in parallel chunks for large trees, 
+so the caller does not wait for every node to be freed. The tree must not be used afterwards. 
+If the tree uses an arena, its chunks are freed right away, since that does not visit the nodes.
+Returns the number of nodes handed to the background thread.
+
+Time Complexity: O(1) for the caller (O(N) in the background)
+*/
+int freeRBSTAsync(RBST* bst) {
+    waitForRebuildRBST(bst);
+    int numNodes = nodeSize(bst->root);
+    pthread_t thread;
+    pthread_attr_t attr;
+    
+    if (bst->arena != NULL || bst->root == NULL) {
+        freeRBST(bst);
+        return 0;
+    }
+    
+    pthread_mutex_lock(&asyncFreeLock);
+    pendingAsyncFrees++;
+    pthread_mutex_unlock(&asyncFreeLock);
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    // Fall back to freeing on the calling thread if no thread can be created.
+    if (pthread_create(&thread, &attr, asyncFreeThread, bst) != 0) {
+        asyncFreeThread(bst);
+    }
+    pthread_attr_destroy(&attr);
+    
+    return numNodes;
+}
+
+// Blocks until every tree passed to freeRBSTAsync() has been freed, e.g. before the program exits.
+void waitForAsyncFrees() {
+    pthread_mutex_lock(&asyncFreeLock);
+    while (pendingAsyncFrees > 0) {
+        pthread_cond_wait(&asyncFreeDone, &asyncFreeLock);
+    }
+    pthread_mutex_unlock(&asyncFreeLock);
+}
+
+// Range of task indices owned by one worker of the work pool. Owners take from the front, thieves from the back.
+typedef struct TaskRange {
+    pthread_mutex_t lock;
+    int next; // The next task the owner runs.
+    int end; // One past the last task in the range.
+} TaskRange;
+
+/*
+Structure for a pool of worker threads that run a batch of independent tasks, numbered 0 to numTasks - 1. 
+Every worker starts with an equal, contiguous range of tasks, and a worker that runs out steals the back 
+half of another worker's remaining range. The calling thread takes part as worker 0.
+*/
+typedef struct WorkPool {
+    int numWorkers; // Number of workers, including the calling thread.
+    pthread_t* threads; // The numWorkers - 1 helper threads.
+    TaskRange* ranges; // The tasks left for every worker.
+    pthread_mutex_t jobLock; // Held for the duration of a batch, so only one batch runs at a time.
+    pthread_mutex_t lock; // Guards the fields below.
+    pthread_cond_t wake; // Signaled when a new batch starts.
+    pthread_cond_t done; // Signaled when a helper finishes its part of a batch.
+    int generation; // Incremented for every batch.
+    int active; // Number of helpers still working on the current batch.
+    void (*runTask)(void* ctx, int task); // Runs a single task of the current batch.
+    void* ctx;
+} WorkPool;
+
+// The shared pool, created on first use by getWorkPool().
+WorkPool* workPool = NULL;
+int workPoolSize = 0; // Number of workers for the pool, 0 for one per processor.
+pthread_once_t workPoolOnce = PTHREAD_ONCE_INIT;
+
+// Set on threads while they run tasks of the pool, so nested parallel calls run serially instead of deadlocking.
+__thread bool inWorkPool = false;
+
+// Takes the next task of the worker's own range, or steals from the other workers. Returns -1 when all are done.
+int takeTask(WorkPool* pool, int worker) {
+    TaskRange* own = &(pool->ranges[worker]);
+    int task = -1;
+    
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        task = (own->next)++;
+    }
+    pthread_mutex_unlock(&own->lock);
+    
+    // Steal the back half of the first victim with work left, keeping one task and queueing the rest.
+    for (int i = 1; i < pool->numWorkers && task == -1; i++) {
+        TaskRange* victim = &(pool->ranges[(worker + i) % pool->numWorkers]);
+        int first = 0;
+        int end = 0;
+        
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            first = victim->next + (victim->end - victim->next) / 2;
+            end = victim->end;
+            victim->end = first;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        
+        if (first < end) {
+            pthread_mutex_lock(&own->lock);
+            own->next = first + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            task = first;
+        }
+    }
+    
+    return task;
+}
+
+// Runs tasks of the current batch on the worker until none are left.
+void runWorker(WorkPool* pool, int worker) {
+    int task;
+    
+    inWorkPool = true;
+    while ((task = takeTask(pool, worker)) != -1) {
+        pool->runTask(pool->ctx, task);
+    }
+    inWorkPool = false;
+}
+
+// Main loop of a helper thread of the pool: waits for a batch, works on it, and reports back.
+void* workPoolThread(void* arg) {
+    WorkPool* pool = workPool;
+    int worker = (int) (intptr_t) arg;
+    int generation = 0;
+    
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == generation) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        
+        runWorker(pool, worker);
+        
+        pthread_mutex_lock(&pool->lock);
+        if (--(pool->active) == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    
+    return NULL;
+}
+
+// Creates the shared pool, with one worker per processor unless setWorkPoolSize() was called.
+void createWorkPool() {
+    WorkPool* pool = (WorkPool*) malloc(sizeof(WorkPool));
+    int numWorkers = (workPoolSize > 0) ? workPoolSize : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    
+    // Check if memory allocation failed.
+    if (pool == NULL) {
+        exit(0);
+    }
+    if (numWorkers < 1) {
+        numWorkers = 1;
+    }
+    
+    pool->threads = (pthread_t*) malloc(numWorkers * sizeof(pthread_t));
+    pool->ranges = (TaskRange*) malloc(numWorkers * sizeof(TaskRange));
+    if (pool->threads == NULL || pool->ranges == NULL) {
+        exit(0);
+    }
+    
+    pthread_mutex_init(&pool->jobLock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->generation = 0;
+    pool->active = 0;
+    pool->numWorkers = 1;
+    workPool = pool;
+    
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_mutex_init(&(pool->ranges[i].lock), NULL);
+    }
+    
+    // Start the helpers, the pool just gets smaller if a thread cannot be created.
+    for (int i = 1; i < numWorkers; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&(pool->threads[i]), &attr, workPoolThread, (void*) (intptr_t) pool->numWorkers) == 0) {
+            (pool->numWorkers)++;
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// Returns the shared pool, creating it on first use.
+WorkPool* getWorkPool() {
+    pthread_once(&workPoolOnce, createWorkPool);
+    
+    return workPool;
+}
+
+// Sets the number of workers of the shared pool. Only has an effect before the pool is first used.
+void setWorkPoolSize(int numWorkers) {
+    workPoolSize = numWorkers;
+}
+
+/*
+Runs runTask(ctx, task) for every task in [0, numTasks) on the shared pool, and returns once all have 
+finished. Tasks may run in any order and at the same time, so they must be independent. Runs the tasks 
+serially on the calling thread if the pool has a single worker or the call is made from inside a task.
+*/
+void runParallelTasks(int numTasks, void (*runTask)(void* ctx, int task), void* ctx) {
+    if (numTasks <= 0) {
+        return;
+    }
+    
+    WorkPool* pool = inWorkPool ? NULL : getWorkPool();
+    
+    if (pool == NULL || pool->numWorkers == 1 || numTasks == 1) {
+        for (int task = 0; task < numTasks; task++) {
+            runTask(ctx, task);
+        }
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->jobLock);
+    
+    // Hand every worker an equal share of the tasks to start with.
+    for (int i = 0; i < pool->numWorkers; i++) {
+        pool->ranges[i].next = (int) ((long long) numTasks * i / pool->numWorkers);
+        pool->ranges[i].end = (int) ((long long) numTasks * (i + 1) / pool->numWorkers);
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->runTask = runTask;
+    pool->ctx = ctx;
+    pool->active = pool->numWorkers - 1;
+    (pool->generation)++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    
+    runWorker(pool, 0);
+    
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    pthread_mutex_unlock(&pool->jobLock);
+}
+
+// Runs the batch of tasks on the tree's executor, or on the shared work pool (see runParallelTasks()).
+void runTreeTasks(RBST* bst, int numTasks, void (*runTask)(void* ctx, int task), void* ctx) {
+    if (bst->executor == NULL) {
+        runParallelTasks(numTasks, runTask, ctx);
+    }
+    else {
+        bst->executor->runTasks(bst->executor, numTasks, runTask, ctx);
+    }
+}
+
+// A piece of the tree for a parallel traversal: a whole subtree, or a single node on its own.
+typedef struct TraversalTask {
+    TreeNode* node;
+    bool wholeSubtree; // If false, only the node's own key belongs to the task.
+} TraversalTask;
+
+/*
+Helper function for splitting the tree into tasks of at most 'grain' nodes, listed in inorder. 
+Subtrees that are too large contribute their root as a single-node task between the tasks of 
+their left and right subtrees. The size fields make this O(number of tasks), without visiting the rest. 
+If tasks is NULL, the tasks are only counted.
+*/
+void splitTraversal(TreeNode* currentNode, int grain, TraversalTask tasks[], int* numTasks) {
+    if (currentNode == NULL) {
+        return;
+    }
+    
+    if (currentNode->size <= grain) {
+        if (tasks != NULL) {
+            tasks[*numTasks].node = currentNode;
+            tasks[*numTasks].wholeSubtree = true;
+        }
+        (*numTasks)++;
+        return;
+    }
+    
+    splitTraversal(currentNode->left, grain, tasks, numTasks);
+    if (tasks != NULL) {
+        tasks[*numTasks].node = currentNode;
+        tasks[*numTasks].wholeSubtree = false;
+    }
+    (*numTasks)++;
+    splitTraversal(currentNode->right, grain, tasks, numTasks);
+}
+
+/*
+Splits the tree into inorder tasks for a parallel traversal, about PARALLEL_TASKS_PER_WORKER per worker 
+so that stealing can even out the load. Returns the tasks, and their number through numTasks.
+*/
+TraversalTask* makeTraversalTasks(RBST* bst, int* numTasks) {
+    waitForRebuildRBST(bst);
+    int numNodes = nodeSize(bst->root);
+    int numWorkers = (bst->executor == NULL) ? getWorkPool()->numWorkers : bst->executor->numThreads;
+    int grain = numNodes / (numWorkers * PARALLEL_TASKS_PER_WORKER);
+    
+    if (grain < tuning.traversalGrain) {
+        grain = tuning.traversalGrain;
+    }
+    
+    // Count the tasks first, then list them.
+    *numTasks = 0;
+    splitTraversal(bst->root, grain, NULL, numTasks);
+    
+    TraversalTask* tasks = (TraversalTask*) malloc((*numTasks + 1) * sizeof(TraversalTask));
+    
+    // Check if memory allocation failed.
+    if (tasks == NULL) {
+        exit(0);
+    }
+    
+    *numTasks = 0;
+    splitTraversal(bst->root, grain, tasks, numTasks);
+    
+    return tasks;
+}
+
+// Calls fn(key, ctx) on every key of the subtree, in inorder.
+void forEachRBSTHelper(TreeNode* currentNode, void (*fn)(int key, void* ctx), void* ctx) {
+    while (currentNode != NULL) {
+        forEachRBSTHelper(currentNode->left, fn, ctx);
+        fn(currentNode->key, ctx);
+        currentNode = currentNode->right;
+    }
+}
+
+// Arguments shared by the tasks of parallelForEach().
+typedef struct ForEachJob {
+    TraversalTask* tasks;
+    void (*fn)(int key, void* ctx);
+    void* ctx;
+} ForEachJob;
+
+// Runs a single task of parallelForEach().
+void forEachTask(void* arg, int task) {
+    ForEachJob* job = (ForEachJob*) arg;
+    TraversalTask* piece = &(job->tasks[task]);
+    
+    if (piece->wholeSubtree) {
+        forEachRBSTHelper(piece->node, job->fn, job->ctx);
+    }
+    else {
+        job->fn(piece->node->key, job->ctx);
+    }
+}
+
+/*
+Calls fn(key, ctx) on every key of the tree, in parallel on the tree's executor. The keys of each task 
+are visited in inorder, but tasks run concurrently, so fn must be safe to call from several threads. 
+The tree must not be modified until the call returns.
+
+Time Complexity: O(N / P + log(N)) with P workers
+*/
+void parallelForEach(RBST* bst, void (*fn)(int key, void* ctx), void* ctx) {
+    int numTasks;
+    
+    // A small tree is not worth splitting.
+    if (bst->isSmall) {
+        for (int i = 0; i < bst->numSmallKeys; i++) {
+            fn(bst->smallKeys[i], ctx);
+        }
+        return;
+    }
+    
+    TraversalTask* tasks = makeTraversalTasks(bst, &numTasks);
+    ForEachJob job = { tasks, fn, ctx };
+    
+    runTreeTasks(bst, numTasks, forEachTask, &job);
+    
+    free(tasks);
+}
+
+// Arguments shared by the tasks of parallelReduce().
+typedef struct ReduceJob {
+    TraversalTask* tasks;
+    long long* partials; // The reduction of every task.
+    long long (*map)(int key, void* ctx);
+    long long (*combine)(long long left, long long right, void* ctx);
+    long long identity;
+    void* ctx;
+} ReduceJob;
+
+// Helper function for reducing the subtree in inorder, starting from the given accumulated value.
+long long reduceRBSTHelper(TreeNode* currentNode, ReduceJob* job, long long accumulated) {
+    while (currentNode != NULL) {
+        accumulated = reduceRBSTHelper(currentNode->left, job, accumulated);
+        accumulated = job->combine(accumulated, job->map(currentNode->key, job->ctx), job->ctx);
+        currentNode = currentNode->right;
+    }
+    
+    return accumulated;
+}
+
+// Runs a single task of parallelReduce().
+void reduceTask(void* arg, int task) {
+    ReduceJob* job = (ReduceJob*) arg;
+    TraversalTask* piece = &(job->tasks[task]);
+    
+    if (piece->wholeSubtree) {
+        job->partials[task] = reduceRBSTHelper(piece->node, job, job->identity);
+    }
+    else {
+        job->partials[task] = job->map(piece->node->key, job->ctx);
+    }
+}
+
+/*
+Maps every key of the tree with map(key, ctx) and combines the results with combine(left, right, ctx), 
+in parallel on the tree's executor. The tasks are combined from left to right in inorder, so combine 
+only has to be associative (not commutative), and 'identity' must be its identity element. 
+map and combine must be safe to call from several threads.
+
+Time Complexity: O(N / P + log(N)) with P workers
+*/
+long long parallelReduce(RBST* bst, long long (*map)(int key, void* ctx), 
+                         long long (*combine)(long long left, long long right, void* ctx), long long identity, void* ctx) {
+    int numTasks;
+    
+    if (bst->isSmall) {
+        long long result = identity;
+        
+        for (int i = 0; i < bst->numSmallKeys; i++) {
+            result = combine(result, map(bst->smallKeys[i], ctx), ctx);
+        }
+        return result;
+    }
+    
+    TraversalTask* tasks = makeTraversalTasks(bst, &numTasks);
+    long long* partials = (long long*) malloc((numTasks + 1) * sizeof(long long));
+    long long result = identity;
+    
+    // Check if memory allocation failed.
+    if (partials == NULL) {
+        exit(0);
+    }
+    
+    ReduceJob job = { tasks, partials, map, combine, identity, ctx };
+    runTreeTasks(bst, numTasks, reduceTask, &job);
+    
+    for (int task = 0; task < numTasks; task++) {
+        result = combine(result, partials[task], ctx);
+    }
+    
+    free(partials);
+    free(tasks);
+    
+    return result;
+}
+
+/*
+Key-value service: a single-threaded epoll server that owns one tree and serves it over a Unix socket, 
+or over loopback TCP for addresses of the form "tcp:<port>". 
+
+Every request is REQUEST_SIZE bytes: a one byte opcode followed by two 32-bit keys in host byte order 
+(the second one is only used by OP_RANGE). Every response is a 32-bit result in host byte order, and 
+responses are sent in the order of the requests on each connection, so clients can pipeline requests. 
+ - OP_INSERT: inserts the key, returns 1.
+ - OP_SEARCH / OP_DELETE: returns 1 if the key was found (and deleted), 0 if not.
+ - OP_RANK: returns the number of keys less than the key.
+ - OP_RANGE: returns the number of keys in [key, key2].
+*/
+#define OP_INSERT 1
+#define OP_SEARCH 2
+#define OP_DELETE 3
+#define OP_RANK 4
+#define OP_RANGE 5
+
+#define REQUEST_SIZE 9
+#define RESPONSE_SIZE 4
+
+// Size of the receive buffer of a connection, and the most events handled per epoll_wait() call.
+#define SERVER_BUFFER_SIZE (REQUEST_SIZE * 4096)
+#define SERVER_MAX_EVENTS 256
+
+// A connection is not read from while it has more than this many bytes of unsent responses, so a client 
+// that sends requests without reading the responses cannot make the server buffer them without bound.
+#define SERVER_MAX_OUTPUT (1 << 20)
+
+// Structure for a client connection of the server.
+typedef struct Connection {
+    int fd;
+    bool closing; // Set once the client hung up, the connection is closed after the current batch.
+    unsigned char in[SERVER_BUFFER_SIZE]; // Received bytes that do not form a full request yet.
+    int inLength;
+    unsigned char* out; // Responses that have not been sent yet.
+    int outLength;
+    int outCapacity;
+} Connection;
+
+// Structure for a request waiting in the current batch.
+typedef struct PendingOp {
+    Connection* conn;
+    int order; // Arrival order within the batch.
+    unsigned char op;
+    int key;
+    int key2;
+    int result;
+} PendingOp;
+
+// Structure for the state of the server.
+typedef struct RBSTServer {
+    RBST* bst;
+    int listenFd;
+    int epollFd;
+    Connection** conns; // Connections indexed by file descriptor.
+    int connsCapacity;
+    PendingOp* batch; // The requests received in the current round, in arrival order.
+    int batchLength;
+    int batchCapacity;
+    PendingOp** sorted; // Scratch space for sorting a run of the batch by key.
+} RBSTServer;
+
+// Set by the signal handler to make the server loop return.
+volatile sig_atomic_t serverStopping = 0;
+
+void stopServer(int signum) {
+    (void) signum;
+    serverStopping = 1;
+}
+
+// Makes the file descriptor non-blocking. Returns false on failure.
+bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+/*
+Creates a socket for the address, "tcp:<port>" for loopback TCP or a path for a Unix socket, and either 
+binds and listens on it (isServer) or connects it. Returns the file descriptor, or -1 on failure.
+*/
+int openSocket(const char* address, bool isServer) {
+    int fd;
+    int result;
+    
+    if (strncmp(address, "tcp:", 4) == 0) {
+        struct sockaddr_in addr;
+        int one = 1;
+        
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) atoi(address + 4));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        if (isServer) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            result = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+        }
+        else {
+            result = connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+        }
+    }
+    else {
+        struct sockaddr_un addr;
+        
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        
+        if (isServer) {
+            unlink(address);
+            result = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+        }
+        else {
+            result = connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+        }
+    }
+    
+    if (result == -1 || (isServer && listen(fd, SOMAXCONN) == -1)) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+// Appends bytes to the send buffer of the connection, growing it as needed.
+void appendOutput(Connection* conn, const void* bytes, int length) {
+    if (conn->outLength + length > conn->outCapacity) {
+        int capacity = (conn->outCapacity > 0) ? conn->outCapacity : 4096;
+        while (capacity < conn->outLength + length) {
+            capacity *= 2;
+        }
+        
+        conn->out = (unsigned char*) realloc(conn->out, capacity);
+        
+        // Check if memory allocation failed.
+        if (conn->out == NULL) {
+            exit(0);
+        }
+        conn->outCapacity = capacity;
+    }
+    
+    memcpy(conn->out + conn->outLength, bytes, length);
+    conn->outLength += length;
+}
+
+/*
+Sends as much of the connection's buffered output as the socket accepts, and waits for EPOLLOUT if some is left. 
+Stops waiting for EPOLLIN while more than SERVER_MAX_OUTPUT bytes are left, until a later call drains them.
+*/
+void flushConnection(RBSTServer* server, Connection* conn) {
+    int sent = 0;
+    
+    while (sent < conn->outLength) {
+        ssize_t n = write(conn->fd, conn->out + sent, conn->outLength - sent);
+        if (n <= 0) {
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                conn->closing = true;
+            }
+            break;
+        }
+        sent += (int) n;
+    }
+    
+    memmove(conn->out, conn->out + sent, conn->outLength - sent);
+    conn->outLength -= sent;
+    
+    struct epoll_event event;
+    event.events = ((conn->outLength <= SERVER_MAX_OUTPUT) ? EPOLLIN : 0) | ((conn->outLength > 0) ? EPOLLOUT : 0);
+    event.data.fd = conn->fd;
+    epoll_ctl(server->epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// Accepts every pending connection on the listening socket.
+void acceptConnections(RBSTServer* server) {
+    int fd;
+    
+    while ((fd = accept(server->listenFd, NULL, NULL)) != -1) {
+        if (!setNonBlocking(fd)) {
+            close(fd);
+            continue;
+        }
+        
+        // Grow the table of connections to fit the file descriptor.
+        if (fd >= server->connsCapacity) {
+            int capacity = server->connsCapacity * 2;
+            while (capacity <= fd) {
+                capacity *= 2;
+            }
+            server->conns = (Connection**) realloc(server->conns, capacity * sizeof(Connection*));
+            if (server->conns == NULL) {
+                exit(0);
+            }
+            memset(server->conns + server->connsCapacity, 0, (capacity - server->connsCapacity) * sizeof(Connection*));
+            server->connsCapacity = capacity;
+        }
+        
+        Connection* conn = (Connection*) calloc(1, sizeof(Connection));
+        if (conn == NULL) {
+            exit(0);
+        }
+        conn->fd = fd;
+        server->conns[fd] = conn;
+        
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+// Reads what the client sent, and adds every complete request to the current batch.
+void readRequests(RBSTServer* server, Connection* conn) {
+    while (!conn->closing) {
+        ssize_t n = read(conn->fd, conn->in + conn->inLength, SERVER_BUFFER_SIZE - conn->inLength);
+        
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn->closing = true;
+        }
+        if (n <= 0) {
+            break;
+        }
+        conn->inLength += (int) n;
+        
+        int offset = 0;
+        while (conn->inLength - offset >= REQUEST_SIZE) {
+            if (server->batchLength == server->batchCapacity) {
+                server->batchCapacity *= 2;
+                server->batch = (PendingOp*) realloc(server->batch, server->batchCapacity * sizeof(PendingOp));
+                server->sorted = (PendingOp**) realloc(server->sorted, server->batchCapacity * sizeof(PendingOp*));
+                if (server->batch == NULL || server->sorted == NULL) {
+                    exit(0);
+                }
+            }
+            
+            PendingOp* pending = &(server->batch[server->batchLength]);
+            pending->conn = conn;
+            pending->order = server->batchLength;
+            pending->op = conn->in[offset];
+            memcpy(&pending->key, conn->in + offset + 1, sizeof(int));
+            memcpy(&pending->key2, conn->in + offset + 5, sizeof(int));
+            (server->batchLength)++;
+            offset += REQUEST_SIZE;
+        }
+        
+        // Keep the bytes of a partial request for the next read.
+        memmove(conn->in, conn->in + offset, conn->inLength - offset);
+        conn->inLength -= offset;
+    }
+}
+
+// Applies a single request to the tree and stores its result.
+void applyOp(RBST* bst, PendingOp* pending) {
+    int nodesVisited = 0;
+    
+    switch (pending->op) {
+        case OP_INSERT:
+            insertRBST(bst, pending->key);
+            pending->result = 1;
+            break;
+        case OP_SEARCH:
+            pending->result = searchRBST(bst, pending->key, &nodesVisited);
+            break;
+        case OP_DELETE:
+            pending->result = deleteRBST(bst, pending->key, &nodesVisited);
+            break;
+        case OP_RANK:
+            pending->result = rankRBST(bst, pending->key);
+            break;
+        case OP_RANGE:
+            pending->result = rangeCountRBST(bst, pending->key, pending->key2);
+            break;
+        default:
+            pending->result = -1;
+            break;
+    }
+}
+
+// Orders requests by key, and requests on the same key by arrival.
+int comparePendingOps(const void* a, const void* b) {
+    const PendingOp* x = *(const PendingOp* const*) a;
+    const PendingOp* y = *(const PendingOp* const*) b;
+    
+    if (x->key != y->key) {
+        return (x->key < y->key) ? -1 : 1;
+    }
+    
+    return x->order - y->order;
+}
+
+/*
+Applies the requests batch[first..last) (which only touch a single key each) in key order, so consecutive 
+descents share the top of the tree in cache. Requests on different keys commute, and requests on the same 
+key keep their arrival order, so the results are the same as applying them in arrival order.
+*/
+void applySortedRun(RBSTServer* server, int first, int last) {
+    int length = last - first;
+    
+    for (int i = 0; i < length; i++) {
+        server->sorted[i] = &(server->batch[first + i]);
+    }
+    qsort(server->sorted, length, sizeof(PendingOp*), comparePendingOps);
+    
+    for (int i = 0; i < length; i++) {
+        applyOp(server->bst, server->sorted[i]);
+    }
+}
+
+/*
+Applies the current batch to the tree and queues the responses. OP_RANK and OP_RANGE depend on many keys, 
+so they split the batch into runs: the single-key requests between them are sorted and applied together.
+*/
+void applyBatch(RBSTServer* server) {
+    int first = 0;
+    
+    for (int i = 0; i < server->batchLength; i++) {
+        unsigned char op = server->batch[i].op;
+        
+        if (op == OP_RANK || op == OP_RANGE) {
+            applySortedRun(server, first, i);
+            applyOp(server->bst, &(server->batch[i]));
+            first = i + 1;
+        }
+    }
+    applySortedRun(server, first, server->batchLength);
+    
+    // Responses go out in arrival order, which is the request order of every connection.
+    for (int i = 0; i < server->batchLength; i++) {
+        PendingOp* pending = &(server->batch[i]);
+        appendOutput(pending->conn, &pending->result, RESPONSE_SIZE);
+    }
+    server->batchLength = 0;
+}
+
+// Closes the connection and frees its buffers.
+void closeConnection(RBSTServer* server, Connection* conn) {
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    server->conns[conn->fd] = NULL;
+    free(conn->out);
+    free(conn);
+}
+
+/*
+Serves the tree on the address until SIGINT or SIGTERM. Every round reads all requests that are ready 
+on every connection, applies them as one batch (see applyBatch()), and then sends the responses. 
+Returns false if the address cannot be listened on.
+*/
+bool runServer(RBST* bst, const char* address) {
+    RBSTServer server;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    struct epoll_event event;
+    
+    server.bst = bst;
+    server.listenFd = openSocket(address, true);
+    if (server.listenFd == -1 || !setNonBlocking(server.listenFd)) {
+        return false;
+    }
+    
+    server.epollFd = epoll_create1(0);
+    server.connsCapacity = 1024;
+    server.conns = (Connection**) calloc(server.connsCapacity, sizeof(Connection*));
+    server.batchCapacity = 4096;
+    server.batchLength = 0;
+    server.batch = (PendingOp*) malloc(server.batchCapacity * sizeof(PendingOp));
+    server.sorted = (PendingOp**) malloc(server.batchCapacity * sizeof(PendingOp*));
+    
+    // Check if memory allocation failed.
+    if (server.epollFd == -1 || server.conns == NULL || server.batch == NULL || server.sorted == NULL) {
+        exit(0);
+    }
+    
+    event.events = EPOLLIN;
+    event.data.fd = server.listenFd;
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &event);
+    
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGPIPE, SIG_IGN);
+    
+    while (!serverStopping) {
+        int numEvents = epoll_wait(server.epollFd, events, SERVER_MAX_EVENTS, -1);
+        
+        // Read every ready connection first, so their requests end up in one batch.
+        for (int i = 0; i < numEvents; i++) {
+            int fd = events[i].data.fd;
+            
+            if (fd == server.listenFd) {
+                acceptConnections(&server);
+            }
+            else if (server.conns[fd] != NULL && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                readRequests(&server, server.conns[fd]);
+            }
+        }
+        
+        applyBatch(&server);
+        
+        // Send the responses, and close the connections whose clients hung up.
+        for (int i = 0; i < numEvents; i++) {
+            int fd = events[i].data.fd;
+            Connection* conn = (fd != server.listenFd) ? server.conns[fd] : NULL;
+            
+            if (conn == NULL) {
+                continue;
+            }
+            if (conn->outLength > 0) {
+                flushConnection(&server, conn);
+            }
+            if (conn->closing) {
+                closeConnection(&server, conn);
+            }
+        }
+    }
+    
+    for (int fd = 0; fd < server.connsCapacity; fd++) {
+        if (server.conns[fd] != NULL) {
+            closeConnection(&server, server.conns[fd]);
+        }
+    }
+    close(server.epollFd);
+    close(server.listenFd);
+    if (strncmp(address, "tcp:", 4) != 0) {
+        unlink(address);
+    }
+    free(server.conns);
+    free(server.batch);
+    free(server.sorted);
+    
+    return true;
+}
+
+// Structure for a connection of the load generator.
+typedef struct LoadConnection {
+    int fd;
+    int sent; // Requests sent so far.
+    int received; // Responses received so far.
+    int quota; // Requests this connection sends in total.
+    double* sendTimes; // Send time of every request in flight, indexed by request number modulo the depth.
+    unsigned char in[RESPONSE_SIZE * 1024]; // Received bytes that do not form a full response yet.
+    int inLength;
+} LoadConnection;
+
+// Returns the current time in seconds, from a monotonic clock.
+double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Sends requests on the connection until 'depth' are in flight or its quota is reached.
+void sendLoadRequests(LoadConnection* conn, int depth, int keySpace) {
+    unsigned char requests[REQUEST_SIZE * 64];
+    
+    while (conn->sent < conn->quota && conn->sent - conn->received < depth) {
+        int count = 0;
+        double now = monotonicSeconds();
+        
+        while (count < 64 && conn->sent < conn->quota && conn->sent - conn->received < depth) {
+            // Mix: 50% inserts, 30% searches, 10% deletes, 5% ranks and 5% range counts.
+            int dice = rand() % 100;
+            unsigned char op = (dice < 50) ? OP_INSERT : (dice < 80) ? OP_SEARCH : (dice < 90) ? OP_DELETE 
+                             : (dice < 95) ? OP_RANK : OP_RANGE;
+            int key = rand() % keySpace;
+            int key2 = key + keySpace / 100;
+            
+            requests[count * REQUEST_SIZE] = op;
+            memcpy(requests + count * REQUEST_SIZE + 1, &key, sizeof(int));
+            memcpy(requests + count * REQUEST_SIZE + 5, &key2, sizeof(int));
+            conn->sendTimes[conn->sent % depth] = now;
+            (conn->sent)++;
+            count++;
+        }
+        
+        // Loopback sockets have room for a few requests, so a short write is treated as a failure.
+        if (write(conn->fd, requests, count * REQUEST_SIZE) != count * REQUEST_SIZE) {
+            fprintf(stderr, "Load generator: write failed\n");
+            exit(1);
+        }
+    }
+}
+
+// Compares two latencies for qsort().
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    
+    return (x > y) - (x < y);
+}
+
+/*
+Closes and frees the first numConnections connections of the load generator (the ones it has 
+started to open), its latency buffer and its epoll instance.
+*/
+void freeLoadGenerator(LoadConnection* conns, int numConnections, double* latencies, int epollFd) {
+    for (int i = 0; i < numConnections; i++) {
+        if (conns[i].fd != -1) {
+            close(conns[i].fd);
+        }
+        free(conns[i].sendTimes);
+    }
+    close(epollFd);
+    free(latencies);
+    free(conns);
+}
+
+/*
+Load generator for the server: opens numConnections connections to the address, and sends a mix of 
+numRequests requests in total, keeping up to 'depth' requests in flight on every connection. Prints the 
+throughput and the latency percentiles. Returns false if it cannot connect. All three counts have to be positive.
+*/
+bool runLoadGenerator(const char* address, int numConnections, int numRequests, int depth) {
+    LoadConnection* conns = (LoadConnection*) calloc(numConnections, sizeof(LoadConnection));
+    double* latencies = (double*) malloc(numRequests * sizeof(double));
+    int epollFd = epoll_create1(0);
+    int numLatencies = 0;
+    int keySpace = 1 << 20;
+    
+    // Check if memory allocation failed.
+    if (conns == NULL || latencies == NULL || epollFd == -1) {
+        exit(0);
+    }
+    
+    double start = monotonicSeconds();
+    
+    for (int i = 0; i < numConnections; i++) {
+        conns[i].fd = openSocket(address, false);
+        conns[i].quota = numRequests / numConnections + ((i < numRequests % numConnections) ? 1 : 0);
+        conns[i].sendTimes = (double*) malloc(depth * sizeof(double));
+        
+        if (conns[i].fd == -1 || conns[i].sendTimes == NULL) {
+            fprintf(stderr, "Load generator: cannot connect to %s\n", address);
+            freeLoadGenerator(conns, i + 1, latencies, epollFd);
+            return false;
+        }
+        
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = (uint32_t) i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, conns[i].fd, &event);
+        
+        sendLoadRequests(&conns[i], depth, keySpace);
+    }
+    
+    while (numLatencies < numRequests) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int numEvents = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, -1);
+        
+        for (int e = 0; e < numEvents; e++) {
+            LoadConnection* conn = &conns[events[e].data.u32];
+            ssize_t n = read(conn->fd, conn->in + conn->inLength, sizeof(conn->in) - conn->inLength);
+            
+            if (n <= 0) {
+                fprintf(stderr, "Load generator: connection closed by the server\n");
+                freeLoadGenerator(conns, numConnections, latencies, epollFd);
+                return false;
+            }
+            conn->inLength += (int) n;
+            
+            // Responses come back in request order, so the oldest request in flight is the one answered.
+            double now = monotonicSeconds();
+            int numResponses = conn->inLength / RESPONSE_SIZE;
+            for (int r = 0; r < numResponses; r++) {
+                latencies[numLatencies++] = now - conn->sendTimes[conn->received % depth];
+                (conn->received)++;
+            }
+            memmove(conn->in, conn->in + numResponses * RESPONSE_SIZE, conn->inLength - numResponses * RESPONSE_SIZE);
+            conn->inLength -= numResponses * RESPONSE_SIZE;
+            
+            sendLoadRequests(conn, depth, keySpace);
+        }
+    }
+    
+    double seconds = monotonicSeconds() - start;
+    qsort(latencies, numLatencies, sizeof(double), compareDoubles);
+    
+    printf("Requests: %d over %d connections (depth %d) in %.3fs: %.0f requests/s\n", 
+           numRequests, numConnections, depth, seconds, numRequests / seconds);
+    if (numLatencies > 0) {
+        printf("Latency: p50 %.1fus  p99 %.1fus  max %.1fus\n", latencies[numLatencies / 2] * 1e6, 
+               latencies[(int) (numLatencies * 0.99)] * 1e6, latencies[numLatencies - 1] * 1e6);
+    }
+    
+    freeLoadGenerator(conns, numConnections, latencies, epollFd);
+    
+    return true;
+}
+
+/*
+Operation-stream replication: a leader applies inserts and deletes to its tree and appends them to a 
+replication log, which is sent to a follower over a pipe or socket on every commit. The stream starts 
+with a snapshot of the leader's tree (its inorder keys and its shape) and a seed that both sides reseed 
+their generators with, so the follower makes the same random decisions and keeps an identical tree. 
+Trees in the self-adjusting mode, whose searches change the shape, and trees with background rebuilds, 
+which are swapped in depending on the timing of the helper thread, cannot be replicated. 
+
+Records are a one byte type followed by their payload, in host byte order: 
+ - REPL_SNAPSHOT: flags (1 byte), n (32 bits), n inorder keys, n preorder left subtree sizes.
+ - REPL_SEED: 64-bit seed.
+ - REPL_INSERT / REPL_DELETE: key (32 bits).
+*/
+#define REPL_SNAPSHOT 'S'
+#define REPL_SEED 'R'
+#define REPL_INSERT 'I'
+#define REPL_DELETE 'D'
+
+// Flags of a snapshot record, for the tree options that change the random decisions.
+#define REPL_FLAG_SHAPE_FIRST 1
+#define REPL_FLAG_SMALL 2
+#define REPL_FLAG_STABLE 4
+
+// Largest snapshot record a follower accepts, so that its buffer size stays within an int.
+#define REPL_MAX_RECORD (1 << 30)
+
+// Structure for the leader side of a replication stream.
+typedef struct ReplicationLog {
+    int fd;
+    unsigned char* buffer; // Records that have not been committed yet.
+    int length;
+    int capacity;
+} ReplicationLog;
+
+// Structure for the follower side of a replication stream.
+typedef struct ReplicationFollower {
+    RBST* bst; // The replica.
+    int fd;
+    unsigned char* buffer; // Received bytes that do not form a full record yet.
+    int length;
+    int capacity;
+} ReplicationFollower;
+
+// Writes all the bytes to the file descriptor, retrying short writes. Returns false on failure.
+bool writeAll(int fd, const void* bytes, size_t length) {
+    const unsigned char* next = (const unsigned char*) bytes;
+    
+    while (length > 0) {
+        ssize_t n = write(fd, next, length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        next += n;
+        length -= (size_t) n;
+    }
+    
+    return true;
+}
+
+// Appends bytes to the replication log's buffer, growing it as needed.
+void appendLog(ReplicationLog* log, const void* bytes, int length) {
+    if (log->length + length > log->capacity) {
+        int capacity = (log->capacity > 0) ? log->capacity : 4096;
+        while (capacity < log->length + length) {
+            capacity *= 2;
+        }
+        
+        log->buffer = (unsigned char*) realloc(log->buffer, capacity);
+        
+        // Check if memory allocation failed.
+        if (log->buffer == NULL) {
+            exit(0);
+        }
+        log->capacity = capacity;
+    }
+    
+    memcpy(log->buffer + log->length, bytes, length);
+    log->length += length;
+}
+
+// Helper function for writing the inorder keys of the subtree to keys[].
+void collectKeys(TreeNode* currentNode, int keys[], int* curIndex) {
+    while (currentNode != NULL) {
+        collectKeys(currentNode->left, keys, curIndex);
+        keys[(*curIndex)++] = currentNode->key;
+        currentNode = currentNode->right;
+    }
+}
+
+// Helper function for writing the left subtree size of every node to shape[], in preorder (see fillRBST()).
+void collectShape(TreeNode* currentNode, uint32_t shape[], int* preIndex) {
+    while (currentNode != NULL) {
+        shape[(*preIndex)++] = (uint32_t) nodeSize(currentNode->left);
+        collectShape(currentNode->left, shape, preIndex);
+        currentNode = currentNode->right;
+    }
+}
+
+// Commits the records appended since the last commit by sending them to the follower. Returns false on failure.
+bool commitReplication(ReplicationLog* log) {
+    bool sent = writeAll(log->fd, log->buffer, log->length);
+    log->length = 0;
+    
+    return sent;
+}
+
+/*
+Starts replicating the tree to the file descriptor: sends a snapshot of the tree and a new seed, 
+which the leader reseeds its own generator with. Returns the log to pass to the replicated operations, 
+or NULL on failure or if the tree is self-adjusting or uses background rebuilds.
+
+Time Complexity: O(N)
+*/
+ReplicationLog* startReplication(RBST* bst, int fd) {
+    if (bst->selfAdjusting || bst->backgroundRebuild) {
+        return NULL;
+    }
+    waitForRebuildRBST(bst);
+    ReplicationLog* log = (ReplicationLog*) calloc(1, sizeof(ReplicationLog));
+    int numNodes = sizeRBST(bst);
+    int* keys = (int*) malloc((numNodes + 1) * sizeof(int));
+    uint32_t* shape = (uint32_t*) calloc(numNodes + 1, sizeof(uint32_t));
+    unsigned char type = REPL_SNAPSHOT;
+    unsigned char flags = (bst->shapeFirstRebuild ? REPL_FLAG_SHAPE_FIRST : 0) | (bst->isSmall ? REPL_FLAG_SMALL : 0) 
+                        | (bst->stableNodes ? REPL_FLAG_STABLE : 0);
+    uint64_t seed = nextRandom(&bst->rng);
+    int curIndex = 0;
+    
+    // Check if memory allocation failed.
+    if (log == NULL || keys == NULL || shape == NULL) {
+        exit(0);
+    }
+    log->fd = fd;
+    
+    // A small tree is sent as its keys, with an unused all-zero shape.
+    if (bst->isSmall) {
+        memcpy(keys, bst->smallKeys, numNodes * sizeof(int));
+    }
+    else {
+        collectKeys(bst->root, keys, &curIndex);
+        curIndex = 0;
+        collectShape(bst->root, shape, &curIndex);
+    }
+    
+    appendLog(log, &type, 1);
+    appendLog(log, &flags, 1);
+    appendLog(log, &numNodes, sizeof(int));
+    appendLog(log, keys, numNodes * sizeof(int));
+    appendLog(log, shape, numNodes * sizeof(uint32_t));
+    
+    type = REPL_SEED;
+    appendLog(log, &type, 1);
+    appendLog(log, &seed, sizeof(uint64_t));
+    seedRNG(&bst->rng, seed);
+    
+    free(shape);
+    free(keys);
+    
+    if (!commitReplication(log)) {
+        free(log->buffer);
+        free(log);
+        return NULL;
+    }
+    
+    return log;
+}
+
+// Inserts the key into the leader's tree and logs it. Returns the number of nodes visited.
+int replicatedInsert(ReplicationLog* log, RBST* bst, int key) {
+    unsigned char record[1 + sizeof(int)] = { REPL_INSERT };
+    
+    memcpy(record + 1, &key, sizeof(int));
+    appendLog(log, record, sizeof(record));
+    
+    return insertRBST(bst, key);
+}
+
+// Deletes the key from the leader's tree and logs it. Returns true if the key was found.
+bool replicatedDelete(ReplicationLog* log, RBST* bst, int key, int* nodesVisited) {
+    unsigned char record[1 + sizeof(int)] = { REPL_DELETE };
+    
+    memcpy(record + 1, &key, sizeof(int));
+    appendLog(log, record, sizeof(record));
+    
+    return deleteRBST(bst, key, nodesVisited);
+}
+
+// Commits what is left in the log, closes the stream, and frees the log.
+void stopReplication(ReplicationLog* log) {
+    commitReplication(log);
+    close(log->fd);
+    free(log->buffer);
+    free(log);
+}
+
+// Creates the follower side of a stream read from the file descriptor, with an empty replica.
+ReplicationFollower* initFollower(int fd) {
+    ReplicationFollower* follower = (ReplicationFollower*) calloc(1, sizeof(ReplicationFollower));
+    
+    // Check if memory allocation failed.
+    if (follower == NULL) {
+        exit(0);
+    }
+    
+    follower->bst = initRBST();
+    follower->fd = fd;
+    follower->capacity = 1 << 16;
+    follower->buffer = (unsigned char*) malloc(follower->capacity);
+    if (follower->bst == NULL || follower->buffer == NULL) {
+        exit(0);
+    }
+    
+    return follower;
+}
+
+/*
+Applies the snapshot record at 'record' (after its type byte) to the follower, replacing the replica with 
+the leader's exact tree. Returns the size of the record, 0 if it has not been received completely, or -1 
+if its node count is negative or makes it larger than REPL_MAX_RECORD.
+*/
+int applySnapshot(ReplicationFollower* follower, const unsigned char* record, int available) {
+    int numNodes;
+    int preIndex = 0;
+    int nodesVisited = 0;
+    
+    if (available < 1 + (int) sizeof(int)) {
+        return 0;
+    }
+    memcpy(&numNodes, record + 1, sizeof(int));
+    
+    if (numNodes < 0 || (size_t) numNodes > (REPL_MAX_RECORD - 1 - sizeof(int)) / (sizeof(int) + sizeof(uint32_t))) {
+        return -1;
+    }
+    size_t length = 1 + sizeof(int) + (size_t) numNodes * (sizeof(int) + sizeof(uint32_t));
+    if ((size_t) available < length) {
+        return 0;
+    }
+    
+    int* keys = (int*) malloc((numNodes + 1) * sizeof(int));
+    uint32_t* shape = (uint32_t*) malloc((numNodes + 1) * sizeof(uint32_t));
+    
+    // Check if memory allocation failed.
+    if (keys == NULL || shape == NULL) {
+        exit(0);
+    }
+    memcpy(keys, record + 1 + sizeof(int), numNodes * sizeof(int));
+    memcpy(shape, record + 1 + sizeof(int) + numNodes * sizeof(int), numNodes * sizeof(uint32_t));
+    
+    freeRBSTHelper(follower->bst->root, &nodesVisited);
+    follower->bst->shapeFirstRebuild = (record[0] & REPL_FLAG_SHAPE_FIRST) != 0;
+    follower->bst->stableNodes = (record[0] & REPL_FLAG_STABLE) != 0;
+    if (follower->bst->stableNodes) {
+        follower->bst->nodeExtras |= NODE_LINKED;
+    }
+    follower->bst->isSmall = (record[0] & REPL_FLAG_SMALL) != 0 && numNodes <= SMALL_TREE_KEYS;
+    if (follower->bst->isSmall) {
+        memcpy(follower->bst->smallKeys, keys, numNodes * sizeof(int));
+        follower->bst->numSmallKeys = numNodes;
+        follower->bst->root = NULL;
+    }
+    else {
+        follower->bst->numSmallKeys = 0;
+        setRoot(follower->bst, fillRBST(follower->bst, keys, shape, 0, numNodes, &preIndex, &nodesVisited));
+    }
+    
+    free(shape);
+    free(keys);
+    
+    return (int) length;
+}
+
+/*
+Applies every complete record in the follower's buffer, in order, and keeps a trailing partial record 
+for the next read. Returns the number of records applied, or -1 if the stream is corrupt. 
+
+Inserts and deletes are replayed one at a time, not through deleteBatchRBST() or a batched build: the 
+replica only stays identical to the leader's tree if it draws the same random numbers in the same order, 
+and a batch draws them in a different order (and splits on the executor's threads) than the single 
+operations the leader applied.
+*/
+int applyReplicationRecords(ReplicationFollower* follower) {
+    int offset = 0;
+    int applied = 0;
+    int nodesVisited = 0;
+    
+    while (offset < follower->length) {
+        unsigned char type = follower->buffer[offset];
+        int available = follower->length - offset - 1;
+        const unsigned char* payload = follower->buffer + offset + 1;
+        int length;
+        
+        if (type == REPL_INSERT || type == REPL_DELETE) {
+            int key;
+            
+            length = sizeof(int);
+            if (available < length) {
+                break;
+            }
+            memcpy(&key, payload, sizeof(int));
+            
+            if (type == REPL_INSERT) {
+                insertRBST(follower->bst, key);
+            }
+            else {
+                deleteRBST(follower->bst, key, &nodesVisited);
+            }
+        }
+        else if (type == REPL_SEED) {
+            uint64_t seed;
+            
+            length = sizeof(uint64_t);
+            if (available < length) {
+                break;
+            }
+            memcpy(&seed, payload, sizeof(uint64_t));
+            seedRNG(&follower->bst->rng, seed);
+        }
+        else if (type == REPL_SNAPSHOT) {
+            length = applySnapshot(follower, payload, available);
+            if (length == -1) {
+                return -1;
+            }
+            if (length == 0) {
+                break;
+            }
+        }
+        else {
+            return -1;
+        }
+        
+        offset += 1 + length;
+        applied++;
+    }
+    
+    memmove(follower->buffer, follower->buffer + offset, follower->length - offset);
+    follower->length -= offset;
+    
+    return applied;
+}
+
+/*
+Reads whatever the leader has sent (up to the size of the buffer, in one system call) and applies it 
+to the replica. Blocks if the file descriptor is blocking and nothing has arrived. Returns false once 
+the stream has ended or is corrupt, true otherwise, so reads can be served between calls.
+*/
+bool pollFollower(ReplicationFollower* follower) {
+    // Make room for a snapshot that is larger than the buffer.
+    if (follower->length == follower->capacity) {
+        follower->capacity *= 2;
+        follower->buffer = (unsigned char*) realloc(follower->buffer, follower->capacity);
+        if (follower->buffer == NULL) {
+            exit(0);
+        }
+    }
+    
+    ssize_t n = read(follower->fd, follower->buffer + follower->length, follower->capacity - follower->length);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    follower->length += (int) n;
+    
+    return applyReplicationRecords(follower) != -1;
+}
+
+// Closes the stream and frees the follower, but not its replica, which is returned.
+RBST* stopFollower(ReplicationFollower* follower) {
+    RBST* bst = follower->bst;
+    
+    close(follower->fd);
+    free(follower->buffer);
+    free(follower);
+    
+    return bst;
+}
+
+/*
+External-memory mode: a randomized BST whose nodes live in fixed-size pages of a file, with a buffer pool 
+caching PAGED_POOL_FRAMES (or more) pages in memory and evicting with the CLOCK algorithm. Nodes are 
+referred to by 32-bit references (page number << 8 | slot), 0 being the empty subtree, since page 0 of the 
+file is the header. Every page starts with a PageHeader in slot 0, followed by PAGED_SLOTS node slots. 
+
+Free pages are tracked in bitmap pages, one per group of PAGED_GROUP_PAGES pages (page 1 for the first 
+group, the first page of the group for the others), like the block groups of a file system. 
+
+Inserts make the same random decisions as insertRBST(). Rebuilt subtrees with fewer than PAGED_SLOTS 
+nodes reuse their old slots. Larger ones free their old slots and are laid out in preorder on a run of 
+free pages (the first contiguous run that is large enough, or the end of the file), which is written 
+sequentially with one pwrite() per contiguous stretch instead of modifying scattered pages. 
+Preorder places every subtree on consecutive slots, so small subtrees share a page.
+*/
+#define PAGED_PAGE_SIZE 4096
+#define PAGED_SLOTS 255
+#define PAGED_POOL_FRAMES 64
+#define PAGED_MAGIC 0x52425354u
+#define PAGED_GROUP_PAGES (PAGED_PAGE_SIZE * 8)
+
+// Structure for a node in a page, with references to its children instead of pointers.
+typedef struct PagedNode {
+    int key;
+    int size;
+    uint32_t left;
+    uint32_t right;
+} PagedNode;
+
+// Structure for the header at the start (slot 0) of every node page.
+typedef struct PageHeader {
+    uint16_t used; // Number of slots holding nodes.
+    uint16_t bumped; // Slots below 1 + bumped have been handed out at least once.
+    uint16_t freeSlot; // First released slot, linked through the left field of the nodes, 0 if none.
+    uint16_t unused[5];
+} PageHeader;
+
+// Structure for the file header, stored in page 0.
+typedef struct PagedFileHeader {
+    uint32_t magic;
+    uint32_t root;
+    uint32_t numPages; // Number of pages in the file, including the header.
+    uint32_t freeHint; // No page below this one is free.
+    uint32_t fillPage; // Page new single nodes are placed on when their parent's page is full.
+    int numNodes;
+} PagedFileHeader;
+
+// Structure for a page cached in the buffer pool.
+typedef struct PageFrame {
+    uint32_t page; // The cached page, 0 if the frame is unused.
+    bool dirty;
+    bool referenced; // Second chance bit of the CLOCK algorithm.
+    unsigned char* data;
+} PageFrame;
+
+// Structure for a tree stored in a file.
+typedef struct PagedRBST {
+    int fd;
+    PagedFileHeader header;
+    RNG rng;
+    PageFrame* frames;
+    int numFrames;
+    int clockHand;
+    int* frameOf; // Frame holding every page, or -1, indexed by page number.
+    uint32_t frameOfCapacity;
+    long long pageReads; // Pages read from the file.
+    long long pageWrites; // Pages written to the file, counting the pages of sequential runs.
+} PagedRBST;
+
+// Makes sure frameOf[] has an entry for every page below numPages.
+void growFrameTable(PagedRBST* tree, uint32_t numPages) {
+    if (numPages <= tree->frameOfCapacity) {
+        return;
+    }
+    
+    uint32_t capacity = (tree->frameOfCapacity > 0) ? tree->frameOfCapacity : 1024;
+    while (capacity < numPages) {
+        capacity *= 2;
+    }
+    
+    tree->frameOf = (int*) realloc(tree->frameOf, capacity * sizeof(int));
+    
+    // Check if memory allocation failed.
+    if (tree->frameOf == NULL) {
+        exit(0);
+    }
+    for (uint32_t page = tree->frameOfCapacity; page < capacity; page++) {
+        tree->frameOf[page] = -1;
+    }
+    tree->frameOfCapacity = capacity;
+}
+
+// Writes the frame's page back to the file if it was modified.
+void writeBackFrame(PagedRBST* tree, PageFrame* frame) {
+    if (frame->page != 0 && frame->dirty) {
+        if (pwrite(tree->fd, frame->data, PAGED_PAGE_SIZE, (off_t) frame->page * PAGED_PAGE_SIZE) != PAGED_PAGE_SIZE) {
+            fprintf(stderr, "Paged tree: write of page %u failed\n", frame->page);
+            exit(1);
+        }
+        (tree->pageWrites)++;
+        frame->dirty = false;
+    }
+}
+
+/*
+Returns the cached contents of the page, reading it into the pool if needed. The returned memory is only 
+valid until the next call, since that may evict the page. The page is marked dirty if 'forWrite' is true.
+*/
+unsigned char* fetchPage(PagedRBST* tree, uint32_t page, bool forWrite) {
+    int index = tree->frameOf[page];
+    
+    if (index == -1) {
+        // Advance the clock hand to a frame that has not been referenced since the last pass.
+        while (tree->frames[tree->clockHand].referenced) {
+            tree->frames[tree->clockHand].referenced = false;
+            tree->clockHand = (tree->clockHand + 1) % tree->numFrames;
+        }
+        index = tree->clockHand;
+        tree->clockHand = (tree->clockHand + 1) % tree->numFrames;
+        
+        PageFrame* victim = &(tree->frames[index]);
+        writeBackFrame(tree, victim);
+        if (victim->page != 0) {
+            tree->frameOf[victim->page] = -1;
+        }
+        
+        if (pread(tree->fd, victim->data, PAGED_PAGE_SIZE, (off_t) page * PAGED_PAGE_SIZE) != PAGED_PAGE_SIZE) {
+            fprintf(stderr, "Paged tree: read of page %u failed\n", page);
+            exit(1);
+        }
+        (tree->pageReads)++;
+        victim->page = page;
+        tree->frameOf[page] = index;
+    }
+    
+    tree->frames[index].referenced = true;
+    if (forWrite) {
+        tree->frames[index].dirty = true;
+    }
+    
+    return tree->frames[index].data;
+}
+
+// Copies the node with the reference out of its page.
+void readPagedNode(PagedRBST* tree, uint32_t ref, PagedNode* node) {
+    unsigned char* data = fetchPage(tree, ref >> 8, false);
+    memcpy(node, data + (ref & 0xFF) * sizeof(PagedNode), sizeof(PagedNode));
+}
+
+// Copies the node into its slot of its page.
+void writePagedNode(PagedRBST* tree, uint32_t ref, const PagedNode* node) {
+    unsigned char* data = fetchPage(tree, ref >> 8, true);
+    memcpy(data + (ref & 0xFF) * sizeof(PagedNode), node, sizeof(PagedNode));
+}
+
+// Returns the size of the subtree with the reference, or 0 for the empty subtree.
+int pagedSize(PagedRBST* tree, uint32_t ref) {
+    PagedNode node;
+    
+    if (ref == 0) {
+        return 0;
+    }
+    readPagedNode(tree, ref, &node);
+    
+    return node.size;
+}
+
+// Returns the bitmap page that tracks the page.
+uint32_t bitmapPageOf(uint32_t page) {
+    uint32_t group = page / PAGED_GROUP_PAGES;
+    
+    return (group == 0) ? 1 : group * PAGED_GROUP_PAGES;
+}
+
+// Returns true if the page is in use: it holds nodes, a bitmap, the header, or is beyond the end of the file.
+bool isPageUsed(PagedRBST* tree, uint32_t page) {
+    if (page >= tree->header.numPages) {
+        return false;
+    }
+    
+    uint32_t bit = page % PAGED_GROUP_PAGES;
+    unsigned char* bitmap = fetchPage(tree, bitmapPageOf(page), false);
+    
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+// Marks the page as used or free in its bitmap.
+void setPageUsed(PagedRBST* tree, uint32_t page, bool used) {
+    uint32_t bit = page % PAGED_GROUP_PAGES;
+    unsigned char* bitmap = fetchPage(tree, bitmapPageOf(page), true);
+    
+    if (used) {
+        bitmap[bit / 8] |= (unsigned char) (1 << (bit % 8));
+    }
+    else {
+        bitmap[bit / 8] &= (unsigned char) ~(1 << (bit % 8));
+        if (page < tree->header.freeHint) {
+            tree->header.freeHint = page;
+        }
+    }
+}
+
+// Grows the file to numPages pages, and sets up the bitmap page of every group it enters.
+void extendPagedFile(PagedRBST* tree, uint32_t numPages) {
+    uint32_t oldNumPages = tree->header.numPages;
+    
+    if (numPages <= oldNumPages) {
+        return;
+    }
+    if (ftruncate(tree->fd, (off_t) numPages * PAGED_PAGE_SIZE) == -1) {
+        fprintf(stderr, "Paged tree: cannot grow the file to %u pages\n", numPages);
+        exit(1);
+    }
+    tree->header.numPages = numPages;
+    growFrameTable(tree, numPages);
+    
+    for (uint32_t page = oldNumPages; page < numPages; page++) {
+        if (page == bitmapPageOf(page)) {
+            memset(fetchPage(tree, page, true), 0, PAGED_PAGE_SIZE);
+            setPageUsed(tree, page, true);
+        }
+    }
+}
+
+// Returns an empty page, the first free page in the file or a new one at the end, marked as used.
+uint32_t allocatePage(PagedRBST* tree) {
+    uint32_t page = tree->header.freeHint;
+    
+    while (page < tree->header.numPages && isPageUsed(tree, page)) {
+        page++;
+    }
+    tree->header.freeHint = page + 1;
+    
+    // Grow the file past a bitmap page that the new page would otherwise be.
+    extendPagedFile(tree, page + 1);
+    if (isPageUsed(tree, page)) {
+        page = tree->header.numPages;
+        extendPagedFile(tree, page + 1);
+    }
+    
+    setPageUsed(tree, page, true);
+    memset(fetchPage(tree, page, true), 0, PAGED_PAGE_SIZE);
+    
+    return page;
+}
+
+/*
+Finds numPages free pages for a rebuilt subtree, marks them as used and writes their numbers to pages[]. 
+Takes the first contiguous run of free pages in the file that is long enough, or otherwise pages at the 
+end of the file, which are contiguous except for the bitmap pages of new groups.
+*/
+void allocatePageRun(PagedRBST* tree, uint32_t numPages, uint32_t pages[]) {
+    uint32_t runStart = tree->header.freeHint;
+    uint32_t runLength = 0;
+    
+    for (uint32_t page = tree->header.freeHint; page < tree->header.numPages && runLength < numPages; page++) {
+        if (isPageUsed(tree, page)) {
+            runStart = page + 1;
+            runLength = 0;
+        }
+        else {
+            runLength++;
+        }
+    }
+    
+    // Without a long enough run, take the free pages at the end of the file and grow it.
+    if (runLength < numPages) {
+        runStart = tree->header.numPages;
+        while (runStart > tree->header.freeHint && !isPageUsed(tree, runStart - 1)) {
+            runStart--;
+        }
+    }
+    
+    uint32_t page = runStart;
+    for (uint32_t i = 0; i < numPages; i++) {
+        extendPagedFile(tree, page + 1);
+        while (isPageUsed(tree, page)) {
+            page++;
+            extendPagedFile(tree, page + 1);
+        }
+        setPageUsed(tree, page, true);
+        pages[i] = page++;
+    }
+}
+
+// Takes a free slot of the page and returns its reference, or 0 if the page is full.
+uint32_t allocateSlot(PagedRBST* tree, uint32_t page) {
+    unsigned char* data = fetchPage(tree, page, true);
+    PageHeader* pageHeader = (PageHeader*) data;
+    uint32_t slot;
+    
+    if (pageHeader->freeSlot != 0) {
+        slot = pageHeader->freeSlot;
+        pageHeader->freeSlot = (uint16_t) ((PagedNode*) (data + slot * sizeof(PagedNode)))->left;
+    }
+    else if (pageHeader->bumped < PAGED_SLOTS) {
+        slot = ++(pageHeader->bumped);
+    }
+    else {
+        return 0;
+    }
+    (pageHeader->used)++;
+    
+    return (page << 8) | slot;
+}
+
+// Allocates a slot for a new node, on the page of 'near' if it has room, so parent and child share a page.
+uint32_t allocatePagedNode(PagedRBST* tree, uint32_t near) {
+    uint32_t ref = (near != 0) ? allocateSlot(tree, near >> 8) : 0;
+    
+    if (ref == 0 && tree->header.fillPage != 0) {
+        ref = allocateSlot(tree, tree->header.fillPage);
+    }
+    if (ref == 0) {
+        tree->header.fillPage = allocatePage(tree);
+        ref = allocateSlot(tree, tree->header.fillPage);
+    }
+    
+    return ref;
+}
+
+// Releases the node's slot, and marks its page as free once it has no nodes left.
+void freePagedNode(PagedRBST* tree, uint32_t ref) {
+    uint32_t page = ref >> 8;
+    unsigned char* data = fetchPage(tree, page, true);
+    PageHeader* pageHeader = (PageHeader*) data;
+    
+    ((PagedNode*) (data + (ref & 0xFF) * sizeof(PagedNode)))->left = pageHeader->freeSlot;
+    pageHeader->freeSlot = (uint16_t) (ref & 0xFF);
+    (pageHeader->used)--;
+    
+    if (pageHeader->used == 0) {
+        setPageUsed(tree, page, false);
+        if (tree->header.fillPage == page) {
+            tree->header.fillPage = 0;
+        }
+    }
+}
+
+/*
+Opens the tree stored in the file at the path, or creates an empty one if the file does not exist, with 
+numFrames pages cached in memory (at least PAGED_POOL_FRAMES). Returns NULL if the file cannot be used.
+*/
+PagedRBST* openPagedRBST(const char* path, int numFrames) {
+    PagedRBST* tree = (PagedRBST*) calloc(1, sizeof(PagedRBST));
+    
+    // Check if memory allocation failed.
+    if (tree == NULL) {
+        exit(0);
+    }
+    
+    tree->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (tree->fd == -1) {
+        free(tree);
+        return NULL;
+    }
+    
+    // Read the header of an existing file, or write a new one.
+    if (pread(tree->fd, &tree->header, sizeof(PagedFileHeader), 0) != sizeof(PagedFileHeader)) {
+        memset(&tree->header, 0, sizeof(PagedFileHeader));
+        tree->header.magic = PAGED_MAGIC;
+        tree->header.numPages = 1;
+        if (ftruncate(tree->fd, PAGED_PAGE_SIZE) == -1) {
+            close(tree->fd);
+            free(tree);
+            return NULL;
+        }
+        tree->header.freeHint = 2;
+    }
+    else if (tree->header.magic != PAGED_MAGIC) {
+        close(tree->fd);
+        free(tree);
+        return NULL;
+    }
+    
+    tree->numFrames = (numFrames > PAGED_POOL_FRAMES) ? numFrames : PAGED_POOL_FRAMES;
+    tree->frames = (PageFrame*) calloc(tree->numFrames, sizeof(PageFrame));
+    if (tree->frames == NULL) {
+        exit(0);
+    }
+    for (int i = 0; i < tree->numFrames; i++) {
+        tree->frames[i].data = (unsigned char*) malloc(PAGED_PAGE_SIZE);
+        if (tree->frames[i].data == NULL) {
+            exit(0);
+        }
+    }
+    growFrameTable(tree, tree->header.numPages);
+    seedRNG(&tree->rng, ((uint64_t) rand() << 32) ^ (uint64_t) rand());
+    
+    // A new file gets the bitmap page of the first group, which also marks the header page as used.
+    if (tree->header.numPages == 1) {
+        extendPagedFile(tree, 2);
+        setPageUsed(tree, 0, true);
+    }
+    
+    return tree;
+}
+
+// Writes every modified page and the header back to the file, and syncs it.
+void flushPagedRBST(PagedRBST* tree) {
+    for (int i = 0; i < tree->numFrames; i++) {
+        writeBackFrame(tree, &(tree->frames[i]));
+    }
+    if (pwrite(tree->fd, &tree->header, sizeof(PagedFileHeader), 0) != sizeof(PagedFileHeader)) {
+        fprintf(stderr, "Paged tree: write of the header failed\n");
+        exit(1);
+    }
+    fsync(tree->fd);
+}
+
+// Flushes the tree to its file, closes it and frees the buffer pool.
+void closePagedRBST(PagedRBST* tree) {
+    flushPagedRBST(tree);
+    close(tree->fd);
+    
+    for (int i = 0; i < tree->numFrames; i++) {
+        free(tree->frames[i].data);
+    }
+    free(tree->frames);
+    free(tree->frameOf);
+    free(tree);
+}
+
+// Structure for a subtree being rebuilt, with its nodes in preorder and their children as preorder indices.
+typedef struct PagedRebuild {
+    int* keys; // The sorted keys, including the new one.
+    uint32_t* oldRefs; // The references of the old nodes, in inorder.
+    int numOld;
+    PagedNode* nodes; // The new nodes in preorder, with preorder indices + 1 as children (0 for none).
+    int numNodes;
+} PagedRebuild;
+
+// Helper function for writing the keys and references of the paged subtree to the rebuild, in inorder.
+void flattenPaged(PagedRBST* tree, uint32_t ref, PagedRebuild* rebuild, int* nodesVisited) {
+    PagedNode node;
+    
+    while (ref != 0) {
+        readPagedNode(tree, ref, &node);
+        (*nodesVisited)++;
+        
+        flattenPaged(tree, node.left, rebuild, nodesVisited);
+        rebuild->keys[rebuild->numOld] = node.key;
+        rebuild->oldRefs[(rebuild->numOld)++] = ref;
+        ref = node.right;
+    }
+}
+
+/*
+Helper function for laying out the randomized subtree of keys[first..last] in preorder, like makeRBST() 
+does with TreeNodes: the new key is the root, and every other subtree has a uniformly random root. 
+Returns the preorder index + 1 of the subtree's root, or 0 for an empty subtree.
+*/
+uint32_t makePagedShape(PagedRBST* tree, PagedRebuild* rebuild, int first, int last, int newNodeIndex, bool isAdded) {
+    if (last < first) {
+        return 0;
+    }
+    
+    int index = isAdded ? first + (int) randomBelow(&tree->rng, (uint32_t) (last - first + 1)) : newNodeIndex;
+    int pre = (rebuild->numNodes)++;
+    
+    rebuild->nodes[pre].key = rebuild->keys[index];
+    rebuild->nodes[pre].size = last - first + 1;
+    rebuild->nodes[pre].left = makePagedShape(tree, rebuild, first, index - 1, newNodeIndex, true);
+    rebuild->nodes[pre].right = makePagedShape(tree, rebuild, index + 1, last, newNodeIndex, true);
+    
+    return (uint32_t) pre + 1;
+}
+
+/*
+Rebuilds the paged subtree with the reference with the new key at its root, and returns the reference of 
+the new subtree root. See the description of the external-memory mode for where the nodes are placed.
+
+Time Complexity: O(N) node accesses, O(N / PAGED_SLOTS) page writes for large subtrees
+*/
+uint32_t rebuildPaged(PagedRBST* tree, uint32_t ref, int key, int* nodesVisited) {
+    int numNodes = pagedSize(tree, ref) + 1;
+    PagedRebuild rebuild;
+    uint32_t* newRefs = (uint32_t*) malloc(numNodes * sizeof(uint32_t));
+    
+    rebuild.keys = (int*) malloc(numNodes * sizeof(int));
+    rebuild.oldRefs = (uint32_t*) malloc(numNodes * sizeof(uint32_t));
+    rebuild.nodes = (PagedNode*) malloc(numNodes * sizeof(PagedNode));
+    rebuild.numOld = 0;
+    rebuild.numNodes = 0;
+    
+    // Check if memory allocation failed.
+    if (newRefs == NULL || rebuild.keys == NULL || rebuild.oldRefs == NULL || rebuild.nodes == NULL) {
+        exit(0);
+    }
+    
+    flattenPaged(tree, ref, &rebuild, nodesVisited);
+    
+    // Insert the new key after the keys that are less than or equal to it, like flattenRBST().
+    int newNodeIndex = rebuild.numOld;
+    while (newNodeIndex > 0 && key < rebuild.keys[newNodeIndex - 1]) {
+        rebuild.keys[newNodeIndex] = rebuild.keys[newNodeIndex - 1];
+        newNodeIndex--;
+    }
+    rebuild.keys[newNodeIndex] = key;
+    
+    RNGBuffer buffer;
+    bool isBuffered = attachRNGBuffer(&tree->rng, &buffer, numNodes);
+    makePagedShape(tree, &rebuild, 0, numNodes - 1, newNodeIndex, false);
+    detachRNGBuffer(&tree->rng, isBuffered);
+    *nodesVisited += numNodes;
+    
+    if (numNodes < PAGED_SLOTS) {
+        // Small subtrees reuse their old slots, plus one next to the old root for the new key.
+        for (int i = 0; i < rebuild.numOld; i++) {
+            newRefs[i] = rebuild.oldRefs[i];
+        }
+        newRefs[numNodes - 1] = allocatePagedNode(tree, ref);
+        
+        for (int i = 0; i < numNodes; i++) {
+            PagedNode node = rebuild.nodes[i];
+            node.left = (node.left != 0) ? newRefs[node.left - 1] : 0;
+            node.right = (node.right != 0) ? newRefs[node.right - 1] : 0;
+            writePagedNode(tree, newRefs[i], &node);
+        }
+    }
+    else {
+        // Large subtrees get a run of free pages, written with one pwrite() per contiguous stretch.
+        uint32_t numPages = (uint32_t) ((numNodes + PAGED_SLOTS - 1) / PAGED_SLOTS);
+        uint32_t* pages = (uint32_t*) malloc(numPages * sizeof(uint32_t));
+        unsigned char* run = (unsigned char*) calloc(numPages, PAGED_PAGE_SIZE);
+        
+        if (pages == NULL || run == NULL) {
+            exit(0);
+        }
+        
+        // Free the old slots first, so the pages they empty can be part of the run.
+        for (int i = 0; i < rebuild.numOld; i++) {
+            freePagedNode(tree, rebuild.oldRefs[i]);
+        }
+        allocatePageRun(tree, numPages, pages);
+        for (int i = 0; i < numNodes; i++) {
+            newRefs[i] = (pages[i / PAGED_SLOTS] << 8) | (uint32_t) (1 + i % PAGED_SLOTS);
+        }
+        
+        for (int i = 0; i < numNodes; i++) {
+            PagedNode node = rebuild.nodes[i];
+            node.left = (node.left != 0) ? newRefs[node.left - 1] : 0;
+            node.right = (node.right != 0) ? newRefs[node.right - 1] : 0;
+            memcpy(run + (size_t) (i / PAGED_SLOTS) * PAGED_PAGE_SIZE + (1 + i % PAGED_SLOTS) * sizeof(PagedNode), 
+                   &node, sizeof(PagedNode));
+        }
+        for (uint32_t page = 0; page < numPages; page++) {
+            PageHeader* pageHeader = (PageHeader*) (run + (size_t) page * PAGED_PAGE_SIZE);
+            int used = (page + 1 < numPages) ? PAGED_SLOTS : numNodes - (int) page * PAGED_SLOTS;
+            pageHeader->used = (uint16_t) used;
+            pageHeader->bumped = (uint16_t) used;
+        }
+        
+        for (uint32_t first = 0; first < numPages; ) {
+            uint32_t last = first + 1;
+            while (last < numPages && pages[last] == pages[last - 1] + 1) {
+                last++;
+            }
+            
+            // Drop cached copies of the pages, which the pool would otherwise write back over the run.
+            for (uint32_t i = first; i < last; i++) {
+                int index = tree->frameOf[pages[i]];
+                if (index != -1) {
+                    tree->frames[index].page = 0;
+                    tree->frames[index].dirty = false;
+                    tree->frameOf[pages[i]] = -1;
+                }
+            }
+            
+            size_t length = (size_t) (last - first) * PAGED_PAGE_SIZE;
+            if (pwrite(tree->fd, run + (size_t) first * PAGED_PAGE_SIZE, length, 
+                       (off_t) pages[first] * PAGED_PAGE_SIZE) != (ssize_t) length) {
+                fprintf(stderr, "Paged tree: sequential write of %u pages failed\n", last - first);
+                exit(1);
+            }
+            first = last;
+        }
+        tree->pageWrites += numPages;
+        free(pages);
+        free(run);
+    }
+    
+    uint32_t root = newRefs[0];
+    
+    free(newRefs);
+    free(rebuild.nodes);
+    free(rebuild.oldRefs);
+    free(rebuild.keys);
+    
+    return root;
+}
+
+/*
+Inserts the key into the paged tree, with the same random decisions as insertRBST(): at every node on 
+the path, with probability 1/(n+1) the subtree is rebuilt with the new key at its root. 
+Returns the number of nodes visited.
+
+Time Complexity: Expected O(log(N)) node accesses
+*/
+int insertPagedRBST(PagedRBST* tree, int key) {
+    uint32_t parent = 0; // The last node on the path that was kept, 0 while the path is at the root.
+    bool isLeft = false; // Whether the path continued to the left child of the parent.
+    uint32_t ref = tree->header.root;
+    uint32_t replacement;
+    int nodesVisited = 1;
+    PagedNode node;
+    
+    while (true) {
+        if (ref == 0) {
+            // Place the new leaf next to its parent.
+            replacement = allocatePagedNode(tree, parent);
+            node.key = key;
+            node.size = 1;
+            node.left = 0;
+            node.right = 0;
+            writePagedNode(tree, replacement, &node);
+            break;
+        }
+        
+        readPagedNode(tree, ref, &node);
+        nodesVisited++;
+        
+        if (randomBelow(&tree->rng, (uint32_t) (node.size + 1)) == 0) {
+            replacement = rebuildPaged(tree, ref, key, &nodesVisited);
+            break;
+        }
+        
+        node.size++;
+        writePagedNode(tree, ref, &node);
+        
+        parent = ref;
+        isLeft = (key < node.key);
+        ref = isLeft ? node.left : node.right;
+    }
+    
+    // Link the new leaf or rebuilt subtree to the rest of the tree.
+    if (parent == 0) {
+        tree->header.root = replacement;
+    }
+    else {
+        readPagedNode(tree, parent, &node);
+        if (isLeft) {
+            node.left = replacement;
+        }
+        else {
+            node.right = replacement;
+        }
+        writePagedNode(tree, parent, &node);
+    }
+    (tree->header.numNodes)++;
+    
+    return nodesVisited;
+}
+
+/*
+The function takes a paged tree and a key to search for. Returns true if the key is in the tree, 
+and adds the number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(log(N)) node accesses
+*/
+bool searchPagedRBST(PagedRBST* tree, int key, int* nodesVisited) {
+    uint32_t ref = tree->header.root;
+    PagedNode node;
+    
+    while (ref != 0) {
+        readPagedNode(tree, ref, &node);
+        (*nodesVisited)++;
+        
+        if (key == node.key) {
+            return true;
+        }
+        ref = (key < node.key) ? node.left : node.right;
+    }
+    
+    return false;
+}
+
+/*
+Snapshot files: a SnapshotHeader followed by one SnapshotRecord per node in preorder, holding the key and 
+the size of the left subtree, which is enough to rebuild the exact tree in a single pass (see fillRBST()). 
+
+Saving streams the records into SNAPSHOT_BUFFERS buffers: while some buffers are being written to disk, 
+the traversal fills the next one. Loading keeps reads of the following buffers in flight while the tree is 
+built from the current one. The I/O goes through io_uring when the kernel allows it, and otherwise through 
+a helper thread issuing pread()/pwrite(), so both ways overlap the I/O with the tree work.
+*/
+#define SNAPSHOT_MAGIC 0x53545352u
+#define SNAPSHOT_BUFFERS 4
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)
+#define SNAPSHOT_FLAG_SELF_ADJUSTING 1
+#define SNAPSHOT_FLAG_SHAPE_FIRST 2
+#define SNAPSHOT_FLAG_SMALL 4
+
+// Structure for the header at the start of a snapshot file.
+typedef struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t flags;
+    int64_t numNodes;
+} SnapshotHeader;
+
+// Structure for the record of a node in a snapshot file.
+typedef struct SnapshotRecord {
+    int32_t key;
+    uint32_t leftSize;
+} SnapshotRecord;
+
+// Structure for a read or write of a whole buffer, one per buffer.
+typedef struct IORequest {
+    struct iovec iov;
+    off_t offset;
+    bool isWrite;
+    bool pending; // Submitted and not waited for yet.
+    bool completed;
+    ssize_t result; // Number of bytes transferred, or -errno.
+} IORequest;
+
+// Structure for the asynchronous I/O on a file, through io_uring or a helper thread.
+typedef struct AsyncIO {
+    int fd;
+    IORequest requests[SNAPSHOT_BUFFERS];
+    bool useRing;
+    
+    // io_uring: the submission and completion rings shared with the kernel.
+    int ringFd;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    
+    // Helper thread: a queue of submitted requests, in submission order.
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int queue[SNAPSHOT_BUFFERS];
+    int queueHead;
+    int queueLength;
+    bool stopping;
+} AsyncIO;
+
+// Sets up an io_uring instance for the requests. Returns false if the kernel does not support or allow it.
+bool setupRing(AsyncIO* io) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    
+    memset(&params, 0, sizeof(params));
+    io->ringFd = (int) syscall(__NR_io_uring_setup, SNAPSHOT_BUFFERS, &params);
+    if (io->ringFd < 0) {
+        return false;
+    }
+    
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                      io->ringFd, IORING_OFF_SQ_RING);
+    io->cqRing = mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                      io->ringFd, IORING_OFF_CQ_RING);
+    io->sqes = (struct io_uring_sqe*) mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE, 
+                                           MAP_SHARED | MAP_POPULATE, io->ringFd, IORING_OFF_SQES);
+    if (io->sqRing == MAP_FAILED || io->cqRing == MAP_FAILED || io->sqes == MAP_FAILED) {
+        exit(0);
+    }
+    
+    unsigned char* sq = (unsigned char*) io->sqRing;
+    unsigned char* cq = (unsigned char*) io->cqRing;
+    io->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    io->sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    io->sqArray = (unsigned*) (sq + params.sq_off.array);
+    io->cqHead = (unsigned*) (cq + params.cq_off.head);
+    io->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    io->cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    
+    return true;
+#else
+    (void) io;
+    return false;
+#endif
+}
+
+// Helper thread of the pread()/pwrite() fallback: carries out the queued requests in order.
+void* asyncIOThread(void* arg) {
+    AsyncIO* io = (AsyncIO*) arg;
+    
+    pthread_mutex_lock(&io->lock);
+    while (true) {
+        while (io->queueLength == 0 && !io->stopping) {
+            pthread_cond_wait(&io->changed, &io->lock);
+        }
+        if (io->queueLength == 0) {
+            break;
+        }
+        IORequest* request = &(io->requests[io->queue[io->queueHead]]);
+        pthread_mutex_unlock(&io->lock);
+        
+        // Retry short transfers, so only errors and the end of the file end a request early.
+        size_t done = 0;
+        ssize_t n = 0;
+        while (done < request->iov.iov_len) {
+            unsigned char* data = (unsigned char*) request->iov.iov_base + done;
+            size_t length = request->iov.iov_len - done;
+            off_t offset = request->offset + (off_t) done;
+            
+            n = request->isWrite ? pwrite(io->fd, data, length, offset) : pread(io->fd, data, length, offset);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += (size_t) n;
+        }
+        
+        pthread_mutex_lock(&io->lock);
+        request->result = (n == -1 && done == 0) ? -errno : (ssize_t) done;
+        request->completed = true;
+        io->queueHead = (io->queueHead + 1) % SNAPSHOT_BUFFERS;
+        io->queueLength--;
+        pthread_cond_broadcast(&io->changed);
+    }
+    pthread_mutex_unlock(&io->lock);
+    
+    return NULL;
+}
+
+// Starts asynchronous I/O on the file descriptor, using io_uring unless RBST_NO_IO_URING is set in the environment.
+AsyncIO* openAsyncIO(int fd) {
+    AsyncIO* io = (AsyncIO*) calloc(1, sizeof(AsyncIO));
+    
+    // Check if memory allocation failed.
+    if (io == NULL) {
+        exit(0);
+    }
+    io->fd = fd;
+    
+    io->useRing = getenv("RBST_NO_IO_URING") == NULL && setupRing(io);
+    if (!io->useRing) {
+        pthread_mutex_init(&io->lock, NULL);
+        pthread_cond_init(&io->changed, NULL);
+        if (pthread_create(&io->thread, NULL, asyncIOThread, io) != 0) {
+            exit(0);
+        }
+    }
+    
+    return io;
+}
+
+// Starts reading or writing the bytes at the offset of the file, using the request of the buffer.
+void submitIO(AsyncIO* io, int buffer, bool isWrite, void* data, size_t length, off_t offset) {
+    IORequest* request = &(io->requests[buffer]);
+    
+    request->iov.iov_base = data;
+    request->iov.iov_len = length;
+    request->offset = offset;
+    request->isWrite = isWrite;
+    request->pending = true;
+    request->completed = false;
+    
+    if (!io->useRing) {
+        pthread_mutex_lock(&io->lock);
+        io->queue[(io->queueHead + io->queueLength) % SNAPSHOT_BUFFERS] = buffer;
+        io->queueLength++;
+        pthread_cond_broadcast(&io->changed);
+        pthread_mutex_unlock(&io->lock);
+        return;
+    }
+    
+#ifdef __NR_io_uring_setup
+    // Only this thread writes the submission tail, so a plain read of it is enough.
+    unsigned tail = *io->sqTail;
+    unsigned index = tail & *io->sqMask;
+    struct io_uring_sqe* sqe = &(io->sqes[index]);
+    
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = isWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &(request->iov);
+    sqe->len = 1;
+    sqe->off = (uint64_t) offset;
+    sqe->user_data = (uint64_t) buffer;
+    io->sqArray[index] = index;
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+    
+    while (syscall(__NR_io_uring_enter, io->ringFd, 1, 0, 0, NULL, 0) == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            fprintf(stderr, "Snapshot: cannot submit I/O (%s)\n", strerror(errno));
+            exit(1);
+        }
+    }
+#endif
+}
+
+// Waits for the request of the buffer to complete. Returns the number of bytes transferred, or -errno.
+ssize_t waitIO(AsyncIO* io, int buffer) {
+    IORequest* request = &(io->requests[buffer]);
+    
+    if (!io->useRing) {
+        pthread_mutex_lock(&io->lock);
+        while (!request->completed) {
+            pthread_cond_wait(&io->changed, &io->lock);
+        }
+        request->pending = false;
+        pthread_mutex_unlock(&io->lock);
+        return request->result;
+    }
+    
+#ifdef __NR_io_uring_setup
+    // Reap completions, which can belong to other buffers, until this request's has arrived.
+    while (!request->completed) {
+        unsigned head = *io->cqHead;
+        
+        if (head == __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE)) {
+            syscall(__NR_io_uring_enter, io->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        struct io_uring_cqe* cqe = &(io->cqes[head & *io->cqMask]);
+        io->requests[cqe->user_data].result = cqe->res;
+        io->requests[cqe->user_data].completed = true;
+        __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+    }
+    request->pending = false;
+#endif
+    
+    return request->result;
+}
+
+// Waits for every request to complete and tears down the ring or the helper thread. Does not close the file.
+void closeAsyncIO(AsyncIO* io) {
+    for (int i = 0; i < SNAPSHOT_BUFFERS; i++) {
+        if (io->requests[i].pending) {
+            waitIO(io, i);
+        }
+    }
+    
+    if (io->useRing) {
+        munmap(io->sqes, io->sqesSize);
+        munmap(io->cqRing, io->cqRingSize);
+        munmap(io->sqRing, io->sqRingSize);
+        close(io->ringFd);
+    }
+    else {
+        pthread_mutex_lock(&io->lock);
+        io->stopping = true;
+        pthread_cond_broadcast(&io->changed);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->thread, NULL);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->changed);
+    }
+    free(io);
+}
+
+// Structure for streaming a snapshot out through the buffers.
+typedef struct SnapshotStream {
+    AsyncIO* io;
+    unsigned char* buffers[SNAPSHOT_BUFFERS];
+    int current; // The buffer being filled (saving) or consumed (loading).
+    size_t position; // Bytes filled or consumed in the current buffer.
+    size_t length; // Bytes read into the current buffer when loading.
+    off_t offset; // File offset of the next buffer to write or read.
+    off_t fileSize;
+    bool failed;
+} SnapshotStream;
+
+// Allocates the stream's buffers. The file is not opened with O_DIRECT, so io_uring accepts any buffer.
+void initSnapshotStream(SnapshotStream* stream, int fd) {
+    memset(stream, 0, sizeof(SnapshotStream));
+    for (int i = 0; i < SNAPSHOT_BUFFERS; i++) {
+        stream->buffers[i] = (unsigned char*) malloc(SNAPSHOT_BUFFER_SIZE);
+        
+        // Check if memory allocation failed.
+        if (stream->buffers[i] == NULL) {
+            exit(0);
+        }
+    }
+    stream->io = openAsyncIO(fd);
+}
+
+// Waits for the outstanding I/O and frees the stream's buffers.
+void closeSnapshotStream(SnapshotStream* stream) {
+    closeAsyncIO(stream->io);
+    for (int i = 0; i < SNAPSHOT_BUFFERS; i++) {
+        free(stream->buffers[i]);
+    }
+}
+
+// Starts writing the current buffer, and moves on to the next one once its previous write has completed.
+void flushSnapshotBuffer(SnapshotStream* stream) {
+    if (stream->position == 0) {
+        return;
+    }
+    submitIO(stream->io, stream->current, true, stream->buffers[stream->current], stream->position, stream->offset);
+    stream->offset += (off_t) stream->position;
+    stream->current = (stream->current + 1) % SNAPSHOT_BUFFERS;
+    stream->position = 0;
+    
+    IORequest* request = &(stream->io->requests[stream->current]);
+    if (request->pending && waitIO(stream->io, stream->current) != (ssize_t) request->iov.iov_len) {
+        stream->failed = true;
+    }
+}
+
+// Appends the bytes to the snapshot. Every write of the header and records fits in the buffer size.
+void putSnapshotBytes(SnapshotStream* stream, const void* bytes, size_t length) {
+    if (stream->position + length > SNAPSHOT_BUFFER_SIZE) {
+        flushSnapshotBuffer(stream);
+    }
+    memcpy(stream->buffers[stream->current] + stream->position, bytes, length);
+    stream->position += length;
+}
+
+// Helper function for appending the record of every node of the subtree, in preorder.
+void writeSnapshotRecords(SnapshotStream* stream, TreeNode* currentNode) {
+    while (currentNode != NULL) {
+        SnapshotRecord record = { currentNode->key, (uint32_t) nodeSize(currentNode->left) };
+        
+        putSnapshotBytes(stream, &record, sizeof(SnapshotRecord));
+        writeSnapshotRecords(stream, currentNode->left);
+        currentNode = currentNode->right;
+    }
+}
+
+// Syncs the directory that holds the path, so that a file renamed into it survives a crash. Returns false on failure.
+bool syncParentDirectory(const char* path) {
+    const char* slash = strrchr(path, '/');
+    size_t length = (slash == NULL) ? 1 : (slash == path) ? 1 : (size_t) (slash - path);
+    char* directory = (char*) malloc(length + 1);
+    
+    // Check if memory allocation failed.
+    if (directory == NULL) {
+        exit(0);
+    }
+    memcpy(directory, (slash == NULL) ? "." : path, length);
+    directory[length] = '\0';
+    
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    bool synced = fd != -1 && fsync(fd) == 0;
+    
+    if (fd != -1) {
+        close(fd);
+    }
+    free(directory);
+    
+    return synced;
+}
+
+/*
+Saves the tree to a snapshot file at the path, replacing it. The snapshot is written to "<path>.tmp", 
+synced, and renamed over the path, so a crash or a failed write leaves the previous snapshot intact. 
+Returns false if the file could not be written.
+
+Time Complexity: O(N)
+*/
+bool saveRBST(RBST* bst, const char* path) {
+    size_t pathLength = strlen(path);
+    char* tmpPath = (char*) malloc(pathLength + sizeof(".tmp"));
+    SnapshotStream stream;
+    SnapshotHeader header;
+    
+    // Check if memory allocation failed.
+    if (tmpPath == NULL) {
+        exit(0);
+    }
+    memcpy(tmpPath, path, pathLength);
+    memcpy(tmpPath + pathLength, ".tmp", sizeof(".tmp"));
+    
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free(tmpPath);
+        return false;
+    }
+    waitForRebuildRBST(bst);
+    initSnapshotStream(&stream, fd);
+    
+    memset(&header, 0, sizeof(SnapshotHeader));
+    header.magic = SNAPSHOT_MAGIC;
+    header.flags = (bst->selfAdjusting ? SNAPSHOT_FLAG_SELF_ADJUSTING : 0) | 
+                   (bst->shapeFirstRebuild ? SNAPSHOT_FLAG_SHAPE_FIRST : 0) | (bst->isSmall ? SNAPSHOT_FLAG_SMALL : 0);
+    header.numNodes = sizeRBST(bst);
+    putSnapshotBytes(&stream, &header, sizeof(SnapshotHeader));
+    writeSnapshotRecords(&stream, bst->root);
+    
+    // The keys of a small tree are saved as a chain of right children.
+    for (int i = 0; bst->isSmall && i < bst->numSmallKeys; i++) {
+        SnapshotRecord record = { bst->smallKeys[i], 0 };
+        putSnapshotBytes(&stream, &record, sizeof(SnapshotRecord));
+    }
+    flushSnapshotBuffer(&stream);
+    
+    // Check the writes that are still in flight.
+    for (int i = 0; i < SNAPSHOT_BUFFERS; i++) {
+        IORequest* request = &(stream.io->requests[i]);
+        if (request->pending && waitIO(stream.io, i) != (ssize_t) request->iov.iov_len) {
+            stream.failed = true;
+        }
+    }
+    closeSnapshotStream(&stream);
+    
+    bool saved = !stream.failed && fsync(fd) == 0;
+    if (close(fd) == -1) {
+        saved = false;
+    }
+    
+    // Only a complete snapshot replaces the previous one.
+    if (saved && rename(tmpPath, path) == 0) {
+        saved = syncParentDirectory(path);
+    }
+    else {
+        unlink(tmpPath);
+        saved = false;
+    }
+    free(tmpPath);
+    
+    return saved;
+}
+
+// Starts reading the buffer at the stream's next offset, if the file has any bytes left.
+void readAheadSnapshot(SnapshotStream* stream, int buffer) {
+    if (stream->offset >= stream->fileSize) {
+        return;
+    }
+    
+    size_t length = SNAPSHOT_BUFFER_SIZE;
+    if (stream->fileSize - stream->offset < (off_t) length) {
+        length = (size_t) (stream->fileSize - stream->offset);
+    }
+    submitIO(stream->io, buffer, false, stream->buffers[buffer], length, stream->offset);
+    stream->offset += (off_t) length;
+}
+
+// Copies the next bytes of the snapshot out, waiting for the next buffer when the current one is used up.
+bool getSnapshotBytes(SnapshotStream* stream, void* bytes, size_t length) {
+    if (stream->position + length > stream->length) {
+        // Reuse the consumed buffer for the read after the ones in flight.
+        if (stream->length > 0) {
+            readAheadSnapshot(stream, stream->current);
+            stream->current = (stream->current + 1) % SNAPSHOT_BUFFERS;
+        }
+        
+        IORequest* request = &(stream->io->requests[stream->current]);
+        if (!request->pending || waitIO(stream->io, stream->current) != (ssize_t) request->iov.iov_len) {
+            stream->failed = true;
+            return false;
+        }
+        stream->position = 0;
+        stream->length = request->iov.iov_len;
+        if (length > stream->length) {
+            stream->failed = true;
+            return false;
+        }
+    }
+    
+    memcpy(bytes, stream->buffers[stream->current] + stream->position, length);
+    stream->position += length;
+    
+    return true;
+}
+
+// Structure for a node on the stack of readSnapshotRecords(), whose subtree is still being read.
+typedef struct SnapshotFrame {
+    TreeNode* node;
+    int rightSize; // Size of its right subtree, from its record.
+    bool isRightStarted;
+} SnapshotFrame;
+
+/*
+Helper function for building a subtree of the given size from the records of its nodes, in preorder. 
+Every left subtree size read from the file is checked against the subtree it lies in, and the nodes 
+whose subtrees are being read are kept on an explicit stack, since a corrupt file can describe a path 
+as long as the tree. On failure, sets stream->failed and returns the nodes built so far as a valid tree.
+
+Time Complexity: O(N)
+*/
+TreeNode* readSnapshotRecords(RBST* bst, SnapshotStream* stream, int size) {
+    TreeNode* root = NULL;
+    TreeNode** slot = &root; // Where the next subtree read goes.
+    SnapshotFrame* stack = NULL;
+    int numFrames = 0;
+    int maxFrames = 0;
+    
+    while (true) {
+        // Read the records down the left spine of the subtree.
+        while (size > 0 && !stream->failed) {
+            SnapshotRecord record;
+            
+            if (!getSnapshotBytes(stream, &record, sizeof(SnapshotRecord))) {
+                break;
+            }
+            if (record.leftSize >= (uint32_t) size) {
+                stream->failed = true;
+                break;
+            }
+            
+            if (numFrames == maxFrames) {
+                maxFrames = (maxFrames == 0) ? 64 : 2 * maxFrames;
+                stack = (SnapshotFrame*) realloc(stack, maxFrames * sizeof(SnapshotFrame));
+                
+                // Check if memory allocation failed.
+                if (stack == NULL) {
+                    exit(0);
+                }
+            }
+            
+            TreeNode* newNode = createNode(bst, record.key);
+            *slot = newNode;
+            stack[numFrames].node = newNode;
+            stack[numFrames].rightSize = size - 1 - (int) record.leftSize;
+            stack[numFrames].isRightStarted = false;
+            numFrames++;
+            slot = &(newNode->left);
+            size = (int) record.leftSize;
+        }
+        
+        // Complete the nodes whose right subtrees have been read, or every node after a failure.
+        while (numFrames > 0 && (stack[numFrames - 1].isRightStarted || stream->failed)) {
+            numFrames--;
+            updateNode(stack[numFrames].node);
+        }
+        if (numFrames == 0) {
+            break;
+        }
+        
+        stack[numFrames - 1].isRightStarted = true;
+        slot = &(stack[numFrames - 1].node->right);
+        size = stack[numFrames - 1].rightSize;
+    }
+    free(stack);
+    
+    return root;
+}
+
+/*
+Loads a tree from a snapshot file written by saveRBST(). The tree has the same shape as the saved one. 
+Returns NULL if the file cannot be read or is not a valid snapshot.
+
+Time Complexity: O(N)
+*/
+RBST* loadRBST(const char* path) {
+    int fd = open(path, O_RDONLY);
+    SnapshotStream stream;
+    SnapshotHeader header;
+    struct stat status;
+    
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &status) == -1) {
+        close(fd);
+        return NULL;
+    }
+    initSnapshotStream(&stream, fd);
+    stream.fileSize = status.st_size;
+    
+    // Keep every buffer busy from the start.
+    for (int i = 0; i < SNAPSHOT_BUFFERS; i++) {
+        readAheadSnapshot(&stream, i);
+    }
+    
+    RBST* bst = initRBST();
+    if (!getSnapshotBytes(&stream, &header, sizeof(SnapshotHeader)) || header.magic != SNAPSHOT_MAGIC || 
+        header.numNodes < 0 || header.numNodes > INT_MAX || 
+        stream.fileSize != (off_t) (sizeof(SnapshotHeader) + header.numNodes * sizeof(SnapshotRecord))) {
+        stream.failed = true;
+    }
+    else {
+        bst->selfAdjusting = (header.flags & SNAPSHOT_FLAG_SELF_ADJUSTING) != 0;
+        bst->shapeFirstRebuild = (header.flags & SNAPSHOT_FLAG_SHAPE_FIRST) != 0;
+        bst->isSmall = false;
+        setRoot(bst, readSnapshotRecords(bst, &stream, (int) header.numNodes));
+        
+        if ((header.flags & SNAPSHOT_FLAG_SMALL) != 0 && !stream.failed) {
+            int nodesVisited = 0;
+            
+            if (header.numNodes > SMALL_TREE_KEYS) {
+                stream.failed = true;
+            }
+            else {
+                shrinkRBST(bst, &nodesVisited);
+            }
+        }
+    }
+    closeSnapshotStream(&stream);
+    close(fd);
+    
+    if (stream.failed) {
+        freeRBST(bst);
+        return NULL;
+    }
+    
+    return bst;
+}
+
+/*
+String-key specialization: StrRBST is a randomized BST over byte strings, ordered like memcmp() with 
+shorter keys first on a tie. Every node keeps the first 8 bytes of its key as a big-endian integer, so most 
+comparisons are one integer compare without touching the key bytes, which live in a per-tree arena. 
+
+Descents are LCP-aware: every key in a subtree lies between the keys of its nearest left and right 
+ancestors, so it shares at least the smaller of their longest common prefixes with the searched key, 
+and comparisons skip those bytes. Rebuilds relink the existing nodes and never copy key bytes.
+*/
+#define STR_ARENA_CHUNK_BYTES 65536
+
+// Structure for representing the nodes of a string-key BST.
+typedef struct StrNode {
+    uint64_t prefix; // The first 8 bytes of the key, big-endian and zero-padded, so integer order is byte order.
+    const unsigned char* bytes; // The whole key, stored in the tree's key arena.
+    uint32_t length;
+    int size; // Number of nodes in its subtree.
+    struct StrNode* left;
+    struct StrNode* right;
+} StrNode;
+
+// Structure for a chunk of key bytes.
+typedef struct StrKeyChunk {
+    struct StrKeyChunk* next;
+    size_t used;
+    size_t capacity;
+    unsigned char bytes[];
+} StrKeyChunk;
+
+// Structure for representing a string-key BST.
+typedef struct StrRBST {
+    StrNode* root;
+    RNG rng;
+    StrKeyChunk* keys; // The most recently allocated chunk of key bytes, which links to the older ones.
+} StrRBST;
+
+// Returns the first 8 bytes of the key as a big-endian integer, padded with zero bytes.
+uint64_t loadStrPrefix(const unsigned char* bytes, uint32_t length) {
+    uint64_t prefix = 0;
+    
+    for (uint32_t i = 0; i < 8; i++) {
+        prefix = (prefix << 8) | ((i < length) ? bytes[i] : 0);
+    }
+    
+    return prefix;
+}
+
+// Initializes an empty string-key tree.
+StrRBST* initStrRBST() {
+    StrRBST* bst = (StrRBST*) malloc(sizeof(StrRBST));
+    
+    // Check if memory allocation failed.
+    if (bst == NULL) {
+        exit(0);
+    }
+    bst->root = NULL;
+    bst->keys = NULL;
+    seedRNG(&bst->rng, ((uint64_t) rand() << 32) ^ (uint64_t) rand());
+    
+    return bst;
+}
+
+// Copies the key into the tree's key arena and returns the copy.
+const unsigned char* storeStrKey(StrRBST* bst, const unsigned char* bytes, uint32_t length) {
+    StrKeyChunk* chunk = bst->keys;
+    
+    if (chunk == NULL || chunk->used + length > chunk->capacity) {
+        size_t capacity = (length > STR_ARENA_CHUNK_BYTES) ? length : STR_ARENA_CHUNK_BYTES;
+        
+        chunk = (StrKeyChunk*) malloc(sizeof(StrKeyChunk) + capacity);
+        
+        // Check if memory allocation failed.
+        if (chunk == NULL) {
+            exit(0);
+        }
+        chunk->next = bst->keys;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        bst->keys = chunk;
+    }
+    
+    unsigned char* copy = chunk->bytes + chunk->used;
+    memcpy(copy, bytes, length);
+    chunk->used += length;
+    
+    return copy;
+}
+
+// Creates a node with a copy of the key.
+StrNode* createStrNode(StrRBST* bst, const unsigned char* bytes, uint32_t length) {
+    StrNode* newNode = (StrNode*) malloc(sizeof(StrNode));
+    
+    // Check if memory allocation failed.
+    if (newNode == NULL) {
+        exit(0);
+    }
+    newNode->prefix = loadStrPrefix(bytes, length);
+    newNode->bytes = storeStrKey(bst, bytes, length);
+    newNode->length = length;
+    newNode->size = 1;
+    newNode->left = NULL;
+    newNode->right = NULL;
+    
+    return newNode;
+}
+
+/*
+Compares the key (with its prefix from loadStrPrefix()) to the node's key, knowing that their first 'skip' 
+bytes are equal. Returns a negative number, zero or a positive number like memcmp(), and sets lcp to the 
+length of their longest common prefix.
+*/
+int compareStrKey(uint64_t prefix, const unsigned char* bytes, uint32_t length, const StrNode* node, 
+                  uint32_t skip, uint32_t* lcp) {
+    uint32_t minLength = (length < node->length) ? length : node->length;
+    
+    if (skip < 8) {
+        if (prefix != node->prefix) {
+            uint32_t first = (uint32_t) __builtin_clzll(prefix ^ node->prefix) / 8;
+            *lcp = (first < minLength) ? first : minLength;
+            return (prefix < node->prefix) ? -1 : 1;
+        }
+        skip = 8;
+    }
+    
+    for (uint32_t i = skip; i < minLength; i++) {
+        if (bytes[i] != node->bytes[i]) {
+            *lcp = i;
+            return (bytes[i] < node->bytes[i]) ? -1 : 1;
+        }
+    }
+    *lcp = minLength;
+    
+    return (length > node->length) - (length < node->length);
+}
+
+// Helper function for flattening the subtree and the new node into nodes[], in sorted order (see flattenRBST()).
+void flattenStrRBST(StrNode* nodes[], StrNode* newNode, StrNode* currentNode, int* curIndex, bool* isAdded, 
+                    int* newNodeIndex, int* nodesVisited) {
+    uint32_t lcp;
+    
+    while (currentNode != NULL) {
+        flattenStrRBST(nodes, newNode, currentNode->left, curIndex, isAdded, newNodeIndex, nodesVisited);
+        
+        // Place the new node before the first node with a greater key.
+        if (!(*isAdded) && compareStrKey(newNode->prefix, newNode->bytes, newNode->length, currentNode, 0, &lcp) < 0) {
+            *newNodeIndex = *curIndex;
+            nodes[(*curIndex)++] = newNode;
+            *isAdded = true;
+        }
+        
+        (*nodesVisited)++;
+        nodes[(*curIndex)++] = currentNode;
+        currentNode = currentNode->right;
+    }
+}
+
+// Helper function for relinking nodes[first..last] into a random subtree, with the new node at the root.
+StrNode* makeStrRBST(StrRBST* bst, StrNode* nodes[], int first, int last, int newNodeIndex, int* nodesVisited) {
+    if (last < first) {
+        return NULL;
+    }
+    
+    (*nodesVisited)++;
+    
+    // The new node is the root of the rebuilt subtree, and every other node is picked at random.
+    int index = newNodeIndex;
+    if (index < first || index > last) {
+        index = first + (int) randomBelow(&bst->rng, (uint32_t) (last - first + 1));
+    }
+    
+    StrNode* newNode = nodes[index];
+    newNode->left = makeStrRBST(bst, nodes, first, index - 1, newNodeIndex, nodesVisited);
+    newNode->right = makeStrRBST(bst, nodes, index + 1, last, newNodeIndex, nodesVisited);
+    newNode->size = 1 + last - first;
+    
+    return newNode;
+}
+
+// Rebuilds the subtree with the new node at its root, by relinking the nodes (see reconstructRBST()).
+StrNode* reconstructStrRBST(StrRBST* bst, StrNode* currentNode, StrNode* newNode, int* nodesVisited) {
+    int arrLength = currentNode->size + 1;
+    StrNode** nodes = (StrNode**) malloc(arrLength * sizeof(StrNode*));
+    int curIndex = 0;
+    int newNodeIndex = arrLength - 1;
+    bool isAdded = false;
+    
+    // Check if memory allocation failed.
+    if (nodes == NULL) {
+        exit(0);
+    }
+    
+    flattenStrRBST(nodes, newNode, currentNode, &curIndex, &isAdded, &newNodeIndex, nodesVisited);
+    
+    // The new node is greater than every key of the subtree.
+    if (!isAdded) {
+        nodes[curIndex] = newNode;
+    }
+    
+    RNGBuffer buffer;
+    bool isBuffered = attachRNGBuffer(&bst->rng, &buffer, arrLength);
+    newNode = makeStrRBST(bst, nodes, 0, arrLength - 1, newNodeIndex, nodesVisited);
+    detachRNGBuffer(&bst->rng, isBuffered);
+    
+    free(nodes);
+    
+    return newNode;
+}
+
+/*
+Helper function for inserting the new node into the subtree. lcpLow and lcpHigh are the longest common 
+prefixes of the new key with the keys of the nearest ancestors the descent went right and left from.
+*/
+StrNode* insertStrRBSTHelper(StrRBST* bst, StrNode* currentNode, StrNode* newNode, uint32_t lcpLow, 
+                             uint32_t lcpHigh, int* nodesVisited) {
+    uint32_t lcp;
+    
+    if (currentNode == NULL) {
+        return newNode;
+    }
+    
+    (*nodesVisited)++;
+    
+    // With probability 1/(n+1), construct a new subtree with the new node in the root.
+    if (randomBelow(&bst->rng, (uint32_t) (currentNode->size + 1)) == 0) {
+        return reconstructStrRBST(bst, currentNode, newNode, nodesVisited);
+    }
+    
+    (currentNode->size)++;
+    
+    uint32_t skip = (lcpLow < lcpHigh) ? lcpLow : lcpHigh;
+    if (compareStrKey(newNode->prefix, newNode->bytes, newNode->length, currentNode, skip, &lcp) < 0) {
+        currentNode->left = insertStrRBSTHelper(bst, currentNode->left, newNode, lcpLow, lcp, nodesVisited);
+    }
+    else {
+        currentNode->right = insertStrRBSTHelper(bst, currentNode->right, newNode, lcp, lcpHigh, nodesVisited);
+    }
+    
+    return currentNode;
+}
+
+/*
+Inserts a copy of the key of the given length into the string-key tree. Returns the number of nodes visited.
+
+Time Complexity: Expected O(log(N)) comparisons, each reading only the bytes past the known common prefix.
+*/
+int insertStrRBST(StrRBST* bst, const void* key, uint32_t length) {
+    int nodesVisited = 1;
+    StrNode* newNode = createStrNode(bst, (const unsigned char*) key, length);
+    
+    bst->root = insertStrRBSTHelper(bst, bst->root, newNode, 0, 0, &nodesVisited);
+    
+    return nodesVisited;
+}
+
+/*
+Searches the string-key tree for the key of the given length. Returns true if it is in the tree, 
+and adds the number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(log(N)) comparisons
+*/
+bool searchStrRBST(StrRBST* bst, const void* key, uint32_t length, int* nodesVisited) {
+    const unsigned char* bytes = (const unsigned char*) key;
+    uint64_t prefix = loadStrPrefix(bytes, length);
+    StrNode* currentNode = bst->root;
+    uint32_t lcpLow = 0;
+    uint32_t lcpHigh = 0;
+    uint32_t lcp;
+    
+    while (currentNode != NULL) {
+        (*nodesVisited)++;
+        
+        int order = compareStrKey(prefix, bytes, length, currentNode, (lcpLow < lcpHigh) ? lcpLow : lcpHigh, &lcp);
+        if (order == 0) {
+            return true;
+        }
+        if (order < 0) {
+            lcpHigh = lcp;
+            currentNode = currentNode->left;
+        }
+        else {
+            lcpLow = lcp;
+            currentNode = currentNode->right;
+        }
+    }
+    
+    return false;
+}
+
+// Helper function for freeing the nodes of the subtree.
+void freeStrRBSTHelper(StrNode* currentNode) {
+    while (currentNode != NULL) {
+        StrNode* right = currentNode->right;
+        
+        freeStrRBSTHelper(currentNode->left);
+        free(currentNode);
+        currentNode = right;
+    }
+}
+
+// Frees the string-key tree, its nodes and its keys.
+void freeStrRBST(StrRBST* bst) {
+    freeStrRBSTHelper(bst->root);
+    while (bst->keys != NULL) {
+        StrKeyChunk* next = bst->keys->next;
+        free(bst->keys);
+        bst->keys = next;
+    }
+    free(bst);
+}
+
+/*
+Order-preserving key normalization: int64, uint64, double, 128-bit and composite keys are encoded as 
+big-endian byte strings whose memcmp() order is the order of the source values, so they can be stored in 
+a StrRBST. Keys of up to 8 bytes fit in the inline prefix, so comparing them is a single unsigned compare. 
+
+A composite key is the concatenation of its encoded fields, compared field by field. Fixed-width fields 
+need no separator; string fields are escaped (0x00 becomes 0x00 0xFF) and end with 0x00 0x00, so a field 
+that is a prefix of another sorts first and never runs into the next field.
+*/
+#define NORMALIZED_KEY_MAX 64
+
+// Structure for a key being normalized, built by the appendKey functions.
+typedef struct NormalizedKey {
+    unsigned char bytes[NORMALIZED_KEY_MAX];
+    uint32_t length;
+} NormalizedKey;
+
+// Appends the value as 8 big-endian bytes. Returns false if the key would be longer than NORMALIZED_KEY_MAX.
+bool appendUint64Key(NormalizedKey* key, uint64_t value) {
+    if (key->length + 8 > NORMALIZED_KEY_MAX) {
+        return false;
+    }
+    for (int i = 7; i >= 0; i--) {
+        key->bytes[key->length++] = (unsigned char) (value >> (8 * i));
+    }
+    
+    return true;
+}
+
+// Appends a signed value, with the sign bit flipped so negative values sort before positive ones.
+bool appendInt64Key(NormalizedKey* key, int64_t value) {
+    return appendUint64Key(key, (uint64_t) value ^ (1ULL << 63));
+}
+
+/*
+Appends a double. Positive values get their sign bit set, and negative values have all bits flipped, 
+so larger magnitudes sort first. -0.0 is encoded as 0.0, and every NaN as one value after +infinity.
+*/
+bool appendDoubleKey(NormalizedKey* key, double value) {
+    uint64_t bits;
+    
+    if (value == 0.0) {
+        value = 0.0;
+    }
+    memcpy(&bits, &value, sizeof(uint64_t));
+    if (isnan(value)) {
+        bits = 0x7FF8000000000000ULL;
+    }
+    
+    return appendUint64Key(key, (bits >> 63) ? ~bits : bits ^ (1ULL << 63));
+}
+
+// Appends an unsigned 128-bit value given as its high and low halves.
+bool appendUint128Key(NormalizedKey* key, uint64_t high, uint64_t low) {
+    return key->length + 16 <= NORMALIZED_KEY_MAX && appendUint64Key(key, high) && appendUint64Key(key, low);
+}
+
+// Appends a signed 128-bit value given as its high (signed) and low halves.
+bool appendInt128Key(NormalizedKey* key, int64_t high, uint64_t low) {
+    return appendUint128Key(key, (uint64_t) high ^ (1ULL << 63), low);
+}
+
+// Appends a string field of a composite key, escaped and terminated (see above).
+bool appendStringKey(NormalizedKey* key, const void* bytes, uint32_t length) {
+    const unsigned char* next = (const unsigned char*) bytes;
+    uint32_t encodedLength = length + 2;
+    
+    for (uint32_t i = 0; i < length; i++) {
+        encodedLength += (next[i] == 0);
+    }
+    if (key->length + encodedLength > NORMALIZED_KEY_MAX) {
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < length; i++) {
+        key->bytes[key->length++] = next[i];
+        if (next[i] == 0) {
+            key->bytes[key->length++] = 0xFF;
+        }
+    }
+    key->bytes[key->length++] = 0;
+    key->bytes[key->length++] = 0;
+    
+    return true;
+}
+
+// Reads the 8-byte field at the offset of a normalized key back as an unsigned value.
+uint64_t readUint64Key(const unsigned char* bytes, uint32_t offset) {
+    uint64_t value = 0;
+    
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | bytes[offset + i];
+    }
+    
+    return value;
+}
+
+// Reads the field at the offset back as a signed value.
+int64_t readInt64Key(const unsigned char* bytes, uint32_t offset) {
+    return (int64_t) (readUint64Key(bytes, offset) ^ (1ULL << 63));
+}
+
+// Reads the field at the offset back as a double.
+double readDoubleKey(const unsigned char* bytes, uint32_t offset) {
+    uint64_t bits = readUint64Key(bytes, offset);
+    double value;
+    
+    bits = (bits >> 63) ? bits ^ (1ULL << 63) : ~bits;
+    memcpy(&value, &bits, sizeof(double));
+    
+    return value;
+}
+
+/*
+Static trees for fixed key sets known at build time. A StaticRBST wraps a constant sorted key array, which 
+is the inorder flattening of a perfectly balanced BST: the middle key is the root and each half is a subtree. 
+Declared with STATIC_RBST() as a static const object, the whole structure is a constant initializer, so it 
+lives in read-only memory and needs no construction at startup. Searches halve the range without branching 
+on the comparison, like a descent of the implicit balanced tree.
+*/
+typedef struct StaticRBST {
+    const int* keys; // Sorted in nondecreasing order.
+    int numKeys;
+} StaticRBST;
+
+// Initializer for a StaticRBST over a constant, sorted array of keys.
+#define STATIC_RBST(keyArray) { (keyArray), (int) (sizeof(keyArray) / sizeof((keyArray)[0])) }
+
+// Returns true if the keys of the static tree are sorted, which STATIC_RBST() cannot check at compile time.
+bool checkStaticRBST(const StaticRBST* tree) {
+    for (int i = 1; i < tree->numKeys; i++) {
+        if (tree->keys[i - 1] > tree->keys[i]) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// Returns the number of keys that are less than the key, or at most the key if inclusive is true.
+int staticRankHelper(const StaticRBST* tree, int key, bool inclusive, int* nodesVisited) {
+    const int* base = tree->keys;
+    int length = tree->numKeys;
+    
+    if (length == 0) {
+        return 0;
+    }
+    
+    // Keep the half that holds the boundary; the conditional move does not depend on branch prediction.
+    while (length > 1) {
+        int half = length / 2;
+        bool goRight = inclusive ? (base[half - 1] <= key) : (base[half - 1] < key);
+        
+        (*nodesVisited)++;
+        base += goRight ? half : 0;
+        length -= half;
+    }
+    (*nodesVisited)++;
+    
+    return (int) (base - tree->keys) + (inclusive ? (*base <= key) : (*base < key));
+}
+
+/*
+The function takes a static tree and a key to search for. Returns true if the key is in the tree,
+and adds the number of nodes visited to nodesVisited.
+
+Time Complexity: O(log(N))
+*/
+bool searchStaticRBST(const StaticRBST* tree, int key, int* nodesVisited) {
+    int rank = staticRankHelper(tree, key, false, nodesVisited);
+    
+    return rank < tree->numKeys && tree->keys[rank] == key;
+}
+
+/*
+Returns the rank of the key: the number of keys in the static tree that are less than it.
+
+Time Complexity: O(log(N))
+*/
+int rankStaticRBST(const StaticRBST* tree, int key) {
+    int nodesVisited = 0;
+    
+    return staticRankHelper(tree, key, false, &nodesVisited);
+}
+
+/*
+Returns the number of keys in the static tree that are in the range [low, high].
+
+Time Complexity: O(log(N))
+*/
+int rangeCountStaticRBST(const StaticRBST* tree, int low, int high) {
+    int nodesVisited = 0;
+    
+    if (low > high) {
+        return 0;
+    }
+    
+    return staticRankHelper(tree, high, true, &nodesVisited) - staticRankHelper(tree, low, false, &nodesVisited);
+}
+
+/*
+Succinct archives of read-only trees. The shape is stored as balanced parentheses, 2 bits per node: a tree 
+is read as the forest whose first child links are the left children and whose next sibling links are the 
+right children, so a node is '(' followed by its left subtree and ')', followed by its right subtree. 
+The node at an opening parenthesis p has its left child at p + 1 and its right child just after its closing 
+parenthesis, if those positions hold an opening one, and its inorder index is the number of closing 
+parentheses before its own. The keys are stored in inorder, bit-packed as offsets from the smallest key. 
+Finding the closing parenthesis uses the minimum excess (opening minus closing parentheses) of every block 
+of SUCCINCT_BLOCK_BITS bits, kept in a binary tree over the blocks, so searches and ranks run on the 
+encoded form without building nodes.
+*/
+#define SUCCINCT_BLOCK_BITS 512
+#define SUCCINCT_MAGIC 0x54435553u
+
+// Structure for a tree encoded as balanced parentheses and bit-packed keys.
+typedef struct SuccinctRBST {
+    int numNodes;
+    int minKey;
+    int keyBits; // Bits per key, which is stored as its offset from minKey.
+    uint64_t* parens; // 2 * numNodes bits, 1 for an opening parenthesis.
+    uint64_t* keys; // The keys in inorder, keyBits each.
+    uint32_t* blockRanks; // Number of opening parentheses before every block.
+    int* minExcess; // Minimum excess of block b at [numLeaves + b], and of the blocks below every inner entry.
+    int numLeaves; // Number of leaves of the minExcess tree, a power of two.
+} SuccinctRBST;
+
+// Lowest excess within every byte (at or after its first bit, lowest bit first), and the excess of the whole byte.
+int8_t byteMinExcess[256];
+int8_t byteExcess[256];
+pthread_once_t byteExcessOnce = PTHREAD_ONCE_INIT;
+
+// Fills the byte excess tables, once (see byteExcessOnce).
+void initByteExcess() {
+    for (int byte = 0; byte < 256; byte++) {
+        int excess = 0;
+        int lowest = 8;
+        
+        for (int bit = 0; bit < 8; bit++) {
+            excess += ((byte >> bit) & 1) ? 1 : -1;
+            if (excess < lowest) {
+                lowest = excess;
+            }
+        }
+        byteMinExcess[byte] = (int8_t) lowest;
+        byteExcess[byte] = (int8_t) excess;
+    }
+}
+
+static inline int parenAt(const SuccinctRBST* tree, int pos) {
+    return (int) ((tree->parens[pos >> 6] >> (pos & 63)) & 1);
+}
+
+// Returns the number of opening parentheses before the position.
+int rankParens(const SuccinctRBST* tree, int pos) {
+    int block = pos / SUCCINCT_BLOCK_BITS;
+    int rank = (int) tree->blockRanks[block];
+    
+    for (int word = block * (SUCCINCT_BLOCK_BITS / 64); word < (pos >> 6); word++) {
+        rank += __builtin_popcountll(tree->parens[word]);
+    }
+    if ((pos & 63) != 0) {
+        rank += __builtin_popcountll(tree->parens[pos >> 6] & ((1ULL << (pos & 63)) - 1));
+    }
+    
+    return rank;
+}
+
+// Returns the key with the inorder index.
+static inline int succinctKey(const SuccinctRBST* tree, int index) {
+    if (tree->keyBits == 0) {
+        return tree->minKey;
+    }
+    
+    uint64_t bit = (uint64_t) index * tree->keyBits;
+    uint64_t offset = tree->keys[bit >> 6] >> (bit & 63);
+    
+    if ((bit & 63) + tree->keyBits > 64) {
+        offset |= tree->keys[(bit >> 6) + 1] << (64 - (bit & 63));
+    }
+    offset &= (1ULL << tree->keyBits) - 1;
+    
+    return (int) ((uint32_t) tree->minKey + (uint32_t) offset);
+}
+
+/*
+Returns the first position in [pos, end) at which the excess drops to the target, given the excess before pos, 
+or -1 if there is none. Whole bytes are skipped with the byte excess tables.
+*/
+int scanExcess(const SuccinctRBST* tree, int pos, int end, int excess, int target) {
+    while (pos < end) {
+        if ((pos & 7) == 0 && pos + 8 <= end) {
+            int byte = (int) ((tree->parens[pos >> 6] >> (pos & 63)) & 0xFF);
+            
+            if (excess + byteMinExcess[byte] > target) {
+                excess += byteExcess[byte];
+                pos += 8;
+                continue;
+            }
+        }
+        
+        excess += parenAt(tree, pos) ? 1 : -1;
+        if (excess == target) {
+            return pos;
+        }
+        pos++;
+    }
+    
+    return -1;
+}
+
+/*
+Returns the position of the closing parenthesis that matches the opening one at pos: the first position 
+after it where the excess drops below the excess at pos. The rest of its block is scanned, then the 
+minExcess tree gives the first later block that reaches the target, which is scanned from its start.
+
+Time Complexity: O(log(N) + SUCCINCT_BLOCK_BITS / 8)
+*/
+int findClose(const SuccinctRBST* tree, int pos) {
+    int excess = 2 * rankParens(tree, pos + 1) - (pos + 1);
+    int target = excess - 1;
+    int block = pos / SUCCINCT_BLOCK_BITS;
+    int blockEnd = (block + 1) * SUCCINCT_BLOCK_BITS;
+    int end = 2 * tree->numNodes;
+    int close = scanExcess(tree, pos + 1, (blockEnd < end) ? blockEnd : end, excess, target);
+    
+    if (close != -1) {
+        return close;
+    }
+    
+    // Climb to the first block range to the right that reaches the target, then descend to its leftmost block.
+    int node = tree->numLeaves + block;
+    while ((node & 1) == 1 || tree->minExcess[node + 1] > target) {
+        node /= 2;
+    }
+    node++;
+    while (node < tree->numLeaves) {
+        node = (tree->minExcess[2 * node] <= target) ? 2 * node : 2 * node + 1;
+    }
+    block = node - tree->numLeaves;
+    
+    int start = block * SUCCINCT_BLOCK_BITS;
+    blockEnd = start + SUCCINCT_BLOCK_BITS;
+    
+    return scanExcess(tree, start, (blockEnd < end) ? blockEnd : end, 2 * (int) tree->blockRanks[block] - start, target);
+}
+
+/*
+Builds the rank and minimum excess directories of the parentheses, which are not stored in archives.
+
+Time Complexity: O(N)
+*/
+void indexSuccinctRBST(SuccinctRBST* tree) {
+    int numBits = 2 * tree->numNodes;
+    int numBlocks = numBits / SUCCINCT_BLOCK_BITS + 1;
+    int excess = 0;
+    
+    pthread_once(&byteExcessOnce, initByteExcess);
+    
+    tree->numLeaves = 1;
+    while (tree->numLeaves < numBlocks) {
+        tree->numLeaves *= 2;
+    }
+    tree->blockRanks = (uint32_t*) malloc(numBlocks * sizeof(uint32_t));
+    tree->minExcess = (int*) malloc(2 * tree->numLeaves * sizeof(int));
+    
+    // Check if memory allocation failed.
+    if (tree->blockRanks == NULL || tree->minExcess == NULL) {
+        exit(0);
+    }
+    
+    for (int i = 0; i < 2 * tree->numLeaves; i++) {
+        tree->minExcess[i] = INT_MAX;
+    }
+    for (int pos = 0, rank = 0; pos < numBits || pos % SUCCINCT_BLOCK_BITS == 0; pos++) {
+        int block = pos / SUCCINCT_BLOCK_BITS;
+        
+        if (pos % SUCCINCT_BLOCK_BITS == 0) {
+            tree->blockRanks[block] = (uint32_t) rank;
+            if (pos == numBits) {
+                break;
+            }
+        }
+        rank += parenAt(tree, pos);
+        excess += parenAt(tree, pos) ? 1 : -1;
+        if (excess < tree->minExcess[tree->numLeaves + block]) {
+            tree->minExcess[tree->numLeaves + block] = excess;
+        }
+    }
+    for (int node = tree->numLeaves - 1; node >= 1; node--) {
+        int left = tree->minExcess[2 * node];
+        int right = tree->minExcess[2 * node + 1];
+        tree->minExcess[node] = (left < right) ? left : right;
+    }
+}
+
+// Allocates an empty encoding for numNodes keys of keyBits bits each.
+SuccinctRBST* allocSuccinctRBST(int numNodes, int minKey, int keyBits) {
+    SuccinctRBST* tree = (SuccinctRBST*) malloc(sizeof(SuccinctRBST));
+    
+    // Check if memory allocation failed.
+    if (tree == NULL) {
+        exit(0);
+    }
+    
+    tree->numNodes = numNodes;
+    tree->minKey = minKey;
+    tree->keyBits = keyBits;
+    tree->parens = (uint64_t*) calloc((2 * (size_t) numNodes) / 64 + 1, sizeof(uint64_t));
+    tree->keys = (uint64_t*) calloc(((size_t) numNodes * keyBits) / 64 + 2, sizeof(uint64_t));
+    tree->blockRanks = NULL;
+    tree->minExcess = NULL;
+    
+    // Check if memory allocation failed.
+    if (tree->parens == NULL || tree->keys == NULL) {
+        exit(0);
+    }
+    
+    return tree;
+}
+
+// Helper function for writing the parentheses of the subtree at *pos and its keys in inorder at *index.
+void encodeSuccinct(SuccinctRBST* tree, TreeNode* currentNode, int* pos, int* index) {
+    while (currentNode != NULL) {
+        tree->parens[*pos >> 6] |= 1ULL << (*pos & 63);
+        (*pos)++;
+        encodeSuccinct(tree, currentNode->left, pos, index);
+        (*pos)++;
+        
+        uint64_t bit = (uint64_t) (*index) * tree->keyBits;
+        uint64_t offset = (uint64_t) ((uint32_t) currentNode->key - (uint32_t) tree->minKey);
+        if (tree->keyBits > 0) {
+            tree->keys[bit >> 6] |= offset << (bit & 63);
+            if ((bit & 63) + tree->keyBits > 64) {
+                tree->keys[(bit >> 6) + 1] |= offset >> (64 - (bit & 63));
+            }
+        }
+        (*index)++;
+        
+        currentNode = currentNode->right;
+    }
+}
+
+/*
+Encodes the tree as balanced parentheses and bit-packed keys, keeping its shape. A small tree is encoded 
+as a chain of right children. The tree itself is not changed.
+
+Time Complexity: O(N)
+*/
+SuccinctRBST* encodeSuccinctRBST(RBST* bst) {
+    waitForRebuildRBST(bst);
+    
+    int numNodes = sizeRBST(bst);
+    TreeNode* root = bst->root;
+    TreeNode* chain = NULL;
+    int pos = 0;
+    int index = 0;
+    
+    // Link the keys of a small tree into a temporary right chain on the stack.
+    TreeNode smallNodes[SMALL_TREE_KEYS];
+    if (bst->isSmall) {
+        for (int i = numNodes - 1; i >= 0; i--) {
+            smallNodes[i].key = bst->smallKeys[i];
+            smallNodes[i].left = NULL;
+            smallNodes[i].right = chain;
+            chain = &(smallNodes[i]);
+        }
+        root = chain;
+    }
+    
+    int minKey = 0;
+    uint32_t range = 0;
+    int keyBits = 0;
+    if (root != NULL) {
+        TreeNode* first = root;
+        TreeNode* last = root;
+        
+        while (first->left != NULL) {
+            first = first->left;
+        }
+        while (last->right != NULL) {
+            last = last->right;
+        }
+        minKey = first->key;
+        range = (uint32_t) last->key - (uint32_t) first->key;
+    }
+    while (keyBits < 32 && (range >> keyBits) != 0) {
+        keyBits++;
+    }
+    
+    SuccinctRBST* tree = allocSuccinctRBST(numNodes, minKey, keyBits);
+    encodeSuccinct(tree, root, &pos, &index);
+    indexSuccinctRBST(tree);
+    
+    return tree;
+}
+
+/*
+Returns true if the key is in the encoded tree, following the same path as a search of the tree it 
+was encoded from. Adds the number of nodes visited to nodesVisited.
+
+Time Complexity: Expected O(log(N)^2) (a findClose() per node on the path)
+*/
+bool searchSuccinctRBST(const SuccinctRBST* tree, int key, int* nodesVisited) {
+    int end = 2 * tree->numNodes;
+    int pos = 0;
+    
+    while (pos < end && parenAt(tree, pos)) {
+        (*nodesVisited)++;
+        
+        int close = findClose(tree, pos);
+        int nodeKey = succinctKey(tree, close - rankParens(tree, close));
+        
+        if (key == nodeKey) {
+            return true;
+        }
+        pos = (key < nodeKey) ? pos + 1 : close + 1;
+    }
+    
+    return false;
+}
+
+/*
+Returns the rank of the key in the encoded tree: the number of keys that are less than it.
+
+Time Complexity: Expected O(log(N)^2)
+*/
+int rankSuccinctRBST(const SuccinctRBST* tree, int key) {
+    int end = 2 * tree->numNodes;
+    int pos = 0;
+    int rank = 0;
+    
+    while (pos < end && parenAt(tree, pos)) {
+        int close = findClose(tree, pos);
+        int index = close - rankParens(tree, close);
+        
+        if (key <= succinctKey(tree, index)) {
+            pos = pos + 1;
+        }
+        else {
+            rank = index + 1;
+            pos = close + 1;
+        }
+    }
+    
+    return rank;
+}
+
+// Returns the number of bytes used by the encoded tree, including its directories.
+size_t succinctMemory(const SuccinctRBST* tree) {
+    return sizeof(SuccinctRBST) + ((2 * (size_t) tree->numNodes) / 64 + 1) * sizeof(uint64_t) + 
+           (((size_t) tree->numNodes * tree->keyBits) / 64 + 2) * sizeof(uint64_t) + 
+           ((2 * (size_t) tree->numNodes) / SUCCINCT_BLOCK_BITS + 1) * sizeof(uint32_t) + 
+           2 * (size_t) tree->numLeaves * sizeof(int);
+}
+
+// Frees the encoded tree.
+void freeSuccinctRBST(SuccinctRBST* tree) {
+    free(tree->parens);
+    free(tree->keys);
+    free(tree->blockRanks);
+    free(tree->minExcess);
+    free(tree);
+}
+
+/*
+Writes the encoded tree to an archive file: a header, the parentheses and the packed keys. Returns false 
+if the file cannot be written.
+*/
+bool saveSuccinctRBST(const SuccinctRBST* tree, const char* path) {
+    FILE* file = fopen(path, "wb");
+    uint32_t header[4] = { SUCCINCT_MAGIC, (uint32_t) tree->numNodes, (uint32_t) tree->minKey, (uint32_t) tree->keyBits };
+    size_t numParenWords = (2 * (size_t) tree->numNodes) / 64 + 1;
+    size_t numKeyWords = ((size_t) tree->numNodes * tree->keyBits) / 64 + 2;
+    
+    if (file == NULL) {
+        return false;
+    }
+    
+    bool isWritten = fwrite(header, sizeof(header), 1, file) == 1 && 
+                     fwrite(tree->parens, sizeof(uint64_t), numParenWords, file) == numParenWords && 
+                     fwrite(tree->keys, sizeof(uint64_t), numKeyWords, file) == numKeyWords;
+    
+    return (fclose(file) == 0) && isWritten;
+}
+
+// Reads an archive written by saveSuccinctRBST() and rebuilds its directories. Returns NULL if it cannot be read.
+SuccinctRBST* loadSuccinctRBST(const char* path) {
+    FILE* file = fopen(path, "rb");
+    uint32_t header[4];
+    
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != SUCCINCT_MAGIC || header[1] > INT_MAX / 2 || header[3] > 32) {
+        fclose(file);
+        return NULL;
+    }
+    
+    SuccinctRBST* tree = allocSuccinctRBST((int) header[1], (int) header[2], (int) header[3]);
+    size_t numParenWords = (2 * (size_t) tree->numNodes) / 64 + 1;
+    size_t numKeyWords = ((size_t) tree->numNodes * tree->keyBits) / 64 + 2;
+    bool isRead = fread(tree->parens, sizeof(uint64_t), numParenWords, file) == numParenWords && 
+                  fread(tree->keys, sizeof(uint64_t), numKeyWords, file) == numKeyWords;
+    
+    fclose(file);
+    if (!isRead) {
+        free(tree->parens);
+        free(tree->keys);
+        free(tree);
+        return NULL;
+    }
+    indexSuccinctRBST(tree);
+    
+    // Reject parentheses that are not balanced, which findClose() relies on.
+    if (rankParens(tree, 2 * tree->numNodes) != tree->numNodes || tree->minExcess[1] < 0) {
+        freeSuccinctRBST(tree);
+        return NULL;
+    }
+    
+    return tree;
+}
+
+
+/*
+Multi-tenant container: an RBSTForest holds many trees, named by 32-bit handles, whose nodes all come 
+from one slab arena. A node is 16 bytes and refers to its children by 32-bit node numbers (0 being the 
+empty subtree), and the header of a tree is just the number of its root node, so a tree costs 4 bytes 
+plus 16 bytes per key, against an RBST and a malloc() per node for separate trees. The slabs never move, 
+so growing the arena does not copy nodes. All trees share one random generator and one rebuild buffer.
+*/
+#define FOREST_SLAB_NODES 65536
+#define FOREST_FREE_TREE 0x80000000u // Marks the header of a released handle, which holds the next free handle.
+#define FOREST_NO_TREE 0x7FFFFFFFu
+
+// Structure for the nodes of the trees in a forest.
+typedef struct ForestNode {
+    int key;
+    int size; // Number of nodes in its subtree.
+    uint32_t left;
+    uint32_t right; // Also links the nodes on the free list.
+} ForestNode;
+
+// Structure for a container of many trees sharing a node arena.
+typedef struct RBSTForest {
+    ForestNode** slabs; // Every slab holds FOREST_SLAB_NODES nodes, node 0 is never used.
+    uint32_t numSlabs;
+    uint32_t slabsCapacity;
+    uint32_t usedNodes; // Nodes handed out from the slabs, including node 0.
+    uint32_t freeNodes; // Released nodes, linked through their right fields, 0 if none.
+    uint32_t* roots; // The root node of every tree, or FOREST_FREE_TREE | next free handle.
+    uint32_t numTrees; // Handles handed out, including released ones.
+    uint32_t rootsCapacity;
+    uint32_t freeTrees; // First released handle, FOREST_NO_TREE if none.
+    uint32_t* rebuild; // Scratch space for the nodes of a rebuilt subtree.
+    int rebuildCapacity;
+    RNG rng;
+} RBSTForest;
+
+// Returns the node with the number.
+static inline ForestNode* forestNode(RBSTForest* forest, uint32_t ref) {
+    return &(forest->slabs[ref / FOREST_SLAB_NODES][ref % FOREST_SLAB_NODES]);
+}
+
+// Returns the size of the subtree rooted at the node, 0 for the empty subtree.
+static inline int forestSize(RBSTForest* forest, uint32_t ref) {
+    return (ref == 0) ? 0 : forestNode(forest, ref)->size;
+}
+
+// Initializes an empty forest.
+RBSTForest* initForest() {
+    RBSTForest* forest = (RBSTForest*) calloc(1, sizeof(RBSTForest));
+    
+    // Check if memory allocation failed.
+    if (forest == NULL) {
+        exit(0);
+    }
+    forest->freeTrees = FOREST_NO_TREE;
+    seedRNG(&forest->rng, ((uint64_t) rand() << 32) ^ (uint64_t) rand());
+    
+    return forest;
+}
+
+// Returns a new node with the key, from the free list or the last slab, adding a slab when it is full.
+uint32_t allocForestNode(RBSTForest* forest, int key) {
+    uint32_t ref = forest->freeNodes;
+    
+    if (ref != 0) {
+        forest->freeNodes = forestNode(forest, ref)->right;
+    }
+    else {
+        if (forest->usedNodes == forest->numSlabs * FOREST_SLAB_NODES) {
+            if (forest->numSlabs == forest->slabsCapacity) {
+                forest->slabsCapacity = (forest->slabsCapacity > 0) ? forest->slabsCapacity * 2 : 16;
+                forest->slabs = (ForestNode**) realloc(forest->slabs, forest->slabsCapacity * sizeof(ForestNode*));
+            }
+            
+            // Check if memory allocation failed.
+            if (forest->slabs == NULL || 
+                (forest->slabs[forest->numSlabs] = (ForestNode*) malloc(FOREST_SLAB_NODES * sizeof(ForestNode))) == NULL) {
+                exit(0);
+            }
+            forest->numSlabs++;
+            
+            // Node 0 stands for the empty subtree.
+            if (forest->usedNodes == 0) {
+                forest->usedNodes = 1;
+            }
+        }
+        ref = forest->usedNodes++;
+    }
+    
+    ForestNode* node = forestNode(forest, ref);
+    node->key = key;
+    node->size = 1;
+    node->left = 0;
+    node->right = 0;
+    
+    return ref;
+}
+
+// Creates an empty tree in the forest and returns its handle, reusing released handles first.
+uint32_t createForestTree(RBSTForest* forest) {
+    uint32_t tree = forest->freeTrees;
+    
+    if (tree != FOREST_NO_TREE) {
+        forest->freeTrees = forest->roots[tree] & ~FOREST_FREE_TREE;
+    }
+    else {
+        if (forest->numTrees == forest->rootsCapacity) {
+            forest->rootsCapacity = (forest->rootsCapacity > 0) ? forest->rootsCapacity * 2 : 1024;
+            forest->roots = (uint32_t*) realloc(forest->roots, forest->rootsCapacity * sizeof(uint32_t));
+            
+            // Check if memory allocation failed.
+            if (forest->roots == NULL) {
+                exit(0);
+            }
+        }
+        tree = forest->numTrees++;
+    }
+    forest->roots[tree] = 0;
+    
+    return tree;
+}
+
+// Returns the number of keys in the tree with the handle.
+int forestTreeSize(RBSTForest* forest, uint32_t tree) {
+    return forestSize(forest, forest->roots[tree]);
+}
+
+// Helper function for listing the nodes of the subtree and the new node in sorted order (see flattenRBST()).
+void flattenForest(RBSTForest* forest, uint32_t ref, uint32_t newRef, int newKey, int* curIndex, int* newIndex) {
+    while (ref != 0) {
+        ForestNode* node = forestNode(forest, ref);
+        
+        flattenForest(forest, node->left, newRef, newKey, curIndex, newIndex);
+        if (*newIndex == -1 && newKey < node->key) {
+            *newIndex = *curIndex;
+            forest->rebuild[(*curIndex)++] = newRef;
+        }
+        forest->rebuild[(*curIndex)++] = ref;
+        ref = node->right;
+    }
+}
+
+// Helper function for relinking rebuild[first..last] into a random subtree, with the new node at the root.
+uint32_t makeForest(RBSTForest* forest, int first, int last, int newIndex) {
+    if (last < first) {
+        return 0;
+    }
+    
+    int index = newIndex;
+    if (index < first || index > last) {
+        index = first + (int) randomBelow(&forest->rng, (uint32_t) (last - first + 1));
+    }
+    
+    uint32_t ref = forest->rebuild[index];
+    ForestNode* node = forestNode(forest, ref);
+    node->left = makeForest(forest, first, index - 1, newIndex);
+    node->right = makeForest(forest, index + 1, last, newIndex);
+    node->size = 1 + last - first;
+    
+    return ref;
+}
+
+// Rebuilds the subtree with the new node at its root, relinking the nodes in place.
+uint32_t reconstructForest(RBSTForest* forest, uint32_t ref, uint32_t newRef) {
+    int length = forestSize(forest, ref) + 1;
+    int curIndex = 0;
+    int newIndex = -1;
+    
+    if (length > forest->rebuildCapacity) {
+        forest->rebuildCapacity = (length > 2 * forest->rebuildCapacity) ? length : 2 * forest->rebuildCapacity;
+        forest->rebuild = (uint32_t*) realloc(forest->rebuild, forest->rebuildCapacity * sizeof(uint32_t));
+        
+        // Check if memory allocation failed.
+        if (forest->rebuild == NULL) {
+            exit(0);
+        }
+    }
+    
+    flattenForest(forest, ref, newRef, forestNode(forest, newRef)->key, &curIndex, &newIndex);
+    
+    // The new key is greater than every key of the subtree.
+    if (newIndex == -1) {
+        newIndex = curIndex;
+        forest->rebuild[curIndex] = newRef;
+    }
+    
+    RNGBuffer buffer;
+    bool isBuffered = attachRNGBuffer(&forest->rng, &buffer, length);
+    uint32_t newRoot = makeForest(forest, 0, length - 1, newIndex);
+    detachRNGBuffer(&forest->rng, isBuffered);
+    
+    return newRoot;
+}
+
+// Helper function for inserting the new node into the subtree, like insertRBSTHelper().
+uint32_t insertForestHelper(RBSTForest* forest, uint32_t ref, uint32_t newRef, int key) {
+    if (ref == 0) {
+        return newRef;
+    }
+    
+    // Slabs never move, so the node stays valid while new nodes are added.
+    ForestNode* node = forestNode(forest, ref);
+    
+    // With probability 1/(n+1), construct a new subtree with the new node in the root.
+    if (randomBelow(&forest->rng, (uint32_t) (node->size + 1)) == 0) {
+        return reconstructForest(forest, ref, newRef);
+    }
+    
+    (node->size)++;
+    if (key < node->key) {
+        node->left = insertForestHelper(forest, node->left, newRef, key);
+    }
+    else {
+        node->right = insertForestHelper(forest, node->right, newRef, key);
+    }
+    
+    return ref;
+}
+
+/*
+Inserts the key into the tree with the handle.
+
+Time Complexity: Expected O(log(N)) for a tree of N keys
+*/
+void insertForest(RBSTForest* forest, uint32_t tree, int key) {
+    uint32_t newRef = allocForestNode(forest, key);
+    
+    forest->roots[tree] = insertForestHelper(forest, forest->roots[tree], newRef, key);
+}
+
+/*
+Returns true if the key is in the tree with the handle.
+
+Time Complexity: Expected O(log(N)) for a tree of N keys
+*/
+bool searchForest(RBSTForest* forest, uint32_t tree, int key) {
+    uint32_t ref = forest->roots[tree];
+    
+    while (ref != 0) {
+        ForestNode* node = forestNode(forest, ref);
+        
+        if (key == node->key) {
+            return true;
+        }
+        ref = (key < node->key) ? node->left : node->right;
+    }
+    
+    return false;
+}
+
+// Helper function for putting the nodes of the subtree on the forest's free list.
+void releaseForestNodes(RBSTForest* forest, uint32_t ref) {
+    while (ref != 0) {
+        ForestNode* node = forestNode(forest, ref);
+        uint32_t right = node->right;
+        
+        releaseForestNodes(forest, node->left);
+        node->right = forest->freeNodes;
+        forest->freeNodes = ref;
+        ref = right;
+    }
+}
+
+/*
+Frees the tree with the handle: its nodes go back to the arena and the handle can be handed out again.
+
+Time Complexity: O(N) for a tree of N keys
+*/
+void freeForestTree(RBSTForest* forest, uint32_t tree) {
+    releaseForestNodes(forest, forest->roots[tree]);
+    forest->roots[tree] = FOREST_FREE_TREE | forest->freeTrees;
+    forest->freeTrees = tree;
+}
+
+// Calls fn(tree, size, ctx) for every live tree of the forest, in handle order.
+void forEachForestTree(RBSTForest* forest, void (*fn)(uint32_t tree, int size, void* ctx), void* ctx) {
+    for (uint32_t tree = 0; tree < forest->numTrees; tree++) {
+        if ((forest->roots[tree] & FOREST_FREE_TREE) == 0) {
+            fn(tree, forestSize(forest, forest->roots[tree]), ctx);
+        }
+    }
+}
+
+// Helper function for calling fn(key, ctx) on every key of the subtree, in inorder.
+void forEachForestKeyHelper(RBSTForest* forest, uint32_t ref, void (*fn)(int key, void* ctx), void* ctx) {
+    while (ref != 0) {
+        ForestNode* node = forestNode(forest, ref);
+        
+        forEachForestKeyHelper(forest, node->left, fn, ctx);
+        fn(node->key, ctx);
+        ref = node->right;
+    }
+}
+
+// Calls fn(key, ctx) on every key of the tree with the handle, in sorted order.
+void forEachForestKey(RBSTForest* forest, uint32_t tree, void (*fn)(int key, void* ctx), void* ctx) {
+    forEachForestKeyHelper(forest, forest->roots[tree], fn, ctx);
+}
+
+// Returns the number of bytes the forest has allocated: its slabs, tree headers and scratch space.
+size_t forestMemory(RBSTForest* forest) {
+    return sizeof(RBSTForest) + (size_t) forest->numSlabs * FOREST_SLAB_NODES * sizeof(ForestNode) + 
+           forest->slabsCapacity * sizeof(ForestNode*) + forest->rootsCapacity * sizeof(uint32_t) + 
+           forest->rebuildCapacity * sizeof(uint32_t);
+}
+
+// Frees the forest and every tree in it.
+void freeForest(RBSTForest* forest) {
+    for (uint32_t i = 0; i < forest->numSlabs; i++) {
+        free(forest->slabs[i]);
+    }
+    free(forest->slabs);
+    free(forest->roots);
+    free(forest->rebuild);
+    free(forest);
+}
+
+/*
+2D range trees for orthogonal range counting and reporting. The primary tree is a randomized BST on x, 
+and every node has an associated randomized BST on y over the points of its subtree, whose nodes hold 
+the y coordinate as key and the x coordinate as value. Inserts take the same random decisions as 
+insertRBST(): the point goes into the associated tree of every node on its path, and a subtree rebuilt 
+with the point at its root gets all its associated trees rebuilt bottom up, merging the children's points 
+by y. The associated trees are stored as bare nodes and updated through a scratch RBST with stable nodes, 
+so their rebuilds keep the x values, and every primary node does not need a whole RBST.
+*/
+
+// Structure for a point of a 2D range tree.
+typedef struct Point2D {
+    int x;
+    int y;
+} Point2D;
+
+// Structure for the nodes of the primary tree.
+typedef struct RangeNode {
+    Point2D point;
+    int size; // Number of points in its subtree.
+    struct RangeNode* left;
+    struct RangeNode* right;
+    TreeNode* ys; // Root of the associated tree: the points of the subtree, keyed by y, with x as value.
+} RangeNode;
+
+// Structure for a 2D range tree.
+typedef struct RangeTree2D {
+    RangeNode* root;
+    RBST scratch; // Takes the root of an associated tree while it is updated, and holds the generator of the whole structure.
+} RangeTree2D;
+
+// Initializes an empty 2D range tree.
+RangeTree2D* initRangeTree() {
+    RangeTree2D* tree = (RangeTree2D*) malloc(sizeof(RangeTree2D));
+    
+    // Check if memory allocation failed.
+    if (tree == NULL) {
+        exit(0);
+    }
+    
+    tree->root = NULL;
+    initScratchRBST(&tree->scratch, NULL, ((uint64_t) rand() << 32) ^ (uint64_t) rand());
+    useStableNodesRBST(&tree->scratch);
+    
+    return tree;
+}
+
+/*
+Helper function for building an associated tree over byY[first..last], which is sorted by y, with a 
+random root like makeRBST().
+
+Time Complexity: O(N)
+*/
+TreeNode* makeAssociated(RangeTree2D* tree, Point2D byY[], int first, int last) {
+    if (last < first) {
+        return NULL;
+    }
+    
+    int index = first + (int) randomBelow(&tree->scratch.rng, (uint32_t) (last - first + 1));
+    TreeNode* newNode = createNode(&tree->scratch, byY[index].y);
+    
+    *handleValue(newNode) = byY[index].x;
+    newNode->left = makeAssociated(tree, byY, first, index - 1);
+    newNode->right = makeAssociated(tree, byY, index + 1, last);
+    updateNode(newNode);
+    
+    return newNode;
+}
+
+/*
+Helper function for building the primary tree over points[first..last], which is sorted by x, with the 
+point at rootIndex at the root, or a random root if rootIndex is -1. Afterwards points[first..last] is 
+sorted by y: the ranges of the two subtrees come back sorted by y and are merged with the root's point, 
+and the associated tree of the node is built from the result. 'merged' is scratch space of the same length.
+
+Time Complexity: O(N*log(N)) (O(N) per level for the merges and associated trees)
+*/
+RangeNode* makeRangeNodes(RangeTree2D* tree, Point2D points[], Point2D merged[], int first, int last, int rootIndex) {
+    if (last < first) {
+        return NULL;
+    }
+    
+    int index = (rootIndex >= 0) ? rootIndex : first + (int) randomBelow(&tree->scratch.rng, (uint32_t) (last - first + 1));
+    RangeNode* newNode = (RangeNode*) malloc(sizeof(RangeNode));
+    
+    // Check if memory allocation failed.
+    if (newNode == NULL) {
+        exit(0);
+    }
+    
+    newNode->point = points[index];
+    newNode->size = last - first + 1;
+    newNode->left = makeRangeNodes(tree, points, merged, first, index - 1, -1);
+    newNode->right = makeRangeNodes(tree, points, merged, index + 1, last, -1);
+    
+    // Merge the left range, the node's point and the right range by y.
+    int left = first;
+    int right = index + 1;
+    bool isPlaced = false;
+    for (int i = first; i <= last; i++) {
+        if (left < index && (isPlaced || points[left].y <= newNode->point.y) && (right > last || points[left].y <= points[right].y)) {
+            merged[i] = points[left++];
+        }
+        else if (!isPlaced && (right > last || newNode->point.y <= points[right].y)) {
+            merged[i] = newNode->point;
+            isPlaced = true;
+        }
+        else {
+            merged[i] = points[right++];
+        }
+    }
+    memcpy(&(points[first]), &(merged[first]), newNode->size * sizeof(Point2D));
+    
+    newNode->ys = makeAssociated(tree, points, first, last);
+    
+    return newNode;
+}
+
+// Helper function for writing the points of the subtree to points[] in inorder, and freeing its nodes.
+void flattenRangeNodes(RangeNode* currentNode, Point2D points[], int* curIndex) {
+    int nodesVisited = 0;
+    
+    while (currentNode != NULL) {
+        RangeNode* right = currentNode->right;
+        
+        flattenRangeNodes(currentNode->left, points, curIndex);
+        points[(*curIndex)++] = currentNode->point;
+        freeRBSTHelper(currentNode->ys, &nodesVisited);
+        free(currentNode);
+        currentNode = right;
+    }
+}
+
+// Compares points by x, for qsort().
+int comparePointsX(const void* a, const void* b) {
+    int x = ((const Point2D*) a)->x;
+    int y = ((const Point2D*) b)->x;
+    
+    return (x > y) - (x < y);
+}
+
+/*
+Rebuilds the subtree with the point added at its root, like reconstructRBST(), and rebuilds all its 
+associated trees.
+
+Time Complexity: O(N*log(N))
+*/
+RangeNode* reconstructRangeTree(RangeTree2D* tree, RangeNode* currentNode, Point2D point) {
+    int length = currentNode->size + 1;
+    Point2D* points = (Point2D*) malloc(length * sizeof(Point2D));
+    Point2D* merged = (Point2D*) malloc(length * sizeof(Point2D));
+    int curIndex = 0;
+    
+    // Check if memory allocation failed.
+    if (points == NULL || merged == NULL) {
+        exit(0);
+    }
+    
+    flattenRangeNodes(currentNode, points, &curIndex);
+    
+    // The point goes after the points with the same x, where insertRangeTree() would have put it.
+    int index = length - 1;
+    while (index > 0 && points[index - 1].x > point.x) {
+        points[index] = points[index - 1];
+        index--;
+    }
+    points[index] = point;
+    
+    RNGBuffer buffer;
+    bool isBuffered = attachRNGBuffer(&tree->scratch.rng, &buffer, length);
+    RangeNode* newRoot = makeRangeNodes(tree, points, merged, 0, length - 1, index);
+    detachRNGBuffer(&tree->scratch.rng, isBuffered);
+    
+    free(merged);
+    free(points);
+    
+    return newRoot;
+}
+
+// Helper function for insertRangeTree() that inserts the point into the subtree and returns its new root.
+RangeNode* insertRangeHelper(RangeTree2D* tree, RangeNode* currentNode, Point2D point) {
+    if (currentNode == NULL) {
+        Point2D single[1] = { point };
+        Point2D merged[1];
+        
+        return makeRangeNodes(tree, single, merged, 0, 0, 0);
+    }
+    
+    // With probability 1/(n+1), rebuild the subtree with the point at its root.
+    if (randomBelow(&tree->scratch.rng, (uint32_t) (currentNode->size + 1)) == 0) {
+        return reconstructRangeTree(tree, currentNode, point);
+    }
+    
+    int nodesVisited = 0;
+    
+    (currentNode->size)++;
+    tree->scratch.root = currentNode->ys;
+    insertHandleRBST(&tree->scratch, point.y, point.x, &nodesVisited);
+    currentNode->ys = tree->scratch.root;
+    tree->scratch.root = NULL;
+    
+    if (point.x < currentNode->point.x) {
+        currentNode->left = insertRangeHelper(tree, currentNode->left, point);
+    }
+    else {
+        currentNode->right = insertRangeHelper(tree, currentNode->right, point);
+    }
+    
+    return currentNode;
+}
+
+/*
+Inserts the point into the range tree.
+
+Time Complexity: Expected O(log(N)^2)
+*/
+void insertRangeTree(RangeTree2D* tree, int x, int y) {
+    Point2D point = { x, y };
+    
+    tree->root = insertRangeHelper(tree, tree->root, point);
+}
+
+/*
+Builds a range tree over n points in any order, with all its associated trees.
+
+Time Complexity: O(N*log(N))
+*/
+RangeTree2D* buildRangeTree(const Point2D points[], int n) {
+    RangeTree2D* tree = initRangeTree();
+    Point2D* sorted = (Point2D*) malloc((n + 1) * sizeof(Point2D));
+    Point2D* merged = (Point2D*) malloc((n + 1) * sizeof(Point2D));
+    
+    // Check if memory allocation failed.
+    if (sorted == NULL || merged == NULL) {
+        exit(0);
+    }
+    
+    memcpy(sorted, points, n * sizeof(Point2D));
+    qsort(sorted, n, sizeof(Point2D), comparePointsX);
+    
+    RNGBuffer buffer;
+    bool isBuffered = attachRNGBuffer(&tree->scratch.rng, &buffer, n);
+    tree->root = makeRangeNodes(tree, sorted, merged, 0, n - 1, -1);
+    detachRNGBuffer(&tree->scratch.rng, isBuffered);
+    
+    free(merged);
+    free(sorted);
+    
+    return tree;
+}
+
+// Returns the number of points of an associated tree with y in [low, high].
+int countAssociated(TreeNode* ys, int low, int high) {
+    return rankInSubtree(ys, high) - ((low == INT_MIN) ? 0 : rankInSubtree(ys, low - 1));
+}
+
+/*
+Helper function for counting the points of the subtree in the rectangle. Equal x coordinates can be on 
+either side of a node, so a node inside [x1, x2] bounds its left subtree by x2 and its right subtree by 
+x1. Once a subtree is inside [x1, x2] on both sides, its associated tree answers for the whole subtree.
+*/
+int countRangeHelper(RangeNode* currentNode, int x1, int x2, int y1, int y2, bool isLowInside, bool isHighInside) {
+    int count = 0;
+    
+    while (currentNode != NULL) {
+        if (isLowInside && isHighInside) {
+            return count + countAssociated(currentNode->ys, y1, y2);
+        }
+        
+        if (!isLowInside && currentNode->point.x < x1) {
+            currentNode = currentNode->right;
+        }
+        else if (!isHighInside && currentNode->point.x > x2) {
+            currentNode = currentNode->left;
+        }
+        else {
+            count += (currentNode->point.y >= y1 && currentNode->point.y <= y2);
+            count += countRangeHelper(currentNode->left, x1, x2, y1, y2, isLowInside, true);
+            currentNode = currentNode->right;
+            isLowInside = true;
+        }
+    }
+    
+    return count;
+}
+
+/*
+Returns the number of points in the rectangle [x1, x2] x [y1, y2].
+
+Time Complexity: Expected O(log(N)^2)
+*/
+int countRangeTree(RangeTree2D* tree, int x1, int x2, int y1, int y2) {
+    if (x2 < x1 || y2 < y1) {
+        return 0;
+    }
+    
+    return countRangeHelper(tree->root, x1, x2, y1, y2, false, false);
+}
+
+// Helper function for writing the points of an associated tree with y in [low, high] to points[], by y.
+void reportAssociated(TreeNode* currentNode, int low, int high, Point2D points[], int* numPoints) {
+    while (currentNode != NULL) {
+        if (currentNode->key < low) {
+            currentNode = currentNode->right;
+        }
+        else if (currentNode->key > high) {
+            currentNode = currentNode->left;
+        }
+        else {
+            reportAssociated(currentNode->left, low, high, points, numPoints);
+            points[*numPoints].x = (int) *handleValue(currentNode);
+            points[*numPoints].y = currentNode->key;
+            (*numPoints)++;
+            currentNode = currentNode->right;
+        }
+    }
+}
+
+// Helper function for reporting the points of the subtree in the rectangle, like countRangeHelper().
+void reportRangeHelper(RangeNode* currentNode, int x1, int x2, int y1, int y2, bool isLowInside, bool isHighInside, 
+                       Point2D points[], int* numPoints) {
+    while (currentNode != NULL) {
+        if (isLowInside && isHighInside) {
+            reportAssociated(currentNode->ys, y1, y2, points, numPoints);
+            return;
+        }
+        
+        if (!isLowInside && currentNode->point.x < x1) {
+            currentNode = currentNode->right;
+        }
+        else if (!isHighInside && currentNode->point.x > x2) {
+            currentNode = currentNode->left;
+        }
+        else {
+            if (currentNode->point.y >= y1 && currentNode->point.y <= y2) {
+                points[(*numPoints)++] = currentNode->point;
+            }
+            reportRangeHelper(currentNode->left, x1, x2, y1, y2, isLowInside, true, points, numPoints);
+            currentNode = currentNode->right;
+            isLowInside = true;
+        }
+    }
+}
+
+/*
+Writes the points in the rectangle [x1, x2] x [y1, y2] to points[], which must have room for 
+countRangeTree() of them, and adds their number to numPoints. The points are grouped by subtree 
+and sorted by y within each group, not sorted overall.
+
+Time Complexity: Expected O(log(N)^2 + K) for K points reported
+*/
+void reportRangeTree(RangeTree2D* tree, int x1, int x2, int y1, int y2, Point2D points[], int* numPoints) {
+    if (x2 < x1 || y2 < y1) {
+        return;
+    }
+    
+    reportRangeHelper(tree->root, x1, x2, y1, y2, false, false, points, numPoints);
+}
+
+// Helper function for freeing the nodes of the subtree and their associated trees.
+void freeRangeNodes(RangeNode* currentNode) {
+    int nodesVisited = 0;
+    
+    while (currentNode != NULL) {
+        RangeNode* right = currentNode->right;
+        
+        freeRangeNodes(currentNode->left);
+        freeRBSTHelper(currentNode->ys, &nodesVisited);
+        free(currentNode);
+        currentNode = right;
+    }
+}
+
+// Frees the range tree and all its associated trees.
+void freeRangeTree(RangeTree2D* tree) {
+    freeRangeNodes(tree->root);
+    free(tree);
+}
+
+
+/*
+Auto-tuning of the thresholds in tuning. A parallel cutoff is set so that the work handed to a new thread 
+or task takes TUNING_PAYOFF times as long as starting it, from the measured cost of a start and the 
+per-node cost of the operation on a tree larger than the last level cache. The background rebuild 
+cutoff is the size of a rebuild that stalls the writer for BACKGROUND_REBUILD_STALL seconds.
+*/
+#define TUNING_PAYOFF 32
+#define TUNING_SAMPLES 16
+#define TUNING_MIN_NODES 32768
+#define TUNING_MAX_NODES 131072
+#define TUNING_FIELDS 6
+
+// Names of the fields of the tuning in tuning files.
+const char* tuningNames[TUNING_FIELDS] = { "shapeThreadCutoff", "parallelFreeCutoff", "parallelDeleteCutoff", 
+                                           "parallelBuildCutoff", "traversalGrain", "backgroundRebuildCutoff" };
+int* const tuningFields[TUNING_FIELDS] = { &tuning.shapeThreadCutoff, &tuning.parallelFreeCutoff, &tuning.parallelDeleteCutoff, 
+                                           &tuning.parallelBuildCutoff, &tuning.traversalGrain, &tuning.backgroundRebuildCutoff };
+
+// Does nothing, for timing thread starts.
+void* idleJob(void* arg) {
+    return arg;
+}
+
+// Does nothing, for timing tasks of the work pool.
+void idleTask(void* ctx, int task) {
+    (void) ctx;
+    (void) task;
+}
+
+// Returns the sum of the keys in the subtree, for timing visits.
+long sumKeys(TreeNode* currentNode) {
+    long sum = 0;
+    
+    while (currentNode != NULL) {
+        sum += currentNode->key + sumKeys(currentNode->left);
+        currentNode = currentNode->right;
+    }
+    
+    return sum;
+}
+
+// Returns the smallest power of two that is at least minimum and at least the number of nodes that take the given seconds.
+int tuneCutoff(double seconds, double secondsPerNode, int minimum) {
+    int cutoff = minimum;
+    
+    while (cutoff < (1 << 24) && cutoff * secondsPerNode < seconds) {
+        cutoff *= 2;
+    }
+    
+    return cutoff;
+}
+
+/*
+Sets the tuning from short measurements on this machine: the cost of starting a thread and a task, and the 
+per-node costs of generating a shape, visiting, rebuilding, batch deleting, freeing and building on a tree of about twice 
+the size of the last level cache. Should be called before other threads use trees, since it changes the tuning.
+
+Time Complexity: O(N*log(N)), for N of at most TUNING_MAX_NODES
+*/
+void calibrateTuning() {
+    long cacheBytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    
+    if (cacheBytes <= 0) {
+        cacheBytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+    
+    long numNodes = (cacheBytes > 0) ? 2 * cacheBytes / (long) sizeof(TreeNode) : TUNING_MIN_NODES;
+    if (numNodes < TUNING_MIN_NODES) {
+        numNodes = TUNING_MIN_NODES;
+    }
+    if (numNodes > TUNING_MAX_NODES) {
+        numNodes = TUNING_MAX_NODES;
+    }
+    
+    RBST* bst = initRBST();
+    uint32_t* shape = (uint32_t*) malloc(numNodes * sizeof(uint32_t));
+    int* keys = (int*) malloc(numNodes / 4 * sizeof(int));
+    int nodesVisited = 0;
+    
+    // Check if memory allocation failed.
+    if (bst == NULL || shape == NULL || keys == NULL) {
+        exit(0);
+    }
+    
+    double start = monotonicSeconds();
+    for (int i = 0; i < TUNING_SAMPLES; i++) {
+        pthread_t thread;
+        
+        if (pthread_create(&thread, NULL, idleJob, NULL) == 0) {
+            pthread_join(thread, NULL);
+        }
+    }
+    double threadSeconds = (monotonicSeconds() - start) / TUNING_SAMPLES;
+    
+    start = monotonicSeconds();
+    runParallelTasks((int) numNodes, idleTask, NULL);
+    double taskSeconds = (monotonicSeconds() - start) / numNodes;
+    
+    // The keys are spread out by a multiplicative hash, the order they are inserted in does not change the shape.
+    for (int i = 0; i < numNodes; i++) {
+        insertRBST(bst, (int) (((uint32_t) i * 2654435761u) >> 1));
+    }
+    
+    ShapeJob job = { &bst->rng, shape, (int) numNodes, (int) numNodes / 2 };
+    start = monotonicSeconds();
+    makeShapeJob(&job);
+    double shapeSeconds = (monotonicSeconds() - start) / numNodes;
+    
+    start = monotonicSeconds();
+    volatile long sum = sumKeys(bst->root);
+    double visitSeconds = (monotonicSeconds() - start) / numNodes;
+    (void) sum;
+    
+    start = monotonicSeconds();
+    setRoot(bst, reconstructRBST(bst, bst->root, createNode(bst, -1), &nodesVisited));
+    double rebuildSeconds = (monotonicSeconds() - start) / (numNodes + 1);
+    
+    // Time the batch delete of a quarter of the keys on this thread alone.
+    int parallelDeleteCutoff = tuning.parallelDeleteCutoff;
+    for (int i = 0; i < numNodes / 4; i++) {
+        keys[i] = (int) (((uint32_t) (4 * i) * 2654435761u) >> 1);
+    }
+    tuning.parallelDeleteCutoff = INT_MAX;
+    start = monotonicSeconds();
+    deleteBatchRBST(bst, keys, (int) numNodes / 4);
+    double deleteSeconds = (monotonicSeconds() - start) / numNodes;
+    tuning.parallelDeleteCutoff = parallelDeleteCutoff;
+    
+    int remaining = sizeRBST(bst);
+    start = monotonicSeconds();
+    freeRBST(bst);
+    double freeSeconds = (monotonicSeconds() - start) / remaining;
+    
+    // Time a build of the deleted keys on this thread alone.
+    qsort(keys, numNodes / 4, sizeof(int), compareKeys);
+    BuildJob build = { initRBST(), keys, 0, (int) numNodes / 4 - 1, 0, 0, NULL };
+    start = monotonicSeconds();
+    buildJob(&build);
+    double buildSeconds = (monotonicSeconds() - start) / (numNodes / 4);
+    build.bst->isSmall = false;
+    setRoot(build.bst, build.root);
+    freeRBST(build.bst);
+    
+    tuning.shapeThreadCutoff = tuneCutoff(TUNING_PAYOFF * threadSeconds, shapeSeconds, 1024);
+    tuning.parallelFreeCutoff = tuneCutoff(TUNING_PAYOFF * threadSeconds, freeSeconds, 1024);
+    tuning.parallelDeleteCutoff = tuneCutoff(TUNING_PAYOFF * threadSeconds, deleteSeconds, 1024);
+    tuning.parallelBuildCutoff = tuneCutoff(TUNING_PAYOFF * threadSeconds, buildSeconds, 1024);
+    tuning.traversalGrain = tuneCutoff(TUNING_PAYOFF * taskSeconds, visitSeconds, 256);
+    tuning.backgroundRebuildCutoff = tuneCutoff(BACKGROUND_REBUILD_STALL, rebuildSeconds, 
+                                                tuneCutoff(TUNING_PAYOFF * threadSeconds, rebuildSeconds, 1024));
+    
+    free(keys);
+    free(shape);
+}
+
+// Writes the tuning to a file, one "name value" line per field. Returns false if the file cannot be written.
+bool saveTuningRBST(const char* path) {
+    FILE* file = fopen(path, "w");
+    bool isWritten = true;
+    
+    if (file == NULL) {
+        return false;
+    }
+    
+    for (int i = 0; i < TUNING_FIELDS; i++) {
+        isWritten = isWritten && fprintf(file, "%s %d\n", tuningNames[i], *(tuningFields[i])) > 0;
+    }
+    
+    return (fclose(file) == 0) && isWritten;
+}
+
+// Sets the tuning from a file written by saveTuningRBST(). Returns false, and leaves the tuning unchanged, unless every field is read.
+bool loadTuningRBST(const char* path) {
+    FILE* file = fopen(path, "r");
+    int values[TUNING_FIELDS];
+    bool isRead[TUNING_FIELDS] = { false };
+    char name[64];
+    int value;
+    
+    if (file == NULL) {
+        return false;
+    }
+    
+    while (fscanf(file, "%63s %d", name, &value) == 2) {
+        for (int i = 0; i < TUNING_FIELDS; i++) {
+            if (strcmp(name, tuningNames[i]) == 0 && value > 0) {
+                values[i] = value;
+                isRead[i] = true;
+            }
+        }
+    }
+    fclose(file);
+    
+    for (int i = 0; i < TUNING_FIELDS; i++) {
+        if (!isRead[i]) {
+            return false;
+        }
+    }
+    for (int i = 0; i < TUNING_FIELDS; i++) {
+        *(tuningFields[i]) = values[i];
+    }
+    
+    return true;
+}
+
+/*
+Configures the tuning for this machine: loads the tuning file at path if it can be read, and otherwise 
+calibrates and writes the file, so the measurements run once per machine. With a NULL path it calibrates 
+every time. Returns true if the tuning was loaded from the file.
+*/
+bool autoTuneRBST(const char* path) {
+    if (path != NULL && loadTuningRBST(path)) {
+        return true;
+    }
+    
+    calibrateTuning();
+    if (path != NULL && !saveTuningRBST(path)) {
+        fprintf(stderr, "Cannot write the tuning file %s\n", path);
+    }
+    
+    return false;
+}
+
+/* 
+Inserts n keys and returns number of nodes visited for all n insertions.It takes an array 
+of n values, and the size n, creates an RBST, uses insertRBST() n times, then frees the rbst. 
+
+Time Complexity: expected/amortized O(Nlog(N)) for insertion, O(N) for freeing. 
+*/
+int testInsertRBST(int n, int* keys) {
+    // Allocate memory for an RBST struct.
+    RBST* bst = initRBST();
+    int temp;
+    int nodesVisited = 0;
+
+    // Check if memory allocation failed.
+    if (bst == NULL) {
+        exit(0);
+    }
+    
+    // Create the keys to add to the bst and iterate over them to add to the RBST.
+    for(int i = 0; i < n; i++) {
+        keys[i] = rand();
+    }
+    
+    /*
+    // For randomizing the elements.
+    for(int i = 0; i < n; i++) {
+        // Select a random index less than n 
+        int k = drand48() * n;
+        // Swap values
+        temp = keys[i];
+        keys[i] = keys[k];
+        keys[k] = temp;
+    }*/
+    
+    for(int i = 0; i < n; i++) {
+        nodesVisited += insertRBST(bst, keys[i]);
+    }
+    
+    int h = height(bst->root); // For testing the height of the tree.
+    printf("Height: %d\n", h);
+    
+    nodesVisited += freeRBST(bst);
+
+    return nodesVisited;
+}
+
+/*Plots the number of elements in the RBST against the nodesVisited to test for 
+  "expected O(Nlog(N))" complexity.The function recieves the number of nodes to add to the 
+  binary search tree, and returns the number of nodes visited in order to complete the process. 
+  These pair of values are used to create the report's graph.
+  */
+int scalingTests(int numElems) {
+    // Allocate memory for an array of integers
+    int* keys = (int*) malloc(numElems * sizeof(int)); // The keys in the BST.
+
+    // Check if memory allocation failed.
+    if (keys == NULL) {
+        return 0;
+    }
+    
+    // Seed drand48 and rand with the current time.
+    srand48(time(NULL));
+    srand(time(NULL));
+    
+    int nodesVisited = testInsertRBST(numElems, keys);
+    
+    free(keys);
+    
+    return nodesVisited;
+}
+
+/*
+Fills queries[] with numQueries ranks in [0, n) drawn from a Zipf distribution with exponent s,
+i.e. rank r is drawn with probability proportional to 1/(r+1)^s. Returns false if malloc fails.
+*/
+bool makeZipfQueries(int n, double s, int numQueries, int* queries) {
+    double* cdf = (double*) malloc(n * sizeof(double)); // Cumulative (unnormalized) probabilities.
+    double total = 0.0;
+
+    if (cdf == NULL) {
+        return false;
+    }
+
+    for (int r = 0; r < n; r++) {
+        total += 1.0 / pow(r + 1, s);
+        cdf[r] = total;
+    }
+
+    // Binary search the first rank whose cumulative probability covers the uniform sample.
+    for (int i = 0; i < numQueries; i++) {
+        double u = drand48() * total;
+        int first = 0;
+        int last = n - 1;
+
+        while (first < last) {
+            int mid = first + (last - first) / 2;
+            if (cdf[mid] < u) {
+                first = mid + 1;
+            }
+            else {
+                last = mid;
+            }
+        }
+        queries[i] = first;
+    }
+
+    free(cdf);
+
+    return true;
+}
+
+/*
+Runs the queries against the tree and prints the average number of nodes visited per search
+and the elapsed time. Returns the total number of nodes visited.
+*/
+int runSearchBenchmark(RBST* bst, const char* label, int* keys, int* queries, int numQueries) {
+    int nodesVisited = 0;
+    clock_t start = clock();
+
+    for (int i = 0; i < numQueries; i++) {
+        searchRBST(bst, keys[queries[i]], &nodesVisited);
+    }
+
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    printf("%-28s avg nodes/search: %6.2f  time: %.3fs  height: %d\n",
+           label, (double) nodesVisited / numQueries, seconds, height(bst->root));
+
+    return nodesVisited;
+}
+
+/*
+Compares the plain tree against the self-adjusting mode on a Zipfian read workload with exponent s,
+and on a uniform workload to check that the self-adjusting mode does not hurt the balanced case.
+Both trees are built from the same keys, and hot ranks are mapped to random keys.
+*/
+void benchZipfSearch(int numElems, int numQueries, double s) {
+    int* keys = (int*) malloc(numElems * sizeof(int));
+    int* queries = (int*) malloc(numQueries * sizeof(int));
+    RBST* plain = initRBST();
+    RBST* adjusting = initRBST();
+
+    // Check if memory allocation failed.
+    if (keys == NULL || queries == NULL || plain == NULL || adjusting == NULL) {
+        exit(0);
+    }
+    adjusting->selfAdjusting = true;
+
+    for (int i = 0; i < numElems; i++) {
+        keys[i] = rand();
+        insertRBST(plain, keys[i]);
+        insertRBST(adjusting, keys[i]);
+    }
+
+    printf("Searching %d keys (Zipf s = %.2f) in a BST of %d elements...\n", numQueries, s, numElems);
+    if (makeZipfQueries(numElems, s, numQueries, queries)) {
+        runSearchBenchmark(plain, "Plain (Zipf):", keys, queries, numQueries);
+        runSearchBenchmark(adjusting, "Self-adjusting (Zipf):", keys, queries, numQueries);
+    }
+
+    // Uniform access afterwards: the self-adjusting tree should stay close to the plain tree.
+    for (int i = 0; i < numQueries; i++) {
+        queries[i] = (int) (drand48() * numElems);
+    }
+    runSearchBenchmark(plain, "Plain (uniform):", keys, queries, numQueries);
+    runSearchBenchmark(adjusting, "Self-adjusting (uniform):", keys, queries, numQueries);
+
+    freeRBST(plain);
+    freeRBST(adjusting);
+    free(queries);
+    free(keys);
+}
+
+/*
+Times numElems insertions of the same keys with the default rebuild, and with the 
+shape-then-fill rebuild (see reconstructShapeFirstRBST()), and prints both.
+*/
+void benchRebuildModes(int numElems) {
+    int* keys = (int*) malloc(numElems * sizeof(int));
+    
+    // Check if memory allocation failed.
+    if (keys == NULL) {
+        exit(0);
+    }
+    
+    for (int i = 0; i < numElems; i++) {
+        keys[i] = rand();
+    }
+    
+    const char* labels[3] = { "Default rebuild:", "Shape-then-fill rebuild:", "Stable-node rebuild:" };
+    
+    for (int mode = 0; mode < 3; mode++) {
+        RBST* bst = initRBST();
+        int nodesVisited = 0;
+        bst->shapeFirstRebuild = (mode == 1);
+        if (mode == 2) {
+            useStableNodesRBST(bst);
+        }
+        
+        clock_t start = clock();
+        for (int i = 0; i < numElems; i++) {
+            nodesVisited += insertRBST(bst, keys[i]);
+        }
+        double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+        
+        printf("%-28s nodes visited: %d  time: %.3fs  height: %d\n", 
+               labels[mode], nodesVisited, seconds, height(bst->root));
+        freeRBST(bst);
+    }
+    
+    free(keys);
+}
+
+// Returns a tree with numElems random keys, allocated from an arena if useArena is true.
+RBST* makeRandomRBST(int numElems, bool useArena) {
+    RBST* bst = initRBST();
+    
+    // Check if memory allocation failed.
+    if (bst == NULL || (useArena && !useArenaRBST(bst))) {
+        exit(0);
+    }
+    
+    for (int i = 0; i < numElems; i++) {
+        insertRBST(bst, rand());
+    }
+    
+    return bst;
+}
+
+/*
+Times how long the caller waits to release a tree of numElems nodes with freeRBST(), 
+freeRBSTAsync(), and freeRBST() on a tree allocated from an arena.
+*/
+void benchFreeModes(int numElems) {
+    const char* labels[3] = { "freeRBST:", "freeRBSTAsync (caller):", "freeRBST (arena):" };
+    
+    for (int mode = 0; mode < 3; mode++) {
+        RBST* bst = makeRandomRBST(numElems, mode == 2);
+        
+        clock_t start = clock();
+        if (mode == 1) {
+            freeRBSTAsync(bst);
+        }
+        else {
+            freeRBST(bst);
+        }
+        double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+        
+        printf("%-28s time: %.4fs\n", labels[mode], seconds);
+    }
+    
+    waitForAsyncFrees();
+}
+
+// Map and combine functions of the statistics pass in benchParallelReduce().
+long long keyValue(int key, void* ctx) {
+    (void) ctx;
+    return key;
+}
+
+long long addValues(long long left, long long right, void* ctx) {
+    (void) ctx;
+    return left + right;
+}
+
+/*
+Times a statistics pass (the sum of every key) over a tree of numElems keys, 
+serially, with parallelReduce() on the shared work pool and on serialExecutor, and prints the results.
+*/
+void benchParallelReduce(int numElems) {
+    RBST* bst = makeRandomRBST(numElems, false);
+    ReduceJob serialJob = { NULL, NULL, keyValue, addValues, 0, NULL };
+    
+    clock_t start = clock();
+    long long serialSum = reduceRBSTHelper(bst->root, &serialJob, 0);
+    double serialSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    long long parallelSum = parallelReduce(bst, keyValue, addValues, 0, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double parallelSeconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    
+    printf("Serial reduce:               sum: %lld  time: %.4fs\n", serialSum, serialSeconds);
+    printf("Parallel reduce (%d workers): sum: %lld  time: %.4fs (wall)\n", 
+           getWorkPool()->numWorkers, parallelSum, parallelSeconds);
+    
+    // The same traversal with the tree set to run on the calling thread alone.
+    setExecutorRBST(bst, &serialExecutor);
+    double executorStart = monotonicSeconds();
+    long long executorSum = parallelReduce(bst, keyValue, addValues, 0, NULL);
+    printf("Reduce on serialExecutor:    sum: %lld  time: %.4fs (wall)\n", executorSum, monotonicSeconds() - executorStart);
+    
+    freeRBST(bst);
+}
+
+/*
+Replicates a tree of numElems keys to a forked follower process over a pipe, followed by numOps 
+inserts and deletes committed in groups of 1000, and prints whether the replica ended up identical.
+*/
+void benchReplication(int numElems, int numOps) {
+    RBST* leader = makeRandomRBST(numElems, false);
+    int fds[2];
+    int nodesVisited = 0;
+    
+    if (pipe(fds) == -1) {
+        return;
+    }
+    
+    // Flush stdout first, or the follower would print the leader's buffered output again.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        return;
+    }
+    
+    // The follower applies the stream until the leader closes it, then reports its replica.
+    if (pid == 0) {
+        close(fds[1]);
+        ReplicationFollower* follower = initFollower(fds[0]);
+        while (pollFollower(follower)) {
+        }
+        RBST* replica = stopFollower(follower);
+        printf("Follower: %d keys, shape checksum %016llx\n", nodeSize(replica->root), 
+               (unsigned long long) shapeChecksum(replica->root));
+        fflush(stdout);
+        _exit(0);
+    }
+    
+    close(fds[0]);
+    double start = monotonicSeconds();
+    ReplicationLog* log = startReplication(leader, fds[1]);
+    
+    for (int i = 0; log != NULL && i < numOps; i++) {
+        if (i % 4 == 3) {
+            replicatedDelete(log, leader, rand() % 1000, &nodesVisited);
+        }
+        else {
+            replicatedInsert(log, leader, rand() % 1000);
+        }
+        if (i % 1000 == 999) {
+            commitReplication(log);
+        }
+    }
+    if (log != NULL) {
+        stopReplication(log);
+    }
+    double seconds = monotonicSeconds() - start;
+    
+    waitpid(pid, NULL, 0);
+    printf("Leader:   %d keys, shape checksum %016llx (%d operations replicated in %.3fs)\n", 
+           nodeSize(leader->root), (unsigned long long) shapeChecksum(leader->root), numOps, seconds);
+    
+    freeRBST(leader);
+}
+
+// Counts the differences reported by diffRBST() in benchDiff().
+void countDifference(int key, int countA, int countB, void* ctx) {
+    (void) key;
+    (void) countA;
+    (void) countB;
+    (*(int*) ctx)++;
+}
+
+/*
+Builds two trees with the same numElems keys in different orders (so different shapes), changes 
+numChanges keys in the second one, and times diffRBST() on them.
+*/
+void benchDiff(int numElems, int numChanges) {
+    int* keys = (int*) malloc(numElems * sizeof(int));
+    RBST* a = initRBST();
+    RBST* b = initRBST();
+    int nodesVisited = 0;
+    int reported = 0;
+    
+    // Check if memory allocation failed.
+    if (keys == NULL || a == NULL || b == NULL) {
+        exit(0);
+    }
+    
+    useHashingRBST(a);
+    useHashingRBST(b);
+    for (int i = 0; i < numElems; i++) {
+        keys[i] = rand();
+        insertRBST(a, keys[i]);
+    }
+    for (int i = numElems - 1; i >= 0; i--) {
+        insertRBST(b, keys[i]);
+    }
+    
+    // Half of the changes delete a key of the first tree, the other half insert new keys.
+    for (int i = 0; i < numChanges; i++) {
+        if (i % 2 == 0) {
+            deleteRBST(b, keys[rand() % numElems], &nodesVisited);
+        }
+        else {
+            insertRBST(b, rand());
+        }
+    }
+    
+    clock_t start = clock();
+    int numDifferences = diffRBST(a, b, countDifference, &reported);
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    
+    printf("Diff of two trees of %d keys with %d changes: %d differences in %.4fs\n", 
+           numElems, numChanges, numDifferences, seconds);
+    
+    freeRBST(a);
+    freeRBST(b);
+    free(keys);
+}
+
+/*
+Inserts numElems keys into a paged tree in a temporary file with a pool of numFrames pages, reopens it, 
+and searches every key. Prints the time and the number of pages read and written for both phases.
+*/
+void benchPagedRBST(int numElems, int numFrames) {
+    char path[] = "/tmp/rbst_paged_XXXXXX";
+    int* keys = (int*) malloc(numElems * sizeof(int));
+    int fd = mkstemp(path);
+    int nodesVisited = 0;
+    int found = 0;
+    
+    // Check if memory allocation failed.
+    if (keys == NULL || fd == -1) {
+        exit(0);
+    }
+    close(fd);
+    unlink(path);
+    
+    PagedRBST* tree = openPagedRBST(path, numFrames);
+    if (tree == NULL) {
+        return;
+    }
+    
+    clock_t start = clock();
+    for (int i = 0; i < numElems; i++) {
+        keys[i] = rand();
+        nodesVisited += insertPagedRBST(tree, keys[i]);
+    }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    printf("Paged inserts (%d keys, %d frames): %.3fs  pages read: %lld  written: %lld  file pages: %u\n", 
+           numElems, tree->numFrames, seconds, tree->pageReads, tree->pageWrites, tree->header.numPages);
+    closePagedRBST(tree);
+    
+    // Reopen the file, so the searches start with an empty pool.
+    tree = openPagedRBST(path, numFrames);
+    start = clock();
+    for (int i = 0; i < numElems; i++) {
+        found += searchPagedRBST(tree, keys[i], &nodesVisited);
+    }
+    seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    printf("Paged searches after reopening: %d of %d found  %.3fs  pages read: %lld\n", 
+           found, numElems, seconds, tree->pageReads);
+    closePagedRBST(tree);
+    
+    unlink(path);
+    free(keys);
+}
+
+/*
+Saves a random tree of numElems keys to a snapshot in a temporary file and loads it back, printing the 
+time and throughput of both, and whether the loaded tree has the same shape.
+*/
+void benchSnapshot(int numElems) {
+    char path[] = "/tmp/rbst_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    
+    if (fd == -1) {
+        return;
+    }
+    close(fd);
+    
+    RBST* bst = makeRandomRBST(numElems, false);
+    double megabytes = (sizeof(SnapshotHeader) + (double) numElems * sizeof(SnapshotRecord)) / (1 << 20);
+    
+    double start = monotonicSeconds();
+    bool saved = saveRBST(bst, path);
+    double saveSeconds = monotonicSeconds() - start;
+    
+    start = monotonicSeconds();
+    RBST* loaded = saved ? loadRBST(path) : NULL;
+    double loadSeconds = monotonicSeconds() - start;
+    
+    if (loaded == NULL) {
+        printf("Snapshot of %d keys could not be saved or loaded\n", numElems);
+    }
+    else {
+        printf("Snapshot (%s): save %.3fs (%.0f MB/s)  load %.3fs (%.0f MB/s)  same shape: %s\n", 
+               getenv("RBST_NO_IO_URING") == NULL ? "io_uring if available" : "pwrite thread", 
+               saveSeconds, megabytes / saveSeconds, loadSeconds, megabytes / loadSeconds, 
+               shapeChecksum(loaded->root) == shapeChecksum(bst->root) ? "yes" : "no");
+        freeRBST(loaded);
+    }
+    
+    unlink(path);
+    freeRBST(bst);
+}
+
+/*
+Inserts numElems string keys that share a long prefix (like URLs or file paths) into a string-key tree, 
+then searches for every key, and prints the time of both phases.
+*/
+void benchStringKeys(int numElems) {
+    char (*keys)[48] = malloc((size_t) numElems * sizeof(*keys));
+    int nodesVisited = 0;
+    int found = 0;
+    
+    // Check if memory allocation failed.
+    if (keys == NULL) {
+        exit(0);
+    }
+    for (int i = 0; i < numElems; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "https://example.com/users/%010d/profile", rand());
+    }
+    
+    StrRBST* bst = initStrRBST();
+    clock_t start = clock();
+    for (int i = 0; i < numElems; i++) {
+        nodesVisited += insertStrRBST(bst, keys[i], (uint32_t) strlen(keys[i]));
+    }
+    double insertSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    
+    start = clock();
+    for (int i = 0; i < numElems; i++) {
+        found += searchStrRBST(bst, keys[i], (uint32_t) strlen(keys[i]), &nodesVisited);
+    }
+    double searchSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    
+    printf("String keys (%d with a 26-byte common prefix): insert %.3fs  search %.3fs  %d found\n", 
+           numElems, insertSeconds, searchSeconds, found);
+    
+    freeStrRBST(bst);
+    free(keys);
+}
+
+// Helper function for checking that the (double, int64) keys of the subtree are in increasing numeric order.
+bool checkNormalizedOrder(StrNode* currentNode, double* lastValue, int64_t* lastId) {
+    while (currentNode != NULL) {
+        if (!checkNormalizedOrder(currentNode->left, lastValue, lastId)) {
+            return false;
+        }
+        
+        double value = readDoubleKey(currentNode->bytes, 0);
+        int64_t id = readInt64Key(currentNode->bytes, 8);
+        if (value < *lastValue || (value == *lastValue && id < *lastId)) {
+            return false;
+        }
+        *lastValue = value;
+        *lastId = id;
+        currentNode = currentNode->right;
+    }
+    
+    return true;
+}
+
+/*
+Inserts numElems composite (double, int64) keys of mixed signs into a string-key tree through the 
+normalized encoding, then checks that an inorder walk decodes to increasing numeric order.
+*/
+void benchNormalizedKeys(int numElems) {
+    StrRBST* bst = initStrRBST();
+    NormalizedKey key;
+    double lastValue = -INFINITY;
+    int64_t lastId = INT64_MIN;
+    
+    clock_t start = clock();
+    for (int i = 0; i < numElems; i++) {
+        key.length = 0;
+        appendDoubleKey(&key, ((double) rand() - RAND_MAX / 2) / 1000.0);
+        appendInt64Key(&key, (int64_t) rand() - RAND_MAX / 2);
+        insertStrRBST(bst, key.bytes, key.length);
+    }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    
+    printf("Normalized (double, int64) keys: %d inserted in %.3fs  in numeric order: %s\n", numElems, seconds, 
+           checkNormalizedOrder(bst->root, &lastValue, &lastId) ? "yes" : "no");
+    
+    freeStrRBST(bst);
+}
+
+// HTTP status codes, an example of a lookup table that is known at build time.
+static const int httpStatusCodes[] = {
+    100, 101, 102, 103, 200, 201, 202, 203, 204, 205, 206, 207, 208, 226, 300, 301, 302, 303, 304, 305, 
+    307, 308, 400, 401, 402, 403, 404, 405, 406, 407, 408, 409, 410, 411, 412, 413, 414, 415, 416, 417, 
+    418, 421, 422, 423, 424, 425, 426, 428, 429, 431, 451, 500, 501, 502, 503, 504, 505, 506, 507, 508, 
+    510, 511
+};
+static const StaticRBST httpStatusTable = STATIC_RBST(httpStatusCodes);
+
+/*
+Looks up numQueries random codes in the static table of HTTP status codes and in a runtime tree with the 
+same keys, checking that both agree, and prints the time of each.
+*/
+void benchStaticRBST(int numQueries) {
+    RBST* bst = initRBST();
+    int nodesVisited = 0;
+    int foundStatic = 0;
+    int foundRuntime = 0;
+    int mismatches = 0;
+    
+    if (!checkStaticRBST(&httpStatusTable)) {
+        printf("Static table of status codes is not sorted\n");
+    }
+    for (int i = 0; i < httpStatusTable.numKeys; i++) {
+        insertRBST(bst, httpStatusTable.keys[i]);
+    }
+    
+    int* queries = (int*) malloc(numQueries * sizeof(int));
+    
+    // Check if memory allocation failed.
+    if (queries == NULL) {
+        exit(0);
+    }
+    for (int i = 0; i < numQueries; i++) {
+        queries[i] = 100 + rand() % 500;
     }
     
-    TreeNode* newNode;
-    (*nodesVisited)++;
+    clock_t start = clock();
+    for (int i = 0; i < numQueries; i++) {
+        foundStatic += searchStaticRBST(&httpStatusTable, queries[i], &nodesVisited);
+    }
+    double staticSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
     
-    // Add the newNode (the key to insert) as to the root node.
-    if (!isAdded) { 
-        newNode = createNode(bstArr[newNodeIndex]);
-        isAdded = true;
-        
-        newNode->left = makeRBST(bstArr, first, newNodeIndex - 1, newNodeIndex, isAdded, nodesVisited);
-        newNode->right = makeRBST(bstArr, newNodeIndex + 1, last, newNodeIndex, isAdded, nodesVisited);
+    start = clock();
+    for (int i = 0; i < numQueries; i++) {
+        foundRuntime += searchRBST(bst, queries[i], &nodesVisited);
     }
-    // Randomly construct the rest of the subree from the array.
-    else {
-        // Generate a random index between first and last index.
-        int index = first + (rand() % (last - first + 1));
-        
-        newNode = createNode(bstArr[index]);
-        newNode->left = makeRBST(bstArr, first, index - 1, newNodeIndex, isAdded, nodesVisited);
-        newNode->right = makeRBST(bstArr, index + 1, last, newNodeIndex, isAdded, nodesVisited);
+    double runtimeSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    
+    for (int i = 0; i < 1000; i++) {
+        mismatches += rankStaticRBST(&httpStatusTable, queries[i % numQueries]) != rankRBST(bst, queries[i % numQueries]);
+    }
+    
+    printf("Static table (%d keys, %d lookups): %.3fs, runtime tree: %.3fs  found: %d / %d  rank mismatches: %d\n", 
+           httpStatusTable.numKeys, numQueries, staticSeconds, runtimeSeconds, foundStatic, foundRuntime, mismatches);
+    
+    free(queries);
+    freeRBST(bst);
+}
+
+/*
+Builds numTrees trees of keysPerTree keys each, searches every tree for a few keys and frees them, 
+printing the time taken. Trees of up to SMALL_TREE_KEYS keys do this without allocating any nodes.
+*/
+void benchSmallTrees(int numTrees, int keysPerTree) {
+    RBST** trees = (RBST**) malloc(numTrees * sizeof(RBST*));
+    int nodesVisited = 0;
+    int found = 0;
+    
+    // Check if memory allocation failed.
+    if (trees == NULL) {
+        exit(0);
     }
     
-    // Update the size of the subtree rooted at the current node.
-    if (newNode->left != NULL) {
-       newNode->size += newNode->left->size;
+    clock_t start = clock();
+    for (int i = 0; i < numTrees; i++) {
+        trees[i] = initRBST();
+        for (int j = 0; j < keysPerTree; j++) {
+            insertRBST(trees[i], rand() % (4 * keysPerTree));
+        }
     }
-    if (newNode->right != NULL) {
-        newNode->size += newNode->right->size;
+    for (int i = 0; i < numTrees; i++) {
+        for (int j = 0; j < 4; j++) {
+            found += searchRBST(trees[i], rand() % (4 * keysPerTree), &nodesVisited);
+        }
+    }
+    for (int i = 0; i < numTrees; i++) {
+        freeRBST(trees[i]);
     }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
     
-    return newNode;
+    printf("%d trees of %d keys (%s): build, search and free %.3fs  %d found\n", numTrees, keysPerTree, 
+           (keysPerTree <= SMALL_TREE_KEYS) ? "inline" : "nodes", seconds, found);
+    
+    free(trees);
 }
 
-/*
-Helper function for performing an inorder traversal to flatten the RBST in a sorted array.
-Only the value of the keys are sorted, while the nodes are freed.
+// Adds the size of a tree to the total pointed to by ctx.
+void addTreeSize(uint32_t tree, int size, void* ctx) {
+    (void) tree;
+    *((long long*) ctx) += size;
+}
 
-Time Complexity: O(n) (inorder traversal with O(1) work done per node).
+/*
+Creates numTrees trees in a forest and inserts keysPerTree random keys into each (in random tree order), 
+then searches every tree for one of its keys, frees every other tree and fills them again. Prints the 
+time and the memory used per key, next to what separate RBSTs would need.
 */
-void flattenRBST (int bstArr[], TreeNode* newNode, TreeNode* currentNode, int* curIndex, 
-                    int* newNodeIndex, bool* isAdded, int arrLength, int* nodesVisited) {
-    // Check if a leaf node has been proceeded
-    if(currentNode == NULL) {
-        // If the newNode hasnt been added yet and is greater than all other nodes, add it to the end of the array.
-        if(!(*isAdded) && ((*curIndex) == ((arrLength) - 1))) {
-            bstArr[(*curIndex)] = newNode->key;
-            (*newNodeIndex) = (*curIndex);
-            (*curIndex)++;
-        }
-        
-        return;
+void benchForest(int numTrees, int keysPerTree) {
+    RBSTForest* forest = initForest();
+    long long numKeys = (long long) numTrees * keysPerTree;
+    long long counted = 0;
+    int found = 0;
+    
+    for (int i = 0; i < numTrees; i++) {
+        createForestTree(forest);
     }
     
-    // Recursively sort the left subtree.
-    flattenRBST(bstArr, newNode, currentNode->left, curIndex, newNodeIndex, isAdded, arrLength, nodesVisited);
+    clock_t start = clock();
+    for (long long i = 0; i < numKeys; i++) {
+        insertForest(forest, (uint32_t) (rand() % numTrees), rand());
+    }
+    double insertSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
     
-    // If the newNode is less than the currentNode, add it at the correct position, before the currentNode.
-    if(((newNode->key) < (currentNode->key)) && (!(*isAdded))){
-        bstArr[(*curIndex)] = newNode->key;
-        *newNodeIndex = (*curIndex);
-        (*curIndex)++;
-        (*isAdded) = true;
+    for (int i = 0; i < numTrees; i++) {
+        uint32_t root = forest->roots[i];
+        found += (root == 0) || searchForest(forest, (uint32_t) i, forestNode(forest, root)->key);
     }
     
-    (*nodesVisited)++; 
-    bstArr[(*curIndex)] = currentNode->key;
-    (*curIndex)++;
+    // Free and refill half of the trees, which reuses their nodes and handles.
+    for (int i = 0; i < numTrees; i += 2) {
+        freeForestTree(forest, (uint32_t) i);
+    }
+    for (int i = 0; i < numTrees; i += 2) {
+        uint32_t tree = createForestTree(forest);
+        for (int j = 0; j < keysPerTree; j++) {
+            insertForest(forest, tree, rand());
+        }
+    }
+    forEachForestTree(forest, addTreeSize, &counted);
     
-    // Recursively sort the right subtree.
-    flattenRBST(bstArr, newNode, currentNode->right, curIndex, newNodeIndex, isAdded, arrLength, nodesVisited);
+    // Separate trees need an RBST each (inline keys when small, see SMALL_TREE_KEYS) plus a malloc() per node.
+    double separateBytes = (keysPerTree <= SMALL_TREE_KEYS) ? (double) sizeof(RBST) / keysPerTree : 
+                           (double) sizeof(RBST) / keysPerTree + sizeof(TreeNode) + 16;
+    printf("Forest of %d trees, %lld keys: insert %.3fs  %d of %d found  %.1f bytes/key (separate RBSTs: %.1f)\n", 
+           numTrees, counted, insertSeconds, found, numTrees, (double) forestMemory(forest) / counted, separateBytes);
     
-    free(currentNode);
+    freeForest(forest);
 }
 
-/*
-Helper function for flattening a subtree into an array, and reconstructing it with 
-the newNode at the root. Returns the newNode, which contains its new randomized subtree.
+// Adds the key to the sum pointed to by ctx.
+void sumKey(int key, void* ctx) {
+    *((long long*) ctx) += key;
+}
 
-Time Complexity: O(N) (Flatten: O(N) + BST Construction: O(N)) 
-*/
-TreeNode* reconstructRBST(TreeNode* currentNode, TreeNode* newNode, int* nodesVisited) {
-    int arrLength = (currentNode->size) + 1; 
-    int* bstArr = (int*) malloc(arrLength * sizeof(int)); // An array of length: subtree length + 1.
-    int newNodeIndex; // For remembering the newNodeIndex across function calls.
-    int curIndex = 0; // For remembering the current index across function calls.
-    bool isAddedArr = false; // Flag for indicating whether the newNode has been added into the array yet.
-    bool isAddedBST = false; // Flag for indicating whether the newNode has been added into the BST yet.
+// Sums the keys of a random tree with an iterator and with a recursive inorder walk, printing the time of both.
+void benchIterator(int numElems) {
+    RBST* bst = makeRandomRBST(numElems, false);
+    long long iteratorSum = 0;
+    long long recursiveSum = 0;
     
-    // Flatten the BST into a sorted array.
-    flattenRBST(bstArr, newNode, currentNode, &curIndex, &newNodeIndex, &isAddedArr, arrLength, nodesVisited);
-    free(newNode);
+    useLinkedNodesRBST(bst);
+    clock_t start = clock();
+    for (RBSTIterator it = beginRBST(bst); iterValid(&it); iterNext(&it)) {
+        iteratorSum += iterKey(&it);
+    }
+    double iteratorSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
     
-    // Rebuild the subtree from the array, with the newNode at the root.
-    newNode = makeRBST(bstArr, 0, (arrLength - 1), newNodeIndex, isAddedBST, nodesVisited);    
+    start = clock();
+    forEachRBSTHelper(bst->root, sumKey, &recursiveSum);
+    double recursiveSeconds = (double) (clock() - start) / CLOCKS_PER_SEC;
     
-    free(bstArr);
+    printf("Inorder sum of %d keys: iterator %.3fs, recursive walk %.3fs  sums equal: %s\n", numElems, 
+           iteratorSeconds, recursiveSeconds, (iteratorSum == recursiveSum) ? "yes" : "no");
     
-    return newNode;
+    freeRBST(bst);
 }
 
 /*
-Helper function for insertRBST() that is suitable for recursion and keeping track of nodesVisited.
-3 Possibilites for insertion: 
-- The newNode becomes the root node, if the tree is empty. 
-- The newNode becomes the root of the current subtree with probability 1/n, this involves rebuilding its subtree. 
-- Recurses the left or right subtree depending on where the newNode belongs (ordering property of the BST). 
-Returns a tree that includes the added node. 
-
-Time Complexity: Worst case - O(N) (If the entire tree is reconstructed), 
-Expected (Amortized) case - O(log(N)) (Inserts element at end of tree rather than reconstructing at all) 
+Inserts numElems random keys with synchronous and with background rebuilds, and reports the total time, 
+the longest single insert and whether both trees end up with the same keys.
 */
-TreeNode* insertRBSTHelper(TreeNode* currentNode, TreeNode* newNode, int* nodesVisited) {
-    // Check if the tree or node is empty
-    if (currentNode == NULL) {
-        return newNode; 
-    }
-    
-    (*nodesVisited)++;
+void benchBackgroundRebuild(int numElems) {
+    const char* labels[2] = { "Synchronous rebuilds:", "Background rebuilds:" };
+    uint64_t hashes[2];
     
-    // With probability 1/(n+1), construct a new subtree with the new node in the root
-    if (drand48() < (1.0 / ((currentNode->size) + 1))) {
-        TreeNode* reconstructedSubtree = reconstructRBST(currentNode, newNode, nodesVisited);
+    for (int mode = 0; mode < 2; mode++) {
+        RBST* bst = initRBST();
+        double longest = 0.0;
+        if (mode == 1) {
+            useBackgroundRebuildRBST(bst);
+        }
         
-        return reconstructedSubtree;
-    }
-    
-    (currentNode->size)++;
-    
-    // Else If the current node's key is less than the current node's key, recursively search the left substree.
-    if ((newNode->key) < (currentNode->key)) {
-        currentNode->left = insertRBSTHelper(currentNode->left, newNode, nodesVisited);
-    }
-    else {
-        currentNode->right = insertRBSTHelper(currentNode->right, newNode, nodesVisited);
+        srand(1);
+        double start = monotonicSeconds();
+        for (int i = 0; i < numElems; i++) {
+            double insertStart = monotonicSeconds();
+            insertRBST(bst, rand());
+            double seconds = monotonicSeconds() - insertStart;
+            
+            if (seconds > longest) {
+                longest = seconds;
+            }
+        }
+        double seconds = monotonicSeconds() - start;
+        
+        hashes[mode] = rangeHashRBST(bst, INT_MIN, INT_MAX);
+        printf("%-28s time: %.3fs  longest insert: %.2fms\n", labels[mode], seconds, longest * 1000);
+        freeRBST(bst);
     }
     
-    return currentNode;
+    printf("Same keys: %s\n", (hashes[0] == hashes[1]) ? "yes" : "no");
 }
 
 /*
-The function takes an RBST and a key to insert. It uses insertRBSTHelper()
-to insert a node containing the given key and returns number of nodes visited.
-
-Time Complexity: Worst case - O(N), Expected (Amortized) - O(log(N))
+Deletes numDeletes random keys from a tree of numElems random keys, one deleteRBST() call per key 
+and with one deleteBatchRBST() call, and reports the times and the number of keys removed.
 */
-int insertRBST(RBST* bst, int key) { 
-    TreeNode* newNode;
-    int nodesVisited = 0;
+void benchDeleteBatch(int numElems, int numDeletes) {
+    int* keys = (int*) malloc(numDeletes * sizeof(int));
     
-    // Allocate memory for the node to be created.
-    newNode = createNode(key);
-    nodesVisited++;
+    // Check if memory allocation failed.
+    if (keys == NULL) {
+        exit(0);
+    }
     
-    // If the tree is empty, make the newNode the root.
-    if (bst->root == NULL) {
-        bst->root = newNode;
+    for (int mode = 0; mode < 2; mode++) {
+        srand(1);
+        RBST* bst = makeRandomRBST(numElems, false);
+        int removed = 0;
         
-        return nodesVisited;
+        // Delete keys that are in the tree: the first numDeletes keys that were inserted.
+        srand(1);
+        for (int i = 0; i < numDeletes; i++) {
+            keys[i] = rand();
+        }
+        
+        double start = monotonicSeconds();
+        if (mode == 0) {
+            for (int i = 0; i < numDeletes; i++) {
+                int nodesVisited = 0;
+                removed += deleteRBST(bst, keys[i], &nodesVisited);
+            }
+        }
+        else {
+            removed = deleteBatchRBST(bst, keys, numDeletes);
+        }
+        double seconds = monotonicSeconds() - start;
+        
+        printf("%-28s removed: %d  time: %.3fs\n", (mode == 0) ? "deleteRBST per key:" : "deleteBatchRBST:", removed, seconds);
+        freeRBST(bst);
     }
-
-    bst->root = insertRBSTHelper(bst->root, newNode, &nodesVisited);
     
-    return nodesVisited;
+    free(keys);
 }
 
 /*
-Helper function for freeRBST() that uses recursion to free nodes while keeping track of nodesVisited.
+Ranks numQueries sorted random keys in a tree of numElems random keys, with one rankRBST() call per key 
+and with one rankBatchRBST() call, and reports the times and whether the ranks agree.
 */
-void freeRBSTHelper(TreeNode* currentNode, int* nodesVisited) {
-    if (currentNode == NULL) 
-        return;
-    (*nodesVisited)++;
-    freeRBSTHelper(currentNode->left, nodesVisited);
-    freeRBSTHelper(currentNode->right, nodesVisited);
-    free(currentNode);
+void benchRankBatch(int numElems, int numQueries) {
+    RBST* bst = makeRandomRBST(numElems, false);
+    int* keys = (int*) malloc(numQueries * sizeof(int));
+    int* ranks = (int*) malloc(numQueries * sizeof(int));
+    int nodesVisited = 0;
+    bool isEqual = true;
+    
+    // Check if memory allocation failed.
+    if (keys == NULL || ranks == NULL) {
+        exit(0);
+    }
+    
+    for (int i = 0; i < numQueries; i++) {
+        keys[i] = rand();
+    }
+    qsort(keys, numQueries, sizeof(int), compareKeys);
+    
+    double start = monotonicSeconds();
+    rankBatchRBST(bst, keys, numQueries, ranks, &nodesVisited);
+    double batchSeconds = monotonicSeconds() - start;
+    
+    start = monotonicSeconds();
+    for (int i = 0; i < numQueries; i++) {
+        isEqual = isEqual && (rankRBST(bst, keys[i]) == ranks[i]);
+    }
+    double singleSeconds = monotonicSeconds() - start;
+    
+    printf("Rank of %d sorted keys: rankRBST per key %.3fs, rankBatchRBST %.3fs (%d nodes visited)  ranks equal: %s\n", 
+           numQueries, singleSeconds, batchSeconds, nodesVisited, isEqual ? "yes" : "no");
+    
+    free(ranks);
+    free(keys);
+    freeRBST(bst);
 }
 
 /*
-Frees entire tree and returns number of nodes visited in O(N) time.
+Encodes a tree of numElems random keys with encodeSuccinctRBST(), and reports the bits per node of the 
+parentheses with their directories and of the packed keys, and the time of numQueries searches and ranks 
+on the tree and on the encoding, and whether they agree.
 */
-int freeRBST(RBST* bst) {
+void benchSuccinct(int numElems, int numQueries) {
+    RBST* bst = makeRandomRBST(numElems, false);
+    SuccinctRBST* tree = encodeSuccinctRBST(bst);
+    int* keys = (int*) malloc(numQueries * sizeof(int));
     int nodesVisited = 0;
+    long checksum = 0;
+    bool isEqual = true;
     
-    // Free the tree
-    freeRBSTHelper(bst->root, &nodesVisited);
-    free(bst);
+    // Check if memory allocation failed.
+    if (keys == NULL) {
+        exit(0);
+    }
     
-    return nodesVisited;
+    for (int i = 0; i < numQueries; i++) {
+        keys[i] = rand();
+    }
+    
+    double start = monotonicSeconds();
+    for (int i = 0; i < numQueries; i++) {
+        checksum += searchRBST(bst, keys[i], &nodesVisited) + rankRBST(bst, keys[i]);
+    }
+    double treeSeconds = monotonicSeconds() - start;
+    
+    start = monotonicSeconds();
+    for (int i = 0; i < numQueries; i++) {
+        checksum -= searchSuccinctRBST(tree, keys[i], &nodesVisited) + rankSuccinctRBST(tree, keys[i]);
+    }
+    double succinctSeconds = monotonicSeconds() - start;
+    
+    for (int i = 0; i < numQueries && isEqual; i++) {
+        isEqual = (searchRBST(bst, keys[i], &nodesVisited) == searchSuccinctRBST(tree, keys[i], &nodesVisited)) && 
+                  (rankRBST(bst, keys[i]) == rankSuccinctRBST(tree, keys[i]));
+    }
+    
+    size_t keyBytes = (((size_t) tree->numNodes * tree->keyBits) / 64 + 2) * sizeof(uint64_t);
+    printf("Succinct encoding of %d nodes: %.2f bits per node for the shape, %.2f for the keys (TreeNode: %d)\n", 
+           numElems, 8.0 * (succinctMemory(tree) - keyBytes) / numElems, 8.0 * keyBytes / numElems, (int) (8 * sizeof(TreeNode)));
+    printf("%d searches and ranks: RBST %.3fs, SuccinctRBST %.3fs  results equal: %s\n", 
+           numQueries, treeSeconds, succinctSeconds, (isEqual && checksum == 0) ? "yes" : "no");
+    
+    free(keys);
+    freeSuccinctRBST(tree);
+    freeRBST(bst);
 }
 
-/* 
-Inserts n keys and returns number of nodes visited for all n insertions.It takes an array 
-of n values, and the size n, creates an RBST, uses insertRBST() n times, then frees the rbst. 
-
-Time Complexity: expected/amortized O(Nlog(N)) for insertion, O(N) for freeing. 
+/*
+Builds a tree of numElems sorted random keys with insertRBST() per key and with buildRBST(), and checks 
+that a serial build from the same seed (buildJob() without threads) gives the same shape.
 */
-int testInsertRBST(int n, int* keys) {
-    // Allocate memory for an RBST struct.
-    RBST* bst = initRBST();
-    int temp;
-    int nodesVisited = 0;
-
+void benchBuild(int numElems) {
+    int* keys = (int*) malloc(numElems * sizeof(int));
+    uint32_t* shape = (uint32_t*) malloc(numElems * sizeof(uint32_t));
+    uint32_t* serialShape = (uint32_t*) malloc(numElems * sizeof(uint32_t));
+    RBST* inserted = initRBST();
+    RBST* built = initRBST();
+    RBST* serial = initRBST();
+    int preIndex = 0;
+    int serialIndex = 0;
+    
     // Check if memory allocation failed.
-    if (bst == NULL) {
+    if (keys == NULL || shape == NULL || serialShape == NULL) {
         exit(0);
     }
     
-    // Create the keys to add to the bst and iterate over them to add to the RBST.
-    for(int i = 0; i < n; i++) {
+    for (int i = 0; i < numElems; i++) {
         keys[i] = rand();
     }
+    qsort(keys, numElems, sizeof(int), compareKeys);
     
-    /*
-    // For randomizing the elements.
-    for(int i = 0; i < n; i++) {
-        // Select a random index less than n 
-        int k = drand48() * n;
-        // Swap values
-        temp = keys[i];
-        keys[i] = keys[k];
-        keys[k] = temp;
-    }*/
-    
-    for(int i = 0; i < n; i++) {
-        nodesVisited += insertRBST(bst, keys[i]);
+    double start = monotonicSeconds();
+    for (int i = 0; i < numElems; i++) {
+        insertRBST(inserted, keys[i]);
     }
+    double insertSeconds = monotonicSeconds() - start;
     
-    int h = height(bst->root); // For testing the height of the tree.
-    printf("Height: %d\n", h);
+    start = monotonicSeconds();
+    buildRBST(built, keys, numElems, 42);
+    double buildSeconds = monotonicSeconds() - start;
     
-    nodesVisited += freeRBST(bst);
-
-    return nodesVisited;
+    BuildJob job = { serial, keys, 0, numElems - 1, 42, 0, NULL };
+    buildJob(&job);
+    serial->isSmall = false;
+    setRoot(serial, job.root);
+    
+    collectShape(built->root, shape, &preIndex);
+    collectShape(serial->root, serialShape, &serialIndex);
+    
+    printf("Building %d sorted keys: insertRBST per key %.3fs, buildRBST %.3fs  same shape as a serial build: %s\n", 
+           numElems, insertSeconds, buildSeconds, 
+           (preIndex == serialIndex && memcmp(shape, serialShape, preIndex * sizeof(uint32_t)) == 0) ? "yes" : "no");
+    
+    freeRBST(inserted);
+    freeRBST(built);
+    freeRBST(serial);
+    free(serialShape);
+    free(shape);
+    free(keys);
 }
 
-/*Plots the number of elements in the RBST against the nodesVisited to test for 
-  "expected O(Nlog(N))" complexity.The function recieves the number of nodes to add to the 
-  binary search tree, and returns the number of nodes visited in order to complete the process. 
-  These pair of values are used to create the report's graph.
-  */
-int scalingTests(int numElems) {
-    // Allocate memory for an array of integers
-    int* keys = (int*) malloc(numElems * sizeof(int)); // The keys in the BST.
-
+/*
+Inserts numPoints random points into a 2D range tree, and counts the points in numQueries random 
+rectangles with countRangeTree() and with a linear filter over the points, reporting both times.
+*/
+void benchRangeTree(int numPoints, int numQueries) {
+    Point2D* points = (Point2D*) malloc(numPoints * sizeof(Point2D));
+    RangeTree2D* tree = initRangeTree();
+    long long treeCount = 0;
+    long long linearCount = 0;
+    
     // Check if memory allocation failed.
-    if (keys == NULL) {
-        return 0;
+    if (points == NULL) {
+        exit(0);
     }
     
-    // Seed drand48 and rand with the current time.
-    srand48(time(NULL));
-    srand(time(NULL));
+    double start = monotonicSeconds();
+    for (int i = 0; i < numPoints; i++) {
+        points[i].x = rand();
+        points[i].y = rand();
+        insertRangeTree(tree, points[i].x, points[i].y);
+    }
+    double insertSeconds = monotonicSeconds() - start;
     
-    int nodesVisited = testInsertRBST(numElems, keys);
+    double treeSeconds = 0;
+    double linearSeconds = 0;
+    for (int q = 0; q < numQueries; q++) {
+        int x1 = rand();
+        int y1 = rand();
+        // The upper bounds are computed in long long and clamped, since the sums can overflow an int.
+        long long x2Sum = (long long) x1 + rand() % (RAND_MAX / 10);
+        long long y2Sum = (long long) y1 + rand() % (RAND_MAX / 10);
+        int x2 = (int) ((x2Sum < INT_MAX) ? x2Sum : INT_MAX);
+        int y2 = (int) ((y2Sum < INT_MAX) ? y2Sum : INT_MAX);
+        
+        start = monotonicSeconds();
+        treeCount += countRangeTree(tree, x1, x2, y1, y2);
+        treeSeconds += monotonicSeconds() - start;
+        
+        start = monotonicSeconds();
+        for (int i = 0; i < numPoints; i++) {
+            linearCount += (points[i].x >= x1 && points[i].x <= x2 && points[i].y >= y1 && points[i].y <= y2);
+        }
+        linearSeconds += monotonicSeconds() - start;
+    }
     
-    free(keys);
+    printf("2D range tree of %d points: inserts %.3fs, %d counts %.4fs, linear filter %.3fs  counts equal: %s\n", 
+           numPoints, insertSeconds, numQueries, treeSeconds, linearSeconds, (treeCount == linearCount) ? "yes" : "no");
     
-    return nodesVisited;
+    freeRangeTree(tree);
+    free(points);
 }
 
-int main()
+/*
+Without arguments, runs the benchmarks. With arguments, runs the key-value service or its load generator:
+  rbst server <address>
+  rbst loadgen <address> [connections] [requests] [depth]
+where <address> is a Unix socket path or "tcp:<port>" for loopback TCP.
+*/
+int main(int argc, char** argv)
 {
+    if (argc >= 3 && strcmp(argv[1], "server") == 0) {
+        RBST* bst = initRBST();
+        
+        if (!runServer(bst, argv[2])) {
+            fprintf(stderr, "Cannot listen on %s\n", argv[2]);
+            return 1;
+        }
+        freeRBST(bst);
+        
+        return 0;
+    }
+    if (argc >= 3 && strcmp(argv[1], "loadgen") == 0) {
+        int connections = (argc > 3) ? atoi(argv[3]) : 16;
+        int requests = (argc > 4) ? atoi(argv[4]) : 1000000;
+        int depth = (argc > 5) ? atoi(argv[5]) : 32;
+        
+        if (connections <= 0 || requests <= 0 || depth <= 0) {
+            fprintf(stderr, "Usage: %s loadgen <address> [connections] [requests] [depth], with positive counts\n", argv[0]);
+            return 1;
+        }
+        
+        return runLoadGenerator(argv[2], connections, requests, depth) ? 0 : 1;
+    }
+    
+    if (argc >= 3 && strcmp(argv[1], "tune") == 0) {
+        calibrateTuning();
+        
+        return saveTuningRBST(argv[2]) ? 0 : 1;
+    }
+    
     int numElems = 1000000;
     int nodesVisited;
+    bool isTuningLoaded = autoTuneRBST(getenv("RBST_TUNING_FILE"));
+    
+    printf("Tuning (%s): shape thread cutoff %d, parallel free cutoff %d, parallel delete cutoff %d, "
+           "parallel build cutoff %d, traversal grain %d, background rebuild cutoff %d\n", isTuningLoaded ? "loaded" : "calibrated", 
+           tuning.shapeThreadCutoff, tuning.parallelFreeCutoff, tuning.parallelDeleteCutoff, tuning.parallelBuildCutoff, 
+           tuning.traversalGrain, tuning.backgroundRebuildCutoff);
     
     printf("Inserting %d elements in a BST...\n", numElems);
     nodesVisited = scalingTests(numElems);
     printf("Nodes visited: %d\n", nodesVisited);
     
+    benchZipfSearch(numElems / 5, numElems, 1.0);
+    benchRebuildModes(numElems / 5);
+    benchFreeModes(numElems);
+    benchParallelReduce(numElems);
+    benchReplication(numElems / 10, numElems);
+    benchDiff(numElems, 100);
+    benchPagedRBST(numElems / 5, PAGED_POOL_FRAMES);
+    benchSnapshot(numElems);
+    benchStringKeys(numElems / 2);
+    benchNormalizedKeys(numElems / 2);
+    benchStaticRBST(numElems * 10);
+    benchSmallTrees(numElems / 10, SMALL_TREE_KEYS / 2);
+    benchSmallTrees(numElems / 10, SMALL_TREE_KEYS * 2);
+    benchForest(numElems, 8);
+    benchIterator(numElems);
+    benchBackgroundRebuild(numElems);
+    benchDeleteBatch(numElems, numElems / 10);
+    benchRankBatch(numElems, numElems);
+    benchSuccinct(numElems, numElems / 10);
+    benchBuild(numElems);
+    benchRangeTree(numElems / 50, 1000);
+    
+    waitForAsyncFrees();
+
     return 0;
 }
\ No newline at end of file